@@ -133,6 +133,16 @@ const Compzilla = {
       	  	windowStack.showingDesktop = (d1 == 1);
 		        break;
   	    }
+	    },
+
+	    frameBegin: function (frame) {
+	    },
+
+	    frameEnd: function (frame) {
+	    },
+
+	    fullscreenBypass: function (win, enabled) {
+	      Debug ("Fullscreen bypass " + (enabled ? "on" : "off") + " for window " + win.nativeWindowId);
 	    }
     });
 
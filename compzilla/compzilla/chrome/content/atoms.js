@@ -5,17 +5,32 @@ var Atoms = {
     svc: Components.classes['@pyrodesktop.org/compzillaService;1'].getService(
 	     Components.interfaces.compzillaIControl),
 
+    // Names waiting to be interned, and the atoms interned so far.  All
+    // pending names are interned together when the first one is used.
+    _pending: [],
+    _values: {},
+
     Intern: function (atom_name) {
-	var cache = null;
+	this._pending.push (atom_name);
 	this.__defineGetter__ (atom_name,
 			       function () {
-				   if (cache == null) {
-				       cache = this.svc.InternAtom (atom_name);
+				   if (!(atom_name in this._values)) {
+				       this._internPending ();
 				   }
-				   return cache;
+				   return this._values[atom_name];
 			       });
     },
 
+    _internPending: function () {
+	var names = this._pending;
+	this._pending = [];
+
+	var values = this.svc.InternAtoms (names.length, names, {});
+	for (var i = 0; i < names.length; i++) {
+	    this._values[names[i]] = values[i];
+	}
+    },
+
     /* constant atoms */
     get XA_PRIMARY ()             { return 1; },
     get XA_SECONDARY ()           { return 2; },
@@ -21,6 +21,8 @@ function CompzillaWindowContent (nativewin) {
     _addUtilMethods (content);
     _addContentMethods (content);
 
+    // No prefetch needed here: the window fetched the properties the frame
+    // reads when it was created, and only WM_CLASS is still read as a bag.
     content._xprops = new XProps (nativewin);
 
     return content;
@@ -48,18 +50,18 @@ var ContentMethods = {
     },
 
     onmoveresize: function (overrideRedirect) {
-	// at the very least we need to make sure we update our
-	// width/height to the right size, or the resize will scale
-	// us.
-	this.width = this.offsetWidth;
-	this.height = this.offsetHeight;
+	// the canvas keeps its old width/height, scaled to our new
+	// size, until the window's pixmap for the new size arrives.
+	// the compositor resizes it then, once per frame.
+	var width = this.offsetWidth;
+	var height = this.offsetHeight;
 
 	// that's it for override redirect windows
 	if (overrideRedirect)
 	    return;
 
 	// 0-sized dimentions will generate X error
-	if (this.width <= 0 || this.height <= 0)
+	if (width <= 0 || height <= 0)
 	    return;
 
         var pos = this.getPosition();
@@ -68,14 +70,14 @@ var ContentMethods = {
               this._nativewin.nativeWindowId + ", x=" +
               pos.left + ", y=" +
               pos.top + ", width=" +
-              this.width + ", height=" +
-              this.height);
+              width + ", height=" +
+              height);
 
         svc.Configure (this._nativewin.nativeWindowId,
 		       pos.left,
 		       pos.top,
-		       this.width,
-		       this.height,
+		       width,
+		       height,
 		       0);
     },
 
@@ -156,11 +158,11 @@ function _addContentMethods (content) {
     content.addProperty ("wmName",
 			 /* getter */
 			 function () {
-			     var name = this.getNativeProperty (Atoms._NET_WM_NAME);
+			     var name = this._nativewin.GetTextProperty (Atoms._NET_WM_NAME);
 
 			     // fall back to XA_WM_NAME if _NET_WM_NAME is undefined.
 			     if (name == null)
-				 name = this.getNativeProperty (Atoms.XA_WM_NAME);
+				 name = this._nativewin.GetTextProperty (Atoms.XA_WM_NAME);
 
 			     return name;
 			 });
@@ -168,37 +170,38 @@ function _addContentMethods (content) {
     content.addProperty ("wmIconName",
 			 /* getter */
 			 function () {
-			     var name = this.getNativeProperty (Atoms._NET_WM_ICON_NAME);
+			     var name = this._nativewin.GetTextProperty (Atoms._NET_WM_ICON_NAME);
 
 			     // fall back to XA_WM_ICON_NAME if _NET isn't set.
 			     if (name == null)
-				 name = this.getNativeProperty (Atoms.XA_WM_ICON_NAME);
+				 name = this._nativewin.GetTextProperty (Atoms.XA_WM_ICON_NAME);
 
 			     return name;
 			 });
 
-    content.addProperty ("wmIcon",
-			 /* getter */
-			 function () {
-			     var data = this.getNativeProperty (Atoms._NET_WM_ICON);
-
-			     // FIXME: fall back to WMhints if _NET isn't set.
-
-			     return data;
-			 });
-
     content.addProperty ("wmStruts",
 			 /* getter */
 			 function () {
-			     var struts = null;
-			     try {
-			     	 struts = this.getNativeProperty (Atoms._NET_WM_STRUT_PARTIAL);
-			     } catch (e) {
-				 try {
-				     // fall back to _NET_WM_STRUT if _PARTIAL isn't there.
-				     struts = this.getNativeProperty (Atoms._NET_WM_STRUT);
-				 } catch (e) {
-				 }
+			     // _NET_WM_STRUT_PARTIAL, or _NET_WM_STRUT if
+			     // _PARTIAL isn't there.
+			     var s = this._nativewin.GetStrut ({});
+			     if (!s || s.length == 0)
+				 return null;
+
+			     var struts = { left: s[0],
+					    right: s[1],
+					    top: s[2],
+					    bottom: s[3],
+					    partial: s.length == 12 };
+			     if (struts.partial) {
+				 struts.leftStartY = s[4];
+				 struts.leftEndY = s[5];
+				 struts.rightStartY = s[6];
+				 struts.rightEndY = s[7];
+				 struts.topStartX = s[8];
+				 struts.topEndX = s[9];
+				 struts.bottomStartX = s[10];
+				 struts.bottomEndX = s[11];
 			     }
 			     return struts;
 			 });
@@ -212,37 +215,41 @@ function _addContentMethods (content) {
 			     // type must be DIALOG, for instance,
 			     // etc.
 
-			     var t = this.getNativeProperty (Atoms._NET_WM_WINDOW_TYPE);
-			     switch (t) {
-			     case Atoms._NET_WM_WINDOW_TYPE_DESKTOP: 
-				 return "desktop";
-			     case Atoms._NET_WM_WINDOW_TYPE_DIALOG: 
-				 return "dialog";
-			     case Atoms._NET_WM_WINDOW_TYPE_DOCK: 
-				 return "dock";
-			     case Atoms._NET_WM_WINDOW_TYPE_MENU: 
-				 return "menu";
-			     case Atoms._NET_WM_WINDOW_TYPE_SPLASH: 
-				 return "splash";
-			     case Atoms._NET_WM_WINDOW_TYPE_TOOLBAR: 
-				 return "toolbar";
-			     case Atoms._NET_WM_WINDOW_TYPE_UTILITY: 
-				 return "utility";
-			     case Atoms._NET_WM_WINDOW_TYPE_DROPDOWN_MENU: 
-				 return "dropdownmenu";
-			     case Atoms._NET_WM_WINDOW_TYPE_POPUP_MENU: 
-				 return "popupmenu";
-			     case Atoms._NET_WM_WINDOW_TYPE_TOOLTIP: 
-				 return "tooltip";
-			     case Atoms._NET_WM_WINDOW_TYPE_NOTIFICATION: 
-				 return "notification";
-			     case Atoms._NET_WM_WINDOW_TYPE_COMBO: 
-				 return "combo";
-			     case Atoms._NET_WM_WINDOW_TYPE_DND: 
-				 return "dnd";
-			     case Atoms._NET_WM_WINDOW_TYPE_NORMAL:
-			     default:
-				 return "normal";
+			     // the types are listed in order of
+			     // preference, use the first one we know.
+			     var types = this._nativewin.GetWindowTypes ({});
+			     for (var i = 0; types && i < types.length; i++) {
+				 switch (types[i]) {
+				 case Atoms._NET_WM_WINDOW_TYPE_DESKTOP: 
+				     return "desktop";
+				 case Atoms._NET_WM_WINDOW_TYPE_DIALOG: 
+				     return "dialog";
+				 case Atoms._NET_WM_WINDOW_TYPE_DOCK: 
+				     return "dock";
+				 case Atoms._NET_WM_WINDOW_TYPE_MENU: 
+				     return "menu";
+				 case Atoms._NET_WM_WINDOW_TYPE_SPLASH: 
+				     return "splash";
+				 case Atoms._NET_WM_WINDOW_TYPE_TOOLBAR: 
+				     return "toolbar";
+				 case Atoms._NET_WM_WINDOW_TYPE_UTILITY: 
+				     return "utility";
+				 case Atoms._NET_WM_WINDOW_TYPE_DROPDOWN_MENU: 
+				     return "dropdownmenu";
+				 case Atoms._NET_WM_WINDOW_TYPE_POPUP_MENU: 
+				     return "popupmenu";
+				 case Atoms._NET_WM_WINDOW_TYPE_TOOLTIP: 
+				     return "tooltip";
+				 case Atoms._NET_WM_WINDOW_TYPE_NOTIFICATION: 
+				     return "notification";
+				 case Atoms._NET_WM_WINDOW_TYPE_COMBO: 
+				     return "combo";
+				 case Atoms._NET_WM_WINDOW_TYPE_DND: 
+				     return "dnd";
+				 case Atoms._NET_WM_WINDOW_TYPE_NORMAL:
+				     return "normal";
+				 }
 			     }
+			     return "normal";
 			 });
 }
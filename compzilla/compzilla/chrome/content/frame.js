@@ -25,6 +25,7 @@ var FrameMethods = {
 
 	if (this._observer) {
 	    this._content.nativeWindow.removeObserver (this._observer);
+	    this._content.nativeWindow.RemoveIconNode (this._iconCanvas);
 	    this._observer = null;
 	}
 
@@ -146,6 +147,13 @@ var FrameMethods = {
         }
     },
 
+    _updateIcon: function () {
+	// windowIcon stays in place to take clicks for the window menu.
+	var hasIcon = this._content.nativeWindow.hasIcon;
+	this._iconCanvas.style.display = hasIcon ? "block" : "none";
+	this._icon.style.opacity = hasIcon ? 0 : "";
+    },
+
     _updateStrutInfo: function () {
 	workarea.UpdateStrutInfo (this, this._content.wmStruts);
     },
@@ -203,6 +211,7 @@ var FrameMethods = {
 	}
 
 	this.style.display = "block";
+	windowStack.updateStackingOrder ();
 
 	// We don't want this, I think
 	//this._updateContentSize ();
@@ -219,6 +228,7 @@ var FrameMethods = {
 	}
 
 	this.style.display = "none";
+	windowStack.updateStackingOrder ();
     },
 
     doMinimize: function () {
@@ -437,6 +447,7 @@ function CompzillaFrame (content)
     frame._content = content;
 
     frame._icon = $("#windowIcon", frame)[0];
+    frame._iconCanvas = $("#windowIconCanvas", frame)[0];
 
     frame._titleBox = $("#windowTitleBox", frame)[0];
     frame._title = $("#windowTitle", frame)[0];
@@ -455,6 +466,9 @@ function CompzillaFrame (content)
 	    return null;
 	}
 
+	content.nativeWindow.AddIconNode (frame._iconCanvas, 16);
+	frame._updateIcon ();
+
 	frame._updateStrutInfo ();
 
 	frame._resetChromeless ();
@@ -670,7 +684,7 @@ function _observeNativeWindow (frame)
 		break;
 
 	    case Atoms._NET_WM_ICON:
-		frame._icon.src = frame._content.wmIcon;
+		frame._updateIcon ();
 
 		Debug ("frame", "propertychange: new icon!");
 		break;
@@ -767,6 +781,26 @@ function _observeNativeWindow (frame)
      * of the current state.
      */
     frame.content.nativeWindow.addObserver (observer);
+
+    // Only property changes and messages handled above reach us.
+    var props = [ Atoms.XA_WM_NAME,
+		  Atoms._NET_WM_NAME,
+		  Atoms.XA_WM_ICON_NAME,
+		  Atoms._NET_WM_ICON_NAME,
+		  Atoms._NET_WM_ICON,
+		  Atoms._NET_WM_STRUT,
+		  Atoms._NET_WM_STRUT_PARTIAL,
+		  Atoms._NET_WM_WINDOW_TYPE,
+		  Atoms.XA_WM_CLASS ];
+    frame.content.nativeWindow.subscribeProperties (observer,
+						    props.length,
+						    props);
+
+    var messages = [ Atoms._NET_CLOSE_WINDOW ];
+    frame.content.nativeWindow.subscribeClientMessages (observer,
+							messages.length,
+							messages);
+
     return observer;
 };
 
@@ -23,6 +23,11 @@
  *  toggleDesktop () - toggles the visibility of windows above the
  *                     desktop layer.
  *
+ *  updateStackingOrder () - tells the control which native windows are
+ *                           shown, bottom to top.  Called by the
+ *                           methods above, and by frames when they are
+ *                           shown or hidden.
+ *
  *  showingDesktop - property.  true if the all windows above the
  *                   desktop are hidden.
  *
@@ -43,6 +48,7 @@ windowStack.stackWindow = function (w) {
     windowStack.appendChild (w);
 
     _maybeRestackLayer (l);
+    windowStack.updateStackingOrder ();
 }
 
 
@@ -64,6 +70,7 @@ windowStack.moveAbove = function(w, above) {
     // then assign the above window's to above.style.zIndex, then
     // call restoreWindow.)
     windowStack.insertAfter (w, above);
+    windowStack.updateStackingOrder ();
 
     if (w.content && w.content.onmoveabove)
 	w.content.onmoveabove (above);
@@ -80,6 +87,8 @@ windowStack.removeWindow = function(w) {
 	/* swallow any exception raised here */ 
     }
     w.layer = undefined;
+
+    windowStack.updateStackingOrder ();
 }
 
 
@@ -96,7 +105,7 @@ windowStack.moveToBottom = function(w) {
 
     // Restack if we've run out of valid zIndexes
     _maybeRestackLayer (w.layer);
-
+    windowStack.updateStackingOrder ();
 
     if (w.content && w.content.onmovetobottom)
 	w.content.onmovetobottom ();
@@ -119,6 +128,7 @@ windowStack.moveToTop = function(w) {
 
     // Restack if we've run out of valid zIndexes
     _maybeRestackLayer (w.layer);
+    windowStack.updateStackingOrder ();
 
     if (w.content && w.content.onmovetotop)
 	w.content.onmovetotop ();
@@ -128,6 +138,35 @@ windowStack.toggleDesktop = function () {
     windowStack.showingDesktop = !windowStack.showingDesktop;
 }
 
+
+/*
+ * The layers mean the X stacking order isn't what is drawn, so the control
+ * is told what is really on top, for occlusion culling.
+ */
+windowStack.updateStackingOrder = function () {
+    var shown = [];
+    for (var el = windowStack.firstChild; el != null; el = el.nextSibling) {
+	if (el.layer && el.content && el.content.nativeWindow
+	    && el.style.display != "none") {
+	    shown.push ({ xid: el.content.nativeWindow.nativeWindowId,
+			  zIndex: Number (el.style.zIndex),
+			  order: shown.length });
+	}
+    }
+
+    // Document order breaks ties, as it does when drawing.
+    shown.sort (function (w1, w2) {
+	return (w1.zIndex - w2.zIndex) || (w1.order - w2.order);
+    });
+
+    var xids = [];
+    for (var idx = 0; idx < shown.length; idx++) {
+	xids.push (shown[idx].xid);
+    }
+
+    svc.SetStackingOrder (xids.length, xids);
+}
+
 windowStack._showingDesktop = false;
 
 // our one property
@@ -149,6 +188,7 @@ windowStack.addProperty ("showingDesktop",
 				     el.style.display = windowStack._showingDesktop ? "none" : "block";
 				 }
 			     }
+			     windowStack.updateStackingOrder ();
 
 			     svc.SetRootWindowProperty (Atoms._NET_SHOWING_DESKTOP,
 							Atoms.XA_CARDINAL,
@@ -39,6 +39,10 @@ function XProps (nativewin)
 	}
     };
     nativewin.addObserver (this._observer);
+
+    // Only changes to cached values matter.
+    nativewin.subscribeProperties (this._observer, 0, []);
+    nativewin.subscribeClientMessages (this._observer, 0, []);
 }
 XProps.prototype = {
     destroy: function (atom) {
@@ -50,37 +54,51 @@ XProps.prototype = {
 	    return this._values[atom];
 	}
 	else {
-	    var prop_bag = this._nativewin.GetProperty (atom);
-	    if (!prop_bag) {
-		if (use_cache)
-		    this._values[atom] = null;
-		return null;
+	    var val = this._convert (this._nativewin.GetProperty (atom));
+
+	    if (use_cache) {
+		this._values[atom] = val;
+		this._subscribe ();
 	    }
 
-	    var val = new Object ();
-	    var prop;
-	    var propcnt = 0;
+	    return val;
+	}
+    },
 
-	    var enum = prop_bag.enumerator;
-	    while (enum.hasMoreElements()) {
-		prop = enum.getNext().QueryInterface(Components.interfaces.nsIProperty);
+    _convert: function (prop_bag) {
+	if (!prop_bag)
+	    return null;
 
-		val[prop.name] = prop.value;
-		propcnt++;
-	    }
+	var val = new Object ();
+	var prop;
+	var propcnt = 0;
 
-	    // If there's only one property with a known name, use it directly.
-	    if (propcnt == 1 && (prop.name == "atom" ||
-				 prop.name == "text" ||
-				 prop.name == "data")) {
-		val = prop.value;
-	    }
+	var enum = prop_bag.enumerator;
+	while (enum.hasMoreElements()) {
+	    prop = enum.getNext().QueryInterface(Components.interfaces.nsIProperty);
 
-	    if (use_cache)
-		this._values[atom] = val;
+	    val[prop.name] = prop.value;
+	    propcnt++;
+	}
 
-	    return val;
+	// If there's only one property with a known name, use it directly.
+	if (propcnt == 1 && (prop.name == "atom" ||
+			     prop.name == "text" ||
+			     prop.name == "data")) {
+	    val = prop.value;
 	}
+
+	return val;
+    },
+
+    _subscribe: function () {
+	var atoms = [];
+	for (var atom in this._values)
+	    atoms.push (Number (atom));
+
+	this._nativewin.subscribeProperties (this._observer,
+					     atoms.length,
+					     atoms);
     },
 
     invalidate: function (atom) {
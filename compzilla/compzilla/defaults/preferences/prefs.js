@@ -9,6 +9,36 @@ pref("compzilla.autostart", false);
 // If another window manager is running, just replace it instead of asking
 pref("compzilla.replace_existing_wm", false);
 
+// Maximum number of times a second window contents are redrawn
+pref("compzilla.frame_rate", 60);
+
+// Damage events per second at which a window's XDamage report level switches
+// to BoundingBox or NonEmpty, and below which it goes back to RawRectangles
+pref("compzilla.damage.idle_rate", 10);
+pref("compzilla.damage.bounding_box_rate", 100);
+pref("compzilla.damage.non_empty_rate", 500);
+
+// How window contents get to the canvases: "shm" copies damage into shared
+// memory images, falling back to "xlib" (drawing from the window pixmap)
+// when MIT-SHM can't be used
+pref("compzilla.image_transport", "shm");
+
+// Don't redraw windows hidden behind opaque windows
+pref("compzilla.occlusion_culling", true);
+
+// Let the X server draw an opaque window covering the whole screen directly
+pref("compzilla.fullscreen_unredirect", true);
+
+// Read X events ahead and coalesce them per window before handling them
+pref("compzilla.compress_events", true);
+
+// Send clients only the latest pointer position each frame
+pref("compzilla.coalesce_motion", true);
+
+// Read window damage and property changes on a separate X connection and
+// thread, so they are coalesced while Gecko is busy painting
+pref("compzilla.event_thread", false);
+
 pref("javascript.options.showInConsole", true);
 pref("nglayout.debug.disable_xul_cache", true);
 pref("browser.dom.window.dump.enabled", true);
@@ -34,6 +34,7 @@ static char *atom_names[] = {
     "_NET_WM_VISIBLE_ICON_NAME",
     "_NET_WM_VISIBLE_NAME",
     "_NET_WM_WINDOW_TYPE",
+    "_NET_WM_WINDOW_TYPE_DESKTOP",
     "_NET_WORKAREA",
     "WM_COLORMAP_WINDOWS",
     "WM_PROTOCOLS",
@@ -79,6 +80,7 @@ typedef union {
         Atom _NET_WM_VISIBLE_ICON_NAME;
         Atom _NET_WM_VISIBLE_NAME;
         Atom _NET_WM_WINDOW_TYPE;
+        Atom _NET_WM_WINDOW_TYPE_DESKTOP;
         Atom _NET_WORKAREA;
         Atom WM_COLORMAP_WINDOWS;
         Atom WM_PROTOCOLS;
@@ -0,0 +1,152 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <nsClassHashtable.h>
+#include <nsDataHashtable.h>
+#include <nsHashKeys.h>
+#include <nsString.h>
+#include <nsTArray.h>
+
+#include "compzillaAtomCache.h"
+#include "compzillaXcb.h"
+#include "Debug.h"
+
+extern "C" {
+#include <gdk/gdk.h>
+}
+
+
+typedef nsDataHashtable<nsCStringHashKey, PRUint32> AtomTable;
+typedef nsClassHashtable<nsUint32HashKey, nsCString> NameTable;
+
+// Created on first use, torn down when the module unloads.
+static AtomTable *sAtoms = nsnull;
+static NameTable *sNames = nsnull;
+
+
+static bool
+EnsureTables ()
+{
+  if (sAtoms)
+    return true;
+
+  sAtoms = new AtomTable ();
+  sNames = new NameTable ();
+  if (!sAtoms || !sNames || !sAtoms->Init (128) || !sNames->Init (128)) {
+    compzillaAtomCache::Shutdown ();
+    return false;
+  }
+
+  return true;
+}
+
+
+static void
+Add (const char *name, Atom atom)
+{
+  nsCString *str = new nsCString (name);
+  if (!str)
+    return;
+
+  sAtoms->Put (*str, atom);
+  sNames->Put (atom, str);
+}
+
+
+Atom
+compzillaAtomCache::Intern (Display *dpy, const char *name)
+{
+  if (!EnsureTables ())
+    return XInternAtom (dpy, name, False);
+
+  PRUint32 atom;
+  if (sAtoms->Get (nsDependentCString (name), &atom))
+    return atom;
+
+  compzillaXcb::CountRoundTrip ();
+  atom = XInternAtom (dpy, name, False);
+  if (atom != None)
+    Add (name, atom);
+
+  return atom;
+}
+
+
+bool
+compzillaAtomCache::InternAtoms (Display *dpy,
+                                 char **names,
+                                 PRUint32 count,
+                                 Atom *atoms)
+{
+  if (!EnsureTables ())
+    return XInternAtoms (dpy, names, count, False, atoms);
+
+  // Indexes of the names to ask the server for.
+  nsTArray<PRUint32> missing;
+  nsTArray<char *> missingNames;
+
+  for (PRUint32 i = 0; i < count; i++) {
+    PRUint32 atom;
+    if (sAtoms->Get (nsDependentCString (names[i]), &atom)) {
+      atoms[i] = atom;
+    } else {
+      missing.AppendElement (i);
+      missingNames.AppendElement (names[i]);
+    }
+  }
+
+  if (missing.IsEmpty ())
+    return true;
+
+  nsTArray<Atom> result;
+  if (!result.SetLength (missing.Length ()))
+    return false;
+
+  compzillaXcb::CountRoundTrip ();
+  if (!XInternAtoms (dpy, missingNames.Elements (), missingNames.Length (),
+                     False, result.Elements ()))
+    return false;
+
+  for (PRUint32 i = 0; i < missing.Length (); i++) {
+    atoms[missing[i]] = result[i];
+    Add (missingNames[i], result[i]);
+  }
+
+  return true;
+}
+
+
+const char *
+compzillaAtomCache::GetName (Display *dpy, Atom atom)
+{
+  if (!EnsureTables ())
+    return NULL;
+
+  nsCString *str;
+  if (sNames->Get (atom, &str))
+    return str->get ();
+
+  // Trap errors for atoms which don't exist.
+  gdk_error_trap_push ();
+  compzillaXcb::CountRoundTrip ();
+  char *name = XGetAtomName (dpy, atom);
+  gdk_error_trap_pop ();
+
+  if (!name)
+    return NULL;
+
+  Add (name, atom);
+  XFree (name);
+
+  sNames->Get (atom, &str);
+  return str ? str->get () : NULL;
+}
+
+
+void
+compzillaAtomCache::Shutdown ()
+{
+  delete sAtoms;
+  sAtoms = nsnull;
+  delete sNames;
+  sNames = nsnull;
+}
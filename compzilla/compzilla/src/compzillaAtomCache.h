@@ -0,0 +1,38 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaAtomCache_h___
+#define compzillaAtomCache_h___
+
+
+#include <prtypes.h>
+
+extern "C" {
+#include <X11/Xlib.h>
+}
+
+
+/*
+ * Atoms and their names, both ways.  Atoms are never freed by the server,
+ * so once known an atom or name is kept for good and looking it up again
+ * needs no round trip.  Only the main thread's display is cached.
+ */
+class compzillaAtomCache
+{
+public:
+    static Atom Intern (Display *dpy, const char *name);
+
+    // Interns the names not yet known in a single request.  Returns false,
+    // leaving atoms unset, if that failed.
+    static bool InternAtoms (Display *dpy,
+                             char **names,
+                             PRUint32 count,
+                             Atom *atoms);
+
+    // Owned by the cache.  Returns NULL for atoms that don't exist.
+    static const char *GetName (Display *dpy, Atom atom);
+
+    static void Shutdown ();
+};
+
+
+#endif
@@ -8,9 +8,19 @@
 #include <nsIDocShell.h>       // unstable
 #include <nsIDOMClassInfo.h>   // unstable
 #include <nsIInterfaceRequestorUtils.h>
+#include <nsIPrefBranch.h>
+#include <nsIPrefService.h>
 #include <nsIWebNavigation.h>  // unstable
+#include <nsDataHashtable.h>
+#include <nsServiceManagerUtils.h>
+#include <nsXPIDLString.h>
 
+#include "compzillaAtomCache.h"
 #include "compzillaControl.h"
+#include "compzillaErrorTrap.h"
+#include "compzillaIconLoader.h"
+#include "compzillaRegion.h"
+#include "compzillaXcb.h"
 #include "XAtoms.h"
 #include "Debug.h"
 
@@ -28,6 +38,13 @@ extern "C" {
 }
 
 
+#define DEFAULT_FRAME_RATE 60
+
+// Most events read ahead of dispatch in one go, so a client flooding us
+// can't keep Filter from returning.
+#define MAX_EVENT_BATCH 1024
+
+
 // Global storage
 PRLogModuleInfo *compzillaLog; // From Debug.h
 XAtoms atoms;                  // From XAtoms.h
@@ -48,7 +65,20 @@ int compzillaControl::shape_event;
 int compzillaControl::shape_error;
 
 
-compzillaControl::compzillaControl() {
+compzillaControl::compzillaControl()
+    : mFrameSourceId(0),
+      mFrameRate(DEFAULT_FRAME_RATE),
+      mFrameCount(0),
+      mLastFrameTime(0),
+      mStackingChanged(false),
+      mOcclusionCulling(true),
+      mFullscreenUnredirect(true),
+      mCompressEvents(true),
+      mDrainBlocked(false),
+      mEventThreadChannel(NULL),
+      mEventThreadSourceId(0),
+      mUseEventThread(false)
+{
     if (!compzillaLog) {
         compzillaLog = PR_NewLogModule ("compzilla");
     }
@@ -60,11 +90,22 @@ compzillaControl::compzillaControl() {
     // and even it it looks a lot I do think this worth a pref, for example you
     // imagine a system where you want to force having only one window at a
     // time or where you don't want to have too many windows open
-    mWindowMap.Init(50);
+    mWindows.Init(64);
+    mDrainCreated.Init(16);
 }
 
 
 compzillaControl::~compzillaControl() {
+    if (mFrameSourceId)
+        g_source_remove (mFrameSourceId);
+
+    if (mEventThreadSourceId)
+        g_source_remove (mEventThreadSourceId);
+    if (mEventThreadChannel)
+        g_io_channel_unref (mEventThreadChannel);
+    mEventThread = nsnull;
+
+    compzillaIconLoader::Shutdown ();
 }
 
 
@@ -76,7 +117,7 @@ NS_IMETHODIMP
 compzillaControl::HasWindowManager(nsIDOMWindow *window, PRBool *retval) {
   // FIXME: Handle screens
   char *atom_name = g_strdup_printf("WM_S%d", 0);
-  Atom atom = XInternAtom(mXDisplay, atom_name, FALSE);
+  Atom atom = compzillaAtomCache::Intern(mXDisplay, atom_name);
  g_free(atom_name);
 
   *retval = (XGetSelectionOwner(mXDisplay, atom) != None);
@@ -104,6 +145,8 @@ compzillaControl::RegisterWindowManager(nsIDOMWindow *window) {
   // Just ignore errors for now
   XSetErrorHandler(ErrorHandler);
 
+  InitPrefs();
+
   // Try to register as window manager
   rv = InitManagerWindow();
   if (NS_FAILED(rv))
@@ -123,6 +166,11 @@ compzillaControl::RegisterWindowManager(nsIDOMWindow *window) {
   if (NS_FAILED(rv))
      return rv;
 
+  // Read window events on their own connection if asked to
+  rv = InitEventThread ();
+  if (NS_FAILED(rv))
+      return rv;
+
   // Select events and manage all existing windows
   rv = InitWindowState ();
   if (NS_FAILED(rv))
@@ -134,11 +182,50 @@ compzillaControl::RegisterWindowManager(nsIDOMWindow *window) {
 
 NS_IMETHODIMP
 compzillaControl::InternAtom(const char *property, PRUint32 *value) {
-  *value = (PRUint32) XInternAtom(mXDisplay, property, FALSE);
+  *value = (PRUint32) compzillaAtomCache::Intern(mXDisplay, property);
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::InternAtoms(PRUint32 count, const char **names,
+                              PRUint32 *atomCount, PRUint32 **atomArray) {
+  *atomCount = 0;
+  *atomArray = nsnull;
+
+  nsTArray<Atom> result;
+  if (!result.SetLength (count))
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  if (!compzillaAtomCache::InternAtoms (mXDisplay, (char **) names, count,
+                                        result.Elements ()))
+    return NS_ERROR_FAILURE;
+
+  PRUint32 *values = (PRUint32 *) nsMemory::Alloc (PR_MAX (count, 1) * sizeof (PRUint32));
+  if (!values)
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  for (PRUint32 i = 0; i < count; i++) {
+    values[i] = (PRUint32) result[i];
+  }
+
+  *atomCount = count;
+  *atomArray = values;
   return NS_OK;
 }
 
 
+NS_IMETHODIMP
+compzillaControl::GetAtomName(PRUint32 atom, char **name) {
+  const char *str = compzillaAtomCache::GetName (mXDisplay, atom);
+  if (!str)
+    return NS_ERROR_INVALID_ARG;
+
+  *name = (char *) nsMemory::Clone (str, strlen (str) + 1);
+  return *name ? NS_OK : NS_ERROR_OUT_OF_MEMORY;
+}
+
+
 NS_IMETHODIMP
 compzillaControl::SetRootWindowProperty (PRInt32 prop, PRInt32 type,
                                          PRUint32 count,
@@ -223,6 +310,20 @@ compzillaControl::MoveToBottom(PRUint32 xid) {
 }
 
 
+NS_IMETHODIMP
+compzillaControl::SetStackingOrder(PRUint32 count, PRUint32 *xids) {
+  if (!mDrawOrder.SetLength (count))
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  for (PRUint32 i = 0; i < count; i++) {
+    mDrawOrder[i] = xids[i];
+  }
+
+  StackingChanged ();
+  return NS_OK;
+}
+
+
 NS_IMETHODIMP
 compzillaControl::Configure (PRUint32 xid,
                              PRUint32 x, PRUint32 y,
@@ -261,6 +362,62 @@ compzillaControl::Unmap(PRUint32 xid) {
 }
 
 
+NS_IMETHODIMP
+compzillaControl::GetFrameRate(PRUint32 *aFrameRate) {
+  *aFrameRate = mFrameRate;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::SetFrameRate(PRUint32 aFrameRate) {
+  if (aFrameRate == 0)
+    return NS_ERROR_INVALID_ARG;
+
+  mFrameRate = aFrameRate;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::GetOcclusionCulling(PRBool *aOcclusionCulling) {
+  *aOcclusionCulling = mOcclusionCulling;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::SetOcclusionCulling(PRBool aOcclusionCulling) {
+  if (mOcclusionCulling == !!aOcclusionCulling)
+    return NS_OK;
+
+  mOcclusionCulling = aOcclusionCulling;
+  StackingChanged ();
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::GetRoundTrips(PRUint32 *aRoundTrips) {
+  *aRoundTrips = compzillaXcb::RoundTrips ();
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::GetWindowLookups(PRUint32 *aWindowLookups) {
+  *aWindowLookups = mWindows.Lookups ();
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::GetWindowLookupMisses(PRUint32 *aWindowLookupMisses) {
+  *aWindowLookupMisses = mWindows.Misses ();
+  return NS_OK;
+}
+
+
 NS_IMETHODIMP
 compzillaControl::AddObserver(compzillaIControlObserver *aObserver) {
   SPEW ("compzillaWindow::AddObserver %p - %p\n", this, aObserver);
@@ -271,7 +428,7 @@ compzillaControl::AddObserver(compzillaIControlObserver *aObserver) {
    * When initially adding an observer, call windowCreate for all existing
    * windows.
    */
-  mWindowMap.Enumerate (&compzillaControl::CallWindowCreateCb, aObserver);
+  mWindows.Enumerate (&compzillaControl::CallWindowCreateCb, aObserver);
   return NS_OK;
 }
 
@@ -292,6 +449,36 @@ compzillaControl::RemoveObserver (compzillaIControlObserver *aObserver) {
 }
 
 
+NS_IMETHODIMP
+compzillaControl::AddBatchObserver (compzillaIBatchObserver *aObserver) {
+  SPEW ("AddBatchObserver control=%p, observer=%p\n", this, aObserver);
+
+  mBatchObservers.AppendObject (aObserver);
+
+  // Report the existing windows to the new observer only.
+  compzillaEventJournal created;
+  mWindows.Enumerate (&compzillaControl::RecordWindowCreateCb, &created);
+
+  nsCOMArray<compzillaIBatchObserver> observers;
+  observers.AppendObject (aObserver);
+  created.Deliver (observers);
+
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaControl::RemoveBatchObserver (compzillaIBatchObserver *aObserver) {
+  SPEW ("RemoveBatchObserver control=%p, observer=%p\n", this, aObserver);
+
+  mBatchObservers.RemoveObject (aObserver);
+  if (mBatchObservers.Count () == 0)
+    mJournal.Clear ();
+
+  return NS_OK;
+}
+
+
 /* ========================================================================= *\
  * Private methods...                                                        *
 \* ========================================================================= */
@@ -331,12 +518,63 @@ compzillaControl::GetNativeWindow(nsIDOMWindow *window) {
 }
 
 
+nsresult
+compzillaControl::InitPrefs () {
+  nsCOMPtr<nsIPrefBranch> prefs = do_GetService (NS_PREFSERVICE_CONTRACTID);
+  if (!prefs)
+    return NS_ERROR_FAILURE;
+
+  PRInt32 rate;
+  if (NS_SUCCEEDED (prefs->GetIntPref ("compzilla.frame_rate", &rate)) &&
+      rate > 0) {
+    mFrameRate = rate;
+  }
+
+  PRInt32 idleRate = 10, boundingBoxRate = 100, nonEmptyRate = 500;
+  prefs->GetIntPref ("compzilla.damage.idle_rate", &idleRate);
+  prefs->GetIntPref ("compzilla.damage.bounding_box_rate", &boundingBoxRate);
+  prefs->GetIntPref ("compzilla.damage.non_empty_rate", &nonEmptyRate);
+  compzillaWindow::SetDamageRates (idleRate, boundingBoxRate, nonEmptyRate);
+
+  nsXPIDLCString transport;
+  if (NS_SUCCEEDED (prefs->GetCharPref ("compzilla.image_transport",
+                                        getter_Copies (transport)))) {
+    compzillaWindow::SetUseShm (!transport.EqualsLiteral ("xlib"));
+  }
+
+  PRBool culling;
+  if (NS_SUCCEEDED (prefs->GetBoolPref ("compzilla.occlusion_culling", &culling)))
+    mOcclusionCulling = culling;
+
+  PRBool unredirect;
+  if (NS_SUCCEEDED (prefs->GetBoolPref ("compzilla.fullscreen_unredirect", &unredirect)))
+    mFullscreenUnredirect = unredirect;
+
+  PRBool eventThread;
+  if (NS_SUCCEEDED (prefs->GetBoolPref ("compzilla.event_thread", &eventThread)))
+    mUseEventThread = eventThread;
+
+  PRBool compress;
+  if (NS_SUCCEEDED (prefs->GetBoolPref ("compzilla.compress_events", &compress)))
+    mCompressEvents = compress;
+
+  PRBool coalesceMotion;
+  if (NS_SUCCEEDED (prefs->GetBoolPref ("compzilla.coalesce_motion", &coalesceMotion)))
+    compzillaWindow::SetCoalesceMotion (coalesceMotion);
+
+  SPEW ("InitPrefs: frame_rate=%d, damage rates=%d/%d/%d\n",
+        mFrameRate, idleRate, boundingBoxRate, nonEmptyRate);
+  return NS_OK;
+}
+
+
 nsresult
 compzillaControl::InitXAtoms () {
-  if (!XInternAtoms (mXDisplay,
-                     atom_names, sizeof (atom_names) / sizeof (atom_names[0]),
-                     False,
-                     atoms.a)) {
+  // Also seeds the atom cache.
+  if (!compzillaAtomCache::InternAtoms (mXDisplay,
+                                        atom_names,
+                                        sizeof (atom_names) / sizeof (atom_names[0]),
+                                        atoms.a)) {
       return NS_ERROR_FAILURE;
   }
   return NS_OK;
@@ -383,6 +621,9 @@ compzillaControl::InitXExtensions () {
   }
 
   SPEW ("shape extension: event = %d, error = %d\n", shape_event, shape_error);
+
+  // Shape queries go through XCB, which looks the extension up separately.
+  xcb_prefetch_extension_data (XGetXCBConnection (mXDisplay), &xcb_shape_id);
 #endif
 
   return NS_OK;
@@ -417,13 +658,22 @@ compzillaControl::InitWindowState() {
     XQueryTree (mXDisplay, mXRoot, &root_notused,
                 &parent_notused, &children, &nchildren);
 
-    for (int i = 0; i < nchildren; i++) {
-      if (children[i] != mOverlay && children[i] != mMainwinParent) {
-        AddWindow (children[i]);
-      }
-    }
+    // Our root selection is in place and the tree is known, so anything
+    // that changes from here on arrives as an event.  Adopting the windows
+    // doesn't need to hold off other clients.
+    XUngrabServer (mXDisplay);
+
+    // Children are returned in stacking order, bottom first.
+    mStacking.Clear ();
+    mStacking.AppendElements (children, nchildren);
+
+    AdoptWindows (children, nchildren);
 
     XFree (children);
+
+    StackingChanged ();
+  } else {
+    XUngrabServer (mXDisplay);
   }
 
   // Set the root window cursor, used when windows don't specify one.
@@ -435,8 +685,6 @@ compzillaControl::InitWindowState() {
   // for a given window.
   //XFixesSelectCursorInput (mXDisplay, mXRoot, XFixesDisplayCursorNotifyMask);
 
-  XUngrabServer (mXDisplay);
-
   return NS_OK;
 }
 
@@ -458,7 +706,7 @@ compzillaControl::ReplaceSelectionOwner(Window newOwner, Atom atom) {
   XClientMessageEvent ev;
   ev.type = ClientMessage;
   ev.window = mXRoot;
-  ev.message_type = XInternAtom (mXDisplay, "MANAGER", FALSE);
+  ev.message_type = compzillaAtomCache::Intern (mXDisplay, "MANAGER");
   // XXX What is 32 again?
   ev.format = 32;
   ev.data.l[0] = CurrentTime;
@@ -502,7 +750,7 @@ compzillaControl::InitManagerWindow () {
 
   // FIXME: Handle screens
   atom_name = g_strdup_printf ("WM_S%d", 0);
-  atom = XInternAtom (mXDisplay, atom_name, FALSE);
+  atom = compzillaAtomCache::Intern (mXDisplay, atom_name);
   g_free (atom_name);
 
   mIsWindowManager = ReplaceSelectionOwner (mManagerWindow, atom);
@@ -513,7 +761,7 @@ compzillaControl::InitManagerWindow () {
 
   // FIXME: Handle screens
   atom_name = g_strdup_printf ("_NET_WM_CM_S%d", 0);
-  atom = XInternAtom (mXDisplay, atom_name, FALSE);
+  atom = compzillaAtomCache::Intern (mXDisplay, atom_name);
   g_free (atom_name);
 
   mIsCompositor = ReplaceSelectionOwner (mManagerWindow, atom);
@@ -614,6 +862,9 @@ compzillaControl::EnableOverlayInput (bool receiveInput) {
 
 int
 compzillaControl::ErrorHandler (Display *dpy, XErrorEvent *err) {
+  if (compzillaErrorTrap::HandleError (dpy, err))
+    return 0;
+
   sErrorCnt++;
 
   char str[128];
@@ -669,9 +920,9 @@ compzillaControl::ClearErrors (Display *dpy) {
 }
 
 
-PLDHashOperator
-compzillaControl::CallWindowCreateCb (const PRUint32& key,
-                                      nsRefPtr<compzillaWindow>& win,
+void
+compzillaControl::CallWindowCreateCb (Window xid,
+                                      compzillaWindow *win,
                                       void *userdata) {
   compzillaIControlObserver *observer =
     static_cast<compzillaIControlObserver *>(userdata);
@@ -681,41 +932,154 @@ compzillaControl::CallWindowCreateCb (const PRUint32& key,
 
 
 void
-compzillaControl::AddWindow (Window win) {
+compzillaControl::RecordWindowCreateCb (Window xid,
+                                        compzillaWindow *win,
+                                        void *userdata) {
+  compzillaEventJournal *journal =
+    static_cast<compzillaEventJournal *>(userdata);
+  win->RecordCreate (journal);
+}
+
+
+void
+compzillaControl::AddSubwindow (Window xid, compzillaWindow *owner) {
+  mWindows.PutAlias (xid, owner);
+}
+
+
+void
+compzillaControl::RemoveSubwindow (Window xid, compzillaWindow *owner) {
+  mWindows.RemoveAlias (xid, owner);
+}
+
+
+compzillaEventJournal *
+compzillaControl::GetJournal () {
+  return mBatchObservers.Count () ? &mJournal : NULL;
+}
+
+
+void
+compzillaControl::FlushJournal () {
+  if (mBatchObservers.Count ())
+    mJournal.Deliver (mBatchObservers);
+}
+
+
+void
+compzillaControl::AdoptWindows (Window *windows, PRUint32 count) {
+  // Fetch every window's attributes and shape together, so adopting the
+  // existing windows costs one round trip instead of several per window.
+  nsTArray<Window> adopted (count);
+
+  for (PRUint32 i = 0; i < count; i++) {
+    if (windows[i] != mOverlay && windows[i] != mMainwinParent)
+      adopted.AppendElement (windows[i]);
+  }
+
+  nsTArray<XWindowAttributes> attrs (adopted.Length ());
+  attrs.SetLength (adopted.Length ());
+  nsTArray<bool> shaped (adopted.Length ());
+  shaped.SetLength (adopted.Length ());
+  nsTArray<bool> found (adopted.Length ());
+  found.SetLength (adopted.Length ());
+
+  compzillaXcb::GetWindows (mXDisplay, adopted.Elements (), adopted.Length (),
+                            attrs.Elements (), shaped.Elements (),
+                            found.Elements ());
+
+  // Windows destroyed since XQueryTree are skipped.
+  for (PRUint32 i = 0; i < adopted.Length (); i++) {
+    if (!found[i])
+      adopted[i] = None;
+  }
+
+  // Setting up the windows only sends requests.  Errors are collected for
+  // the whole batch with a single sync at the end.
+  nsTArray< nsRefPtr<compzillaWindow> > created (adopted.Length ());
+
   gdk_error_trap_push ();
 
+  for (PRUint32 i = 0; i < adopted.Length (); i++) {
+    nsRefPtr<compzillaWindow> compwin;
+    if (adopted[i] != None)
+      compwin = CreateWindow (adopted[i], &attrs[i], shaped[i]);
+    created.AppendElement (compwin);
+  }
+
+  // Syncs with the server.
+  compzillaXcb::CountRoundTrip ();
+  if (gdk_error_trap_pop ()) {
+    // Some window went away during setup.  Its DestroyNotify is queued
+    // behind this, and removes it again.
+    WARNING ("Errors encountered adopting %d existing windows\n",
+             adopted.Length ());
+  }
+
+  for (PRUint32 i = 0; i < created.Length (); i++) {
+    if (created[i])
+      RegisterWindow (created[i], adopted[i]);
+  }
+}
+
+
+void
+compzillaControl::AddWindow (Window win) {
+  // Attributes, geometry and shape in one round trip.
   XWindowAttributes attrs;
-  if (!XGetWindowAttributes(mXDisplay, win, &attrs)) {
-    gdk_error_trap_pop ();
+  bool shaped, found;
+  compzillaXcb::GetWindows (mXDisplay, &win, 1, &attrs, &shaped, &found);
+  if (!found)
     return;
-  }
 
-  if (attrs.c_class == InputOnly) {
-    INFO ("Ignoring InputOnly window %p\n", win);
-    gdk_error_trap_pop ();
+  gdk_error_trap_push ();
+
+  nsRefPtr<compzillaWindow> compwin = CreateWindow (win, &attrs, shaped);
+
+  // Syncs with the server.
+  compzillaXcb::CountRoundTrip ();
+  if (gdk_error_trap_pop ()) {
+    ERROR ("Errors encountered registering window %p\n", win);
     return;
   }
 
-  nsRefPtr<compzillaWindow> compwin;
-  if (NS_OK != CZ_NewCompzillaWindow (mXDisplay, win, &attrs, getter_AddRefs (compwin))) {
-      gdk_error_trap_pop ();
-      return;
+  if (compwin)
+    RegisterWindow (compwin, win);
+}
+
+
+already_AddRefed<compzillaWindow>
+compzillaControl::CreateWindow (Window win, XWindowAttributes *attrs,
+                                bool isShaped) {
+  if (attrs->c_class == InputOnly) {
+    INFO ("Ignoring InputOnly window %p\n", win);
+    return nsnull;
   }
 
+  compzillaWindow *compwin;
+  if (NS_OK != CZ_NewCompzillaWindow (this, mXDisplay, win, attrs, isShaped,
+                                      &compwin))
+    return nsnull;
+
 #ifdef CAUTIOUS_FILTER
   // Handle events for this window
   gdk_window_add_filter (gdk_window_foreign_new(win), gdk_filter_func, this);
 #endif
 
-  if (gdk_error_trap_pop ()) {
-    ERROR ("Errors encountered registering window %p\n", win);
-    return;
-  }
+  return compwin;
+}
 
+
+void
+compzillaControl::RegisterWindow (compzillaWindow *compwin, Window win) {
   INFO ("Adding window %p %s\n", win,
-    attrs.override_redirect ? "(override-redirect)" : "");
+    compwin->mAttr.override_redirect ? "(override-redirect)" : "");
 
-  mWindowMap.Put (win, compwin);
+  mWindows.Put (win, compwin);
+  StackingChanged ();
+
+  if (mEventThread)
+    mEventThread->Watch (win);
 
   compzillaIWindow *iwin = compwin;
 
@@ -723,8 +1087,11 @@ compzillaControl::AddWindow (Window win) {
     nsCOMPtr<compzillaIControlObserver> observer = mObservers.ObjectAt(i);
     observer->WindowCreate (iwin);
   }
-}
 
+  compzillaEventJournal *journal = GetJournal ();
+  if (journal)
+    compwin->RecordCreate (journal);
+}
 
 void
 compzillaControl::DestroyWindow (nsRefPtr<compzillaWindow> win,
@@ -736,10 +1103,231 @@ compzillaControl::DestroyWindow (nsRefPtr<compzillaWindow> win,
       observer->WindowDestroy (iwin);
     }
 
+    compzillaEventJournal *journal = GetJournal ();
+    if (journal)
+      journal->Append (compzillaIBatchObserver::WINDOW_DESTROY, win);
+
     win->Destroyed ();
   }
 
-  mWindowMap.Remove (xwin);
+  mWindows.Remove (xwin);
+  StackingChanged ();
+
+  if (mEventThread)
+    mEventThread->Unwatch (xwin);
+}
+
+
+/*
+ * Keep mStacking in step with the root window's children.  All of these
+ * arrive through the SubstructureNotifyMask selected on the root, so only
+ * events reported to the root are looked at.
+ */
+void
+compzillaControl::UpdateStacking (XEvent *xev) {
+  switch (xev->type) {
+    case CreateNotify:
+      if (xev->xcreatewindow.parent == mXRoot) {
+        // New windows go on top.
+        RestackWindow (xev->xcreatewindow.window,
+                       mStacking.IsEmpty () ? None : mStacking[mStacking.Length () - 1]);
+      }
+      break;
+
+    case DestroyNotify:
+      if (xev->xdestroywindow.event == mXRoot)
+        RemoveStacking (xev->xdestroywindow.window);
+      break;
+
+    case ReparentNotify:
+      if (xev->xreparent.event != mXRoot)
+        break;
+
+      if (xev->xreparent.parent == mXRoot) {
+        RestackWindow (xev->xreparent.window,
+                       mStacking.IsEmpty () ? None : mStacking[mStacking.Length () - 1]);
+      } else {
+        RemoveStacking (xev->xreparent.window);
+      }
+      break;
+
+    case ConfigureNotify:
+      if (xev->xconfigure.event == mXRoot)
+        RestackWindow (xev->xconfigure.window, xev->xconfigure.above);
+      break;
+
+    case CirculateNotify:
+      if (xev->xcirculate.event == mXRoot) {
+        Window above = None;
+        if (xev->xcirculate.place == PlaceOnTop && !mStacking.IsEmpty ())
+          above = mStacking[mStacking.Length () - 1];
+        RestackWindow (xev->xcirculate.window, above);
+      }
+      break;
+
+    case MapNotify:
+      if (xev->xmap.event == mXRoot)
+        StackingChanged ();
+      break;
+
+    case UnmapNotify:
+      if (xev->xunmap.event == mXRoot)
+        StackingChanged ();
+      break;
+  }
+}
+
+
+/*
+ * Move win directly above the sibling above, or to the bottom if above is
+ * None.  Also used for geometry changes, which need the same recompute.
+ */
+void
+compzillaControl::RestackWindow (Window win, Window above) {
+  if (win == above)
+    return;
+
+  mStacking.RemoveElement (win);
+
+  PRUint32 pos = 0;
+  if (above != None) {
+    PRUint32 index = mStacking.IndexOf (above);
+    pos = (index == mStacking.NoIndex) ? mStacking.Length () : index + 1;
+  }
+
+  mStacking.InsertElementAt (pos, win);
+  StackingChanged ();
+}
+
+
+void
+compzillaControl::RemoveStacking (Window win) {
+  if (mStacking.RemoveElement (win))
+    StackingChanged ();
+}
+
+
+void
+compzillaControl::StackingChanged () {
+  mStackingChanged = true;
+  ScheduleFrame ();
+}
+
+
+/*
+ * Walk the chrome's stack top down, collecting the area covered by opaque
+ * windows.  Windows entirely inside it are marked occluded and stop drawing
+ * until they are uncovered.  The X stacking order can't be used, the chrome
+ * puts windows in layers regardless of it.
+ */
+void
+compzillaControl::UpdateOcclusion () {
+  mStackingChanged = false;
+
+  compzillaRegion covered;
+  nsRefPtr<compzillaWindow> top;
+
+  nsTHashtable<nsUint32HashKey> drawn;
+  if (!drawn.Init (PR_MAX (mDrawOrder.Length (), 16)))
+    return;
+
+  for (PRUint32 i = mDrawOrder.Length () - 1; i != PRUint32(-1); --i) {
+    nsRefPtr<compzillaWindow> win = FindWindow (mDrawOrder[i]);
+    if (!win || win->mAttr.map_state != IsViewable)
+      continue;
+
+    drawn.PutEntry (mDrawOrder[i]);
+
+    if (!top)
+      top = win;
+
+    if (!mOcclusionCulling) {
+      win->SetOccluded (false);
+      continue;
+    }
+
+    XWindowAttributes &attr = win->mAttr;
+    PRInt32 width = attr.width + 2 * attr.border_width;
+    PRInt32 height = attr.height + 2 * attr.border_width;
+
+    compzillaRegion visible (attr.x, attr.y, width, height);
+    visible.Subtract (covered);
+
+    win->SetOccluded (visible.IsEmpty ());
+
+    if (!visible.IsEmpty () && win->IsOpaque ())
+      covered.Union (visible);
+  }
+
+  // Where the chrome draws anything else isn't known, so it is never culled.
+  for (PRUint32 i = 0; i < mStacking.Length (); i++) {
+    if (drawn.GetEntry (mStacking[i]))
+      continue;
+
+    nsRefPtr<compzillaWindow> win = FindWindow (mStacking[i]);
+    if (win)
+      win->SetOccluded (false);
+  }
+
+  UpdateBypass (top);
+}
+
+
+/*
+ * If the window the chrome shows on top is opaque and covers the screen, let
+ * the server draw it directly instead of copying it into a canvas every
+ * frame.  Showing anything above it, moving or resizing it, or cloning it
+ * into a second canvas ends the bypass.  Desktop windows are never bypassed:
+ * with the overlay hidden nothing else would be visible, wherever the chrome
+ * stacks them.
+ */
+void
+compzillaControl::UpdateBypass (compzillaWindow *top) {
+  nsRefPtr<compzillaWindow> bypass;
+  if (mFullscreenUnredirect && top &&
+      top->IsOpaque () && !top->IsCloned () && CoversScreen (top) &&
+      !top->IsDesktop ()) {
+    bypass = top;
+  }
+
+  if (bypass == mBypassWindow)
+    return;
+
+  nsRefPtr<compzillaWindow> old = mBypassWindow;
+  mBypassWindow = bypass;
+
+  if (old)
+    old->SetBypassed (false);
+
+  if (!old || !bypass) {
+    ShowOverlay (!bypass);
+    EnableOverlayInput (!bypass);
+  }
+
+  if (bypass)
+    bypass->SetBypassed (true);
+
+  INFO ("Fullscreen bypass: %p -> %p\n", old.get (), bypass.get ());
+
+  compzillaIWindow *oldwin = old;
+  compzillaIWindow *newwin = bypass;
+
+  for (PRUint32 i = mObservers.Count() - 1; i != PRUint32(-1); --i) {
+    nsCOMPtr<compzillaIControlObserver> observer = mObservers.ObjectAt(i);
+    if (oldwin)
+      observer->FullscreenBypass (oldwin, PR_FALSE);
+    if (newwin)
+      observer->FullscreenBypass (newwin, PR_TRUE);
+  }
+}
+
+
+bool
+compzillaControl::CoversScreen (compzillaWindow *win) {
+  XWindowAttributes &attr = win->mAttr;
+  return (attr.x <= 0 && attr.y <= 0 &&
+          attr.x + attr.width + 2 * attr.border_width >= DisplayWidth (mXDisplay, 0) &&
+          attr.y + attr.height + 2 * attr.border_width >= DisplayHeight (mXDisplay, 0));
 }
 
 
@@ -755,13 +1343,190 @@ compzillaControl::RootClientMessaged (Atom type, int format, long *data/*[5]*/)
                                      data[3],
                                      data[4]);
   }
+
+  compzillaEventJournal *journal = GetJournal ();
+  if (journal) {
+    journal->Append (compzillaIBatchObserver::CLIENT_MESSAGE, NULL,
+                     type, format,
+                     data[0], data[1], data[2], data[3], data[4]);
+  }
+}
+
+
+nsresult
+compzillaControl::InitEventThread () {
+  if (!mUseEventThread)
+    return NS_OK;
+
+  mEventThread = compzillaEventThread::Create (mXDisplay);
+  if (!mEventThread) {
+    WARNING ("Reading all events on the main thread\n");
+    return NS_OK;
+  }
+
+  mEventThreadChannel = g_io_channel_unix_new (mEventThread->GetWakeFd ());
+  mEventThreadSourceId = g_io_add_watch (mEventThreadChannel, G_IO_IN,
+                                         &compzillaControl::EventThreadCb,
+                                         this);
+  return NS_OK;
+}
+
+
+gboolean
+compzillaControl::EventThreadCb (GIOChannel *source,
+                                 GIOCondition condition,
+                                 gpointer data) {
+  compzillaControl *control = reinterpret_cast<compzillaControl*>(data);
+
+  // The records are read by the next frame, which watches again.
+  control->mEventThreadSourceId = 0;
+  control->ScheduleFrame ();
+  return FALSE;
+}
+
+
+/*
+ * Hand what the event thread read since the last frame to the windows.
+ * Damage from the thread is already coalesced per window.
+ */
+void
+compzillaControl::DrainEventThread () {
+  compzillaEventThread::Record records[64];
+  PRUint32 count;
+
+  do {
+    count = mEventThread->Read (records, NS_ARRAY_LENGTH (records));
+
+    for (PRUint32 i = 0; i < count; i++) {
+      nsRefPtr<compzillaWindow> win = FindWindow (records[i].mWindow);
+      if (!win)
+        continue;
+
+      switch (records[i].mType) {
+        case compzillaEventThread::Record::DAMAGE:
+          win->AddDamage (&records[i].mRect);
+          break;
+        case compzillaEventThread::Record::PROPERTY:
+          win->PropertyChanged (records[i].mAtom, records[i].mDeleted);
+          break;
+        case compzillaEventThread::Record::WATCHED:
+          win->UseEventThread ();
+          break;
+      }
+    }
+  } while (count == NS_ARRAY_LENGTH (records));
+
+  FlushJournal ();
+
+  if (!mEventThreadSourceId) {
+    mEventThreadSourceId = g_io_add_watch (mEventThreadChannel, G_IO_IN,
+                                           &compzillaControl::EventThreadCb,
+                                           this);
+  }
+}
+
+
+void
+compzillaControl::WindowDamaged (compzillaWindow *win) {
+  mDirtyWindows.AppendElement (win);
+  ScheduleFrame ();
+}
+
+
+void
+compzillaControl::MotionQueued (compzillaWindow *win) {
+  mMotionWindows.AppendElement (win);
+  ScheduleFrame ();
+}
+
+
+/*
+ * All canvas invalidation goes through here.  If the last frame is older than
+ * the frame interval we flush as soon as GDK has drained the X queue,
+ * otherwise we wait out the rest of the interval so the X event loop and
+ * Gecko's painting don't fight over the main thread.
+ */
+void
+compzillaControl::ScheduleFrame () {
+  if (mFrameSourceId)
+    return;
+
+  PRIntervalTime interval = PR_MillisecondsToInterval (1000 / mFrameRate);
+  PRIntervalTime elapsed = PR_IntervalNow () - mLastFrameTime;
+
+  if (elapsed >= interval) {
+    mFrameSourceId = g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+                                      &compzillaControl::FrameCb,
+                                      this, NULL);
+  } else {
+    mFrameSourceId = g_timeout_add_full (G_PRIORITY_DEFAULT,
+                                         PR_IntervalToMilliseconds (interval - elapsed),
+                                         &compzillaControl::FrameCb,
+                                         this, NULL);
+  }
+}
+
+
+gboolean
+compzillaControl::FrameCb (gpointer data) {
+  compzillaControl *control = reinterpret_cast<compzillaControl*>(data);
+  control->mFrameSourceId = 0;
+  control->Frame ();
+  return FALSE;
+}
+
+
+void
+compzillaControl::Frame () {
+  mLastFrameTime = PR_IntervalNow ();
+  mFrameCount++;
+
+  // Pointer motion first, so clients start repainting for it soonest.
+  nsTArray<nsRefPtr<compzillaWindow> > moved;
+  moved.SwapElements (mMotionWindows);
+  for (PRUint32 i = 0; i < moved.Length (); i++) {
+    moved[i]->FlushMotion ();
+  }
+
+  if (mEventThread)
+    DrainEventThread ();
+
+  // Uncovered windows queue a full redraw for this frame.
+  if (mStackingChanged)
+    UpdateOcclusion ();
+
+  // Windows damaged during the frame get queued for the next one.
+  nsTArray<nsRefPtr<compzillaWindow> > windows;
+  windows.SwapElements (mDirtyWindows);
+
+  // Anything UpdateOcclusion queued is flushed now, don't wake up for it.
+  if (mFrameSourceId) {
+    g_source_remove (mFrameSourceId);
+    mFrameSourceId = 0;
+  }
+
+  SPEW_EVENT ("Frame %d: %d dirty windows\n", mFrameCount, windows.Length());
+
+  for (PRUint32 i = mObservers.Count() - 1; i != PRUint32(-1); --i) {
+    nsCOMPtr<compzillaIControlObserver> observer = mObservers.ObjectAt(i);
+    observer->FrameBegin (mFrameCount);
+  }
+
+  for (PRUint32 i = 0; i < windows.Length(); i++) {
+    windows[i]->FlushDamage ();
+  }
+
+  for (PRUint32 i = mObservers.Count() - 1; i != PRUint32(-1); --i) {
+    nsCOMPtr<compzillaIControlObserver> observer = mObservers.ObjectAt(i);
+    observer->FrameEnd (mFrameCount);
+  }
 }
 
 
 already_AddRefed<compzillaWindow>
 compzillaControl::FindWindow (Window win) {
-  compzillaWindow *compwin;
-  mWindowMap.Get(win, &compwin);
+  compzillaWindow *compwin = mWindows.Get (win);
+  NS_IF_ADDREF (compwin);
   return compwin;
 }
 
@@ -772,7 +1537,7 @@ compzillaControl::PrintEvent (XEvent *xev) {
   case ClientMessage:
     SPEW("ClientMessage: window=0x%0x, type=%s, format=%d\n",
          xev->xclient.window,
-         XGetAtomName (mXDisplay, xev->xclient.message_type),
+         compzillaAtomCache::GetName (mXDisplay, xev->xclient.message_type),
          xev->xclient.format);
     break;
 
@@ -852,7 +1617,7 @@ compzillaControl::PrintEvent (XEvent *xev) {
     case PropertyNotify:
 #if DEBUG_EVENTS // Too much noise
       SPEW("PropertyChange: window=0x%0x, atom=%s\n", xev->xproperty.window,
-           XGetAtomName(xev->xany.display, xev->xproperty.atom));
+           compzillaAtomCache::GetName(xev->xany.display, xev->xproperty.atom));
 #endif
       break;
 
@@ -996,6 +1761,52 @@ compzillaControl::GetEventXWindow (XEvent *xev) {
 }
 
 
+/*
+ * Identifies events which supersede each other: same type and window and,
+ * for PropertyNotify and ShapeNotify, the same atom or shape kind.
+ */
+class EventKey : public PLDHashEntryHdr
+{
+public:
+  struct Key {
+    Window window;
+    int type;
+    unsigned long detail;
+  };
+
+  typedef const Key& KeyType;
+  typedef const Key* KeyTypePointer;
+
+  EventKey (KeyTypePointer aKey) : mKey(*aKey) { }
+  EventKey (const EventKey& toCopy) : mKey(toCopy.mKey) { }
+  ~EventKey () { }
+
+  KeyType GetKey () const { return mKey; }
+  PRBool KeyEquals (KeyTypePointer aKey) const {
+    return (mKey.window == aKey->window &&
+            mKey.type == aKey->type &&
+            mKey.detail == aKey->detail);
+  }
+
+  static KeyTypePointer KeyToPointer (KeyType aKey) { return &aKey; }
+  static PLDHashNumber HashKey (KeyTypePointer aKey) {
+    return (PLDHashNumber) (aKey->window ^ (aKey->detail << 8) ^ (aKey->type << 24));
+  }
+
+  enum { ALLOW_MEMMOVE = PR_TRUE };
+
+private:
+  const Key mKey;
+};
+
+
+/*
+ * Events are read ahead and compressed before anything is dispatched, so
+ * storms (startup, session restore, drags) cost work per window instead of
+ * per event.  Only events we consume are read ahead, and only up to the
+ * first one GDK has to see, so nothing is reordered against GDK's own
+ * event handling.
+ */
 GdkFilterReturn
 compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
   XEvent *xev = (XEvent*) xevent;
@@ -1004,8 +1815,294 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
     return GDK_FILTER_CONTINUE;
   }
 
-  PrintEvent (xev);
+  if (HandleSubwindowEvent (xev))
+    return GDK_FILTER_REMOVE;
+
+  mDrainBlocked = false;
+  mDrainCreated.Clear ();
+
+  if (!mCompressEvents || !CanCompress (xev)) {
+    PrintEvent (xev);
+    UpdateStacking (xev);
+    GdkFilterReturn ret = HandleEvent (xev, 1);
+    FlushJournal ();
+    return ret;
+  }
+
+  nsTArray<PendingEvent> events;
+  PendingEvent *pending = events.AppendElement ();
+  if (!pending) {
+    PrintEvent (xev);
+    UpdateStacking (xev);
+    GdkFilterReturn ret = HandleEvent (xev, 1);
+    FlushJournal ();
+    return ret;
+  }
+  pending->mEvent = *xev;
+  pending->mCount = 1;
+
+  XEvent next;
+  while (events.Length () < MAX_EVENT_BATCH &&
+         XCheckIfEvent (mXDisplay, &next, CanCompressPredicate, (XPointer) this)) {
+    pending = events.AppendElement ();
+    if (!pending) {
+      // Can't be put back, so handle it ahead of the batch.
+      PrintEvent (&next);
+      UpdateStacking (&next);
+      HandleEvent (&next, 1);
+      continue;
+    }
+    pending->mEvent = next;
+    pending->mCount = 1;
+  }
+
+  // Stacking follows every event, since the above sibling of a dropped
+  // ConfigureNotify may be what a later one is stacked against.
+  for (PRUint32 i = 0; i < events.Length (); i++) {
+    PrintEvent (&events[i].mEvent);
+    UpdateStacking (&events[i].mEvent);
+  }
+
+  CompressEvents (events);
+
+  PRUint32 dispatched = 0;
+  for (PRUint32 i = 0; i < events.Length (); i++) {
+    if (events[i].mCount) {
+      HandleEvent (&events[i].mEvent, events[i].mCount);
+      dispatched++;
+    }
+  }
+
+  SPEW_EVENT ("Filter: compressed %d events to %d\n", events.Length (), dispatched);
+
+  FlushJournal ();
+
+  return GDK_FILTER_REMOVE;
+}
+
+
+/*
+ * Events reported because a managed window selected SubstructureNotifyMask
+ * on itself or its subwindows go to the window, to keep its copy of its
+ * subwindows current.
+ */
+bool
+compzillaControl::HandleSubwindowEvent (XEvent *xev) {
+  switch (xev->type) {
+    case CreateNotify:
+    case DestroyNotify:
+    case ConfigureNotify:
+    case GravityNotify:
+    case MapNotify:
+    case UnmapNotify:
+    case ReparentNotify:
+    case CirculateNotify:
+      break;
+    default:
+      return false;
+  }
+
+  // The window the event was reported to, its parent or the old parent.
+  Window parent = xev->xany.window;
+  if (parent == mXRoot || parent == GetEventXWindow (xev))
+    return false;
+
+  nsRefPtr<compzillaWindow> owner = mWindows.GetOwner (parent);
+  if (!owner)
+    return false;
+
+  owner->SubwindowEvent (xev);
+  return true;
+}
+
+
+Bool
+compzillaControl::CanCompressPredicate (Display *dpy, XEvent *xev, XPointer arg) {
+  // Called with the display locked, so no Xlib calls in here.
+  compzillaControl *control = reinterpret_cast<compzillaControl*>(arg);
+  return control->CanCompress (xev) ? True : False;
+}
+
+
+/*
+ * Whether xev can be read ahead: HandleEvent must consume it whatever else
+ * is in the batch.  The first event that can't blocks the rest of the drain.
+ */
+bool
+compzillaControl::CanCompress (XEvent *xev) {
+  if (mDrainBlocked)
+    return false;
 
+  Window xwin = GetEventXWindow (xev);
+  bool compress;
+
+  switch (xev->type) {
+    case CreateNotify:
+      compress = xev->xcreatewindow.parent == mXRoot && xwin != mMainwin;
+      if (compress)
+        mDrainCreated.PutEntry (xwin);
+      break;
+    case ConfigureRequest:
+      compress = xev->xconfigurerequest.parent == mXRoot;
+      break;
+    case MapRequest:
+      compress = xev->xmaprequest.parent == mXRoot;
+      break;
+    case DestroyNotify:
+    case ConfigureNotify:
+    case MapNotify:
+    case UnmapNotify:
+    case PropertyNotify:
+      compress = IsManaged (xwin);
+      break;
+    default:
+      if (xev->type == damage_event + XDamageNotify)
+        compress = IsManaged (xwin);
+      else
+        compress = xev->type == shape_event + ShapeNotify;
+      break;
+  }
+
+  if (!compress)
+    mDrainBlocked = true;
+
+  return compress;
+}
+
+
+bool
+compzillaControl::IsManaged (Window win) {
+  return mWindows.Contains (win) || mDrainCreated.GetEntry (win);
+}
+
+
+/*
+ * Whether only the latest of xev's kind for its window needs handling.
+ * detail further distinguishes events of the same kind.
+ */
+bool
+compzillaControl::GetCoalesceDetail (XEvent *xev, unsigned long *detail) {
+  *detail = 0;
+
+  switch (xev->type) {
+    case ConfigureNotify:
+    case ConfigureRequest:
+    case DestroyNotify:
+      return true;
+    case PropertyNotify:
+      *detail = xev->xproperty.atom;
+      return true;
+    default:
+      if (xev->type == damage_event + XDamageNotify) {
+        return true;
+      } else if (xev->type == shape_event + ShapeNotify) {
+        *detail = ((XShapeEvent *) xev)->kind;
+        return true;
+      }
+      return false;
+  }
+}
+
+
+void
+compzillaControl::CompressEvents (nsTArray<PendingEvent>& events) {
+  nsDataHashtable<EventKey, PRUint32> latest;
+  if (!latest.Init (events.Length ()))
+    return;
+
+  // Walk backwards, so the event kept is the latest one, where it was in
+  // the queue.
+  for (PRUint32 i = events.Length () - 1; i != PRUint32(-1); --i) {
+    XEvent *xev = &events[i].mEvent;
+    Window xwin = GetEventXWindow (xev);
+
+    EventKey::Key destroyKey = { xwin, DestroyNotify, 0 };
+    PRUint32 destroyIndex;
+    if (xev->type != DestroyNotify && latest.Get (destroyKey, &destroyIndex)) {
+      if (xev->type == CreateNotify) {
+        if (mWindows.Contains (xwin))
+          continue;
+
+        // Created and destroyed in the same batch, never seen by anyone.
+        // Anything earlier is for a previous window with the same id.
+        events[destroyIndex].mCount = 0;
+        latest.Remove (destroyKey);
+      }
+
+      // Nothing done to a window matters once it is destroyed.
+      events[i].mCount = 0;
+      continue;
+    }
+
+    unsigned long detail;
+    if (!GetCoalesceDetail (xev, &detail))
+      continue;
+
+    EventKey::Key key = { xwin, xev->type, detail };
+    PRUint32 keptIndex;
+    if (!latest.Get (key, &keptIndex)) {
+      latest.Put (key, i);
+      continue;
+    }
+
+    if (xev->type == damage_event + XDamageNotify) {
+      // The damage itself is collected from the server on flush, merging
+      // keeps the bounds and the event rate right.
+      XRectangle *kept = &((XDamageNotifyEvent *) &events[keptIndex].mEvent)->area;
+      XRectangle *area = &((XDamageNotifyEvent *) xev)->area;
+
+      PRInt32 x1 = PR_MIN (kept->x, area->x);
+      PRInt32 y1 = PR_MIN (kept->y, area->y);
+      PRInt32 x2 = PR_MAX (kept->x + kept->width, area->x + area->width);
+      PRInt32 y2 = PR_MAX (kept->y + kept->height, area->y + area->height);
+      kept->x = x1;
+      kept->y = y1;
+      kept->width = x2 - x1;
+      kept->height = y2 - y1;
+
+      events[keptIndex].mCount += events[i].mCount;
+    }
+
+    events[i].mCount = 0;
+  }
+
+  // A window mapped and unmapped again, or the reverse, ends up where it
+  // started.  So does a map request withdrawn before it was handled.
+  nsDataHashtable<nsUint32HashKey, PRUint32> mapping;
+  if (!mapping.Init (16))
+    return;
+
+  for (PRUint32 i = 0; i < events.Length (); i++) {
+    int type = events[i].mEvent.type;
+    if (!events[i].mCount ||
+        (type != MapNotify && type != UnmapNotify && type != MapRequest))
+      continue;
+
+    Window xwin = GetEventXWindow (&events[i].mEvent);
+    PRUint32 prev;
+    if (mapping.Get (xwin, &prev)) {
+      int prevType = events[prev].mEvent.type;
+      if ((prevType == MapNotify && type == UnmapNotify) ||
+          (prevType == UnmapNotify && type == MapNotify) ||
+          (prevType == MapRequest && type == UnmapNotify)) {
+        events[prev].mCount = 0;
+        events[i].mCount = 0;
+        mapping.Remove (xwin);
+        continue;
+      }
+    }
+
+    mapping.Put (xwin, i);
+  }
+}
+
+
+/*
+ * Handle a single event.  count is the number of events compressed into
+ * it.
+ */
+GdkFilterReturn
+compzillaControl::HandleEvent (XEvent *xev, PRUint32 count) {
   Window xwin = GetEventXWindow (xev);
   nsRefPtr<compzillaWindow> win = FindWindow (xwin);
 
@@ -1033,8 +2130,7 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
       if (xev->xcreatewindow.parent == mXRoot) {
         if (win) {
           ERROR ("CreateNotify: multiple create events for window id: 0x%0x\n", xwin);
-        } else if (!XCheckTypedWindowEvent (mXDisplay, xwin, DestroyNotify, xev) &&
-          !XCheckTypedWindowEvent (mXDisplay, xwin, ReparentNotify, xev)) {
+        } else {
           AddWindow (xwin);
         }
         return GDK_FILTER_REMOVE;
@@ -1050,12 +2146,6 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
 
     case ConfigureNotify:
       if (win) {
-#if CLEAR_PENDING_X_EVENTS
-        while (XCheckTypedWindowEvent (mXDisplay, xwin, ConfigureNotify, xev)) {
-          // Do nothing
-        }
-#endif
-
         // This is driven by compzilla or from an override_redirect itself.
         win->Configured (true,
                          xev->xconfigure.x,
@@ -1072,10 +2162,6 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
     case ConfigureRequest:
       if (xev->xconfigurerequest.parent == mXRoot) {
           if (win) {
-            while (XCheckTypedWindowEvent (mXDisplay, xwin, ConfigureRequest, xev)) {
-              // Do nothing
-            }
-
             nsRefPtr<compzillaWindow> aboveWin;
             if (xev->xconfigure.above != None)
               aboveWin = FindWindow (xev->xconfigure.above);
@@ -1138,7 +2224,7 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
 #if HAVE_XSHAPE
           XShapeSelectInput (mXDisplay, xwin, NoEventMask);
 #endif
-          XUngrabButton (mXDisplay, AnyButton, AnyModifier, xwin);
+          win->SetGrabState (compzillaIWindow::GRAB_NONE);
 
           DestroyWindow (win, xwin);
       }
@@ -1147,27 +2233,21 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
 
     case MapRequest:
       if (xev->xmaprequest.parent == mXRoot) {
-        if (!XCheckTypedWindowEvent (mXDisplay, xwin, UnmapNotify, xev)) {
-          XMapWindow (mXDisplay, xwin);
-        }
+        XMapWindow (mXDisplay, xwin);
         return GDK_FILTER_REMOVE;
       }
       break;
 
     case MapNotify:
       if (win) {
-        if (!XCheckTypedWindowEvent (mXDisplay, xwin, UnmapNotify, xev)) {
-          win->Mapped (xev->xmap.override_redirect);
-        }
+        win->Mapped (xev->xmap.override_redirect);
         return GDK_FILTER_REMOVE;
       }
       break;
 
     case UnmapNotify:
       if (win) {
-        if (!XCheckTypedWindowEvent (mXDisplay, xwin, MapNotify, xev)) {
-          win->Unmapped ();
-        }
+        win->Unmapped ();
         return GDK_FILTER_REMOVE;
       }
       break;
@@ -1180,6 +2260,10 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
       break;
 
     case _FocusIn:
+      // The overlay's input shape stays empty while a window is bypassed.
+      if (mBypassWindow)
+        break;
+
       if (xev->xfocus.mode == NotifyUngrab) {
         SPEW("FocusIn: focusing main window!\n");
         EnableOverlayInput (true);
@@ -1188,6 +2272,9 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
       break;
 
     case _FocusOut:
+      if (mBypassWindow)
+        break;
+
       if ((xwin == mMainwin || xwin == mMainwinParent) &&
           xev->xfocus.mode == NotifyGrab) {
         SPEW ("FocusOut: UNfocusing main window!\n");
@@ -1200,20 +2287,9 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
       if (win && xev->type == damage_event + XDamageNotify) {
         XDamageNotifyEvent *damage_ev = (XDamageNotifyEvent *) xev;
 
-        int cnt = 0;
-        do {
-          win->Damaged (&damage_ev->area);
-          cnt++;
-        }
-#if CLEAR_PENDING_X_EVENTS
-        while (XCheckTypedEvent (mXDisplay, damage_event + XDamageNotify, xev));
-#else
-        while (0);
-#endif
-
-        if (cnt > 1) {
-          SPEW_EVENT ("DAMAGE: Handled %d pending events!\n", cnt);
-        }
+        // Only queues the window; the damage itself is collected from the
+        // server when the window is flushed.
+        win->Damaged (&damage_ev->area, count);
 
         return GDK_FILTER_REMOVE;
       } else if (xev->type == xfixes_event + XFixesCursorNotify) {
@@ -1225,7 +2301,10 @@ compzillaControl::Filter (GdkXEvent *xevent, GdkEvent *event) {
       } else if (xev->type == shape_event + ShapeNotify) {
         XShapeEvent *shape_ev = (XShapeEvent *) xev;
 
-        NS_NOTYETIMPLEMENTED ("ShapeNotify event");
+        if (win && shape_ev->kind == ShapeBounding) {
+          win->SetShaped (shape_ev->shaped);
+          StackingChanged ();
+        }
 
         return GDK_FILTER_REMOVE;
       }
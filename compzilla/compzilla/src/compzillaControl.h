@@ -8,11 +8,16 @@
 #include <nsError.h>
 #include <nsCOMPtr.h>
 #include <nsCOMArray.h>
-#include <nsRefPtrHashtable.h>
+#include <nsAutoPtr.h>
+#include <nsTArray.h>
+#include <nsTHashtable.h>
 #include <nsIWidget.h> // unstable
 
+#include "compzillaEventJournal.h"
+#include "compzillaEventThread.h"
 #include "compzillaIControl.h"
 #include "compzillaWindow.h"
+#include "compzillaWindowIndex.h"
 
 extern "C" {
 #include <gdk/gdkwindow.h>
@@ -37,11 +42,41 @@ public:
     compzillaControl ();
     virtual ~compzillaControl ();
 
+    void WindowDamaged (compzillaWindow *win);
+
+    // win has pointer motion to send on the next frame.
+    void MotionQueued (compzillaWindow *win);
+
+    // Recompute occlusion and fullscreen bypass on the next frame.
+    void StackingChanged ();
+
+    // Subwindows of owner whose substructure events go to it.
+    void AddSubwindow (Window xid, compzillaWindow *owner);
+    void RemoveSubwindow (Window xid, compzillaWindow *owner);
+
+    // Where window events are recorded for batch observers, NULL if there
+    // are none.
+    compzillaEventJournal *GetJournal ();
+
 private:
     already_AddRefed<compzillaWindow> FindWindow (Window win);
 
     void AddWindow (Window win);
+    // Adopt windows that existed before we started, pipelining the
+    // requests for all of them.
+    void AdoptWindows (Window *windows, PRUint32 count);
+    already_AddRefed<compzillaWindow> CreateWindow (Window win,
+                                                    XWindowAttributes *attrs,
+                                                    bool isShaped);
+    void RegisterWindow (compzillaWindow *compwin, Window win);
     void DestroyWindow (nsRefPtr<compzillaWindow> win, Window xwin);
+
+    void UpdateStacking (XEvent *x11_event);
+    void RestackWindow (Window win, Window above);
+    void RemoveStacking (Window win);
+    void UpdateOcclusion ();
+    void UpdateBypass (compzillaWindow *top);
+    bool CoversScreen (compzillaWindow *win);
     void RootClientMessaged (Atom type, int format, long *data/*[5]*/);
 
     GdkWindow *GetNativeWindow(nsIDOMWindow *window);
@@ -52,6 +87,7 @@ private:
     nsresult InitOverlay ();
     nsresult InitManagerWindow ();
     nsresult InitWindowState ();
+    nsresult InitEventThread ();
 
     bool ReplaceSelectionOwner (Window newOwner, Atom atom);
 
@@ -62,17 +98,50 @@ private:
     Window GetEventXWindow (XEvent *x11_event);
 
     GdkFilterReturn Filter (GdkXEvent *xevent, GdkEvent *event);
+    GdkFilterReturn HandleEvent (XEvent *xev, PRUint32 count);
+    bool HandleSubwindowEvent (XEvent *xev);
+
+    // An event read ahead of dispatch.  mCount is the number of events
+    // folded into it, zero if it was dropped.
+    struct PendingEvent {
+        XEvent mEvent;
+        PRUint32 mCount;
+    };
+
+    bool CanCompress (XEvent *xev);
+    bool IsManaged (Window win);
+    bool GetCoalesceDetail (XEvent *xev, unsigned long *detail);
+    void CompressEvents (nsTArray<PendingEvent>& events);
+
+    static Bool CanCompressPredicate (Display *dpy, XEvent *xev, XPointer arg);
 
     static GdkFilterReturn gdk_filter_func (GdkXEvent *xevent, 
                                             GdkEvent *event, 
                                             gpointer data);
+
+    nsresult InitPrefs ();
+
+    void DrainEventThread ();
+    static gboolean EventThreadCb (GIOChannel *source,
+                                   GIOCondition condition,
+                                   gpointer data);
+
+    void ScheduleFrame ();
+    void Frame ();
+    static gboolean FrameCb (gpointer data);
     static int ErrorHandler (Display *, XErrorEvent *);
     static int ClearErrors (Display *dpy);
     static int sErrorCnt;
 
-    static PLDHashOperator CallWindowCreateCb (const PRUint32& key, 
-                                               nsRefPtr<compzillaWindow>& win, 
-                                               void *userdata);
+    static void CallWindowCreateCb (Window xid,
+                                    compzillaWindow *win,
+                                    void *userdata);
+    static void RecordWindowCreateCb (Window xid,
+                                      compzillaWindow *win,
+                                      void *userdata);
+
+    // Deliver window events recorded while dispatching.
+    void FlushJournal ();
 
     Display *mXDisplay;
     Window mXRoot;
@@ -86,8 +155,49 @@ private:
     bool mIsCompositor;
 
     nsCOMPtr<nsIDOMWindow> mDOMWindow;
-    nsRefPtrHashtable<nsUint32HashKey, compzillaWindow> mWindowMap;
+    compzillaWindowIndex mWindows;
     nsCOMArray<compzillaIControlObserver> mObservers;
+    nsCOMArray<compzillaIBatchObserver> mBatchObservers;
+    compzillaEventJournal mJournal;
+
+    // Frame clock.  Windows with damage wait in mDirtyWindows until the
+    // next frame, which is at most mFrameRate frames a second.
+    nsTArray<nsRefPtr<compzillaWindow> > mDirtyWindows;
+    nsTArray<nsRefPtr<compzillaWindow> > mMotionWindows;
+    guint mFrameSourceId;
+    PRUint32 mFrameRate;
+    PRUint32 mFrameCount;
+    PRIntervalTime mLastFrameTime;
+
+    // Children of the root window, bottom to top, including ones we don't
+    // manage so ConfigureNotify's above sibling can always be found.
+    nsTArray<Window> mStacking;
+
+    // The windows the chrome shows, bottom to top, as set by
+    // SetStackingOrder.  This is what is really drawn above what, so it
+    // decides which windows are covered by opaque windows above them.
+    nsTArray<Window> mDrawOrder;
+    bool mStackingChanged;
+    bool mOcclusionCulling;
+
+    // Opaque window covering the whole screen at the top of the stack, which
+    // is unredirected and shown with the overlay hidden.
+    nsRefPtr<compzillaWindow> mBypassWindow;
+    bool mFullscreenUnredirect;
+
+    // Event compression.  While draining the queue, mDrainBlocked is set by
+    // the first event that has to go through GDK in order, and
+    // mDrainCreated holds windows whose CreateNotify was read ahead.
+    bool mCompressEvents;
+    bool mDrainBlocked;
+    nsTHashtable<nsUint32HashKey> mDrainCreated;
+
+    // Reads damage and property events off the main thread when enabled.
+    // Its wakeup is watched until the next frame reads the records.
+    nsAutoPtr<compzillaEventThread> mEventThread;
+    GIOChannel *mEventThreadChannel;
+    guint mEventThreadSourceId;
+    bool mUseEventThread;
 
     static int composite_event, composite_error;
     static int damage_event, damage_error;
@@ -0,0 +1,91 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <nsTArray.h>
+
+#include "compzillaErrorTrap.h"
+#include "Debug.h"
+
+
+// Failures nobody checked are dropped beyond this many.
+#define MAX_FAILED_TRAPS 256
+
+
+struct TrapEntry
+{
+  unsigned long mSerial;
+  bool mFailed;
+};
+
+// In request order.  Only the main thread's display is trapped.
+static nsTArray<TrapEntry> sTraps;
+
+
+/*
+ * Entries the server has got past without an error succeeded, so only the
+ * failures need keeping.
+ */
+static void
+Prune (Display *dpy)
+{
+  unsigned long processed = LastKnownRequestProcessed (dpy);
+
+  PRUint32 failed = 0;
+  for (PRUint32 i = sTraps.Length () - 1; i != PRUint32(-1); --i) {
+    if (sTraps[i].mFailed) {
+      if (++failed > MAX_FAILED_TRAPS)
+        sTraps.RemoveElementAt (i);
+    } else if (sTraps[i].mSerial <= processed) {
+      sTraps.RemoveElementAt (i);
+    }
+  }
+}
+
+
+unsigned long
+compzillaErrorTrap::Trap (Display *dpy)
+{
+  Prune (dpy);
+
+  TrapEntry entry = { NextRequest (dpy), false };
+  sTraps.AppendElement (entry);
+  return entry.mSerial;
+}
+
+
+compzillaErrorTrap::Status
+compzillaErrorTrap::Check (Display *dpy, unsigned long serial)
+{
+  for (PRUint32 i = 0; i < sTraps.Length (); i++) {
+    if (sTraps[i].mSerial == serial) {
+      if (sTraps[i].mFailed) {
+        sTraps.RemoveElementAt (i);
+        return FAILED;
+      }
+      break;
+    }
+  }
+
+  // Errors come in request order, so one for serial would have been read.
+  if (serial <= LastKnownRequestProcessed (dpy)) {
+    Prune (dpy);
+    return SUCCEEDED;
+  }
+
+  return PENDING;
+}
+
+
+bool
+compzillaErrorTrap::HandleError (Display *dpy, XErrorEvent *err)
+{
+  for (PRUint32 i = 0; i < sTraps.Length (); i++) {
+    if (sTraps[i].mSerial == err->serial) {
+      SPEW ("HandleError: trapped error %d for request %lu\n",
+            err->error_code, err->serial);
+      sTraps[i].mFailed = true;
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,34 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaErrorTrap_h___
+#define compzillaErrorTrap_h___
+
+
+extern "C" {
+#include <X11/Xlib.h>
+}
+
+
+/*
+ * Finds out whether single requests failed without syncing with the server.
+ * Trap records the serial of the request about to be sent, the error
+ * handler passes errors to HandleError, and Check tells the outcome once
+ * the server has got to the request.  Errors of trapped requests aren't
+ * logged.
+ */
+class compzillaErrorTrap
+{
+public:
+    enum Status { PENDING, SUCCEEDED, FAILED };
+
+    // Call right before sending the request.  Returns its serial.
+    static unsigned long Trap (Display *dpy);
+
+    static Status Check (Display *dpy, unsigned long serial);
+
+    // Returns true if err was for a trapped request.
+    static bool HandleError (Display *dpy, XErrorEvent *err);
+};
+
+
+#endif
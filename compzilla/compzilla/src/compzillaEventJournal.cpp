@@ -0,0 +1,111 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "compzillaEventJournal.h"
+#include "compzillaWindow.h"
+#include "Debug.h"
+
+
+compzillaEventJournal::compzillaEventJournal ()
+{
+  mWindowIndices.Init (32);
+}
+
+
+PRInt32
+compzillaEventJournal::IndexOf (compzillaWindow *window)
+{
+  if (!window)
+    return -1;
+
+  PRInt32 index;
+  if (mWindowIndices.Get (window, &index))
+    return index;
+
+  index = mWindows.Length ();
+  if (!mWindows.AppendElement (window) ||
+      !mWindowIndices.Put (window, index)) {
+    ERROR ("Out of memory recording window events\n");
+    mWindows.SetLength (index);
+    return -1;
+  }
+
+  return index;
+}
+
+
+void
+compzillaEventJournal::Append (PRInt32 type, compzillaWindow *window,
+                               PRInt32 arg0, PRInt32 arg1, PRInt32 arg2,
+                               PRInt32 arg3, PRInt32 arg4, PRInt32 arg5,
+                               PRInt32 arg6)
+{
+  PRInt32 index = IndexOf (window);
+  if (window && index == -1)
+    return;
+
+  PRInt32 *record =
+    mRecords.AppendElements (compzillaIBatchObserver::RECORD_LENGTH);
+  if (!record) {
+    ERROR ("Out of memory recording window events\n");
+    return;
+  }
+
+  record[0] = type;
+  record[1] = index;
+  record[2] = arg0;
+  record[3] = arg1;
+  record[4] = arg2;
+  record[5] = arg3;
+  record[6] = arg4;
+  record[7] = arg5;
+  record[8] = arg6;
+}
+
+
+void
+compzillaEventJournal::Deliver (const nsCOMArray<compzillaIBatchObserver>& observers)
+{
+  if (IsEmpty ())
+    return;
+
+  // Take the batch and the observers first, so observers can record new
+  // events or remove themselves.
+  nsTArray<nsRefPtr<compzillaWindow> > windows;
+  nsTArray<PRInt32> records;
+  windows.SwapElements (mWindows);
+  records.SwapElements (mRecords);
+  mWindowIndices.Clear ();
+
+  nsCOMArray<compzillaIBatchObserver> batchObservers (observers);
+
+  nsTArray<nsISupports *> iwindows (windows.Length ());
+  for (PRUint32 i = 0; i < windows.Length (); i++) {
+    compzillaIWindow *iwin = windows[i];
+    iwindows.AppendElement (iwin);
+  }
+
+  if (iwindows.Length () != windows.Length ()) {
+    ERROR ("Out of memory delivering window events\n");
+    return;
+  }
+
+  SPEW ("Delivering %d window events for %d windows\n",
+        records.Length () / compzillaIBatchObserver::RECORD_LENGTH,
+        windows.Length ());
+
+  for (PRUint32 i = batchObservers.Count () - 1; i != PRUint32(-1); --i) {
+    batchObservers.ObjectAt (i)->HandleEvents (iwindows.Length (),
+                                               iwindows.Elements (),
+                                               records.Length (),
+                                               records.Elements ());
+  }
+}
+
+
+void
+compzillaEventJournal::Clear ()
+{
+  mWindows.Clear ();
+  mWindowIndices.Clear ();
+  mRecords.Clear ();
+}
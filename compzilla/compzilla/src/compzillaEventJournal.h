@@ -0,0 +1,53 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaEventJournal_h___
+#define compzillaEventJournal_h___
+
+
+#include <nsAutoPtr.h>
+#include <nsCOMArray.h>
+#include <nsDataHashtable.h>
+#include <nsHashKeys.h>
+#include <nsTArray.h>
+
+#include "compzillaIBatchObserver.h"
+
+
+class compzillaWindow;
+
+
+/*
+ * Window events recorded while a batch of X events is dispatched, for
+ * compzillaIBatchObserver.  Records are compzillaIBatchObserver::RECORD_LENGTH
+ * longs each, and windows are listed once per batch however many events
+ * they had, so JS gets the whole batch in a single call.
+ */
+class compzillaEventJournal
+{
+public:
+    compzillaEventJournal ();
+
+    bool IsEmpty () const { return mRecords.Length () == 0; }
+
+    // window is NULL for the root window.
+    void Append (PRInt32 type, compzillaWindow *window,
+                 PRInt32 arg0 = 0, PRInt32 arg1 = 0, PRInt32 arg2 = 0,
+                 PRInt32 arg3 = 0, PRInt32 arg4 = 0, PRInt32 arg5 = 0,
+                 PRInt32 arg6 = 0);
+
+    // Index of window in the batch, adding it if needed.  -1 for NULL.
+    PRInt32 IndexOf (compzillaWindow *window);
+
+    // Hands the batch to observers and starts a new one.  Events recorded
+    // by the observers go in the new batch.
+    void Deliver (const nsCOMArray<compzillaIBatchObserver>& observers);
+    void Clear ();
+
+private:
+    nsTArray<nsRefPtr<compzillaWindow> > mWindows;
+    nsDataHashtable<nsVoidPtrHashKey, PRInt32> mWindowIndices;
+    nsTArray<PRInt32> mRecords;
+};
+
+
+#endif
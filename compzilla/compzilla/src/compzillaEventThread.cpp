@@ -0,0 +1,455 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <nsAutoPtr.h>
+#include <pratom.h>
+
+#include "compzillaEventThread.h"
+#include "Debug.h"
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+}
+
+
+// How long to wait before retrying records which didn't fit in the ring.
+#define RETRY_INTERVAL_MS 10
+
+// Events read before publishing what we have.
+#define MAX_EVENTS_PER_PASS 1024
+
+// Pending damage is simplified to this many boxes per window, like
+// compzillaWindow does before drawing.
+#define MAX_DAMAGE_RECTS 4
+#define MAX_PENDING_RECTS 32
+
+
+static bool
+MakePipe (int fds[2])
+{
+  if (pipe (fds) < 0) {
+    fds[0] = fds[1] = -1;
+    return false;
+  }
+
+  // Neither side ever waits on a write, and reads drain what is there.
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+
+static void
+DrainPipe (int fd)
+{
+  char buf[64];
+  while (read (fd, buf, sizeof (buf)) > 0) {
+    // Do nothing
+  }
+}
+
+
+compzillaEventThread::compzillaEventThread (xcb_connection_t *conn,
+                                            PRUint8 damageEvent)
+  : mConnection(conn),
+    mDamageEvent(damageEvent),
+    mThread(NULL),
+    mStopped(false),
+    mLock(PR_NewLock ()),
+    mHead(0),
+    mTail(0),
+    mWakePending(0)
+{
+  mCommandPipe[0] = mCommandPipe[1] = -1;
+  mWakePipe[0] = mWakePipe[1] = -1;
+}
+
+
+compzillaEventThread::~compzillaEventThread ()
+{
+  if (mThread) {
+    PR_Lock (mLock);
+    mStopped = true;
+    PR_Unlock (mLock);
+
+    write (mCommandPipe[1], "", 1);
+    PR_JoinThread (mThread);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (mCommandPipe[i] >= 0)
+      close (mCommandPipe[i]);
+    if (mWakePipe[i] >= 0)
+      close (mWakePipe[i]);
+  }
+
+  if (mLock)
+    PR_DestroyLock (mLock);
+
+  xcb_disconnect (mConnection);
+}
+
+
+compzillaEventThread *
+compzillaEventThread::Create (Display *mainDisplay)
+{
+  // Set up on the main thread, after this the connection is only used
+  // from the event thread.
+  xcb_connection_t *conn = xcb_connect (DisplayString (mainDisplay), NULL);
+  if (xcb_connection_has_error (conn)) {
+    WARNING ("Can't open a display connection for the event thread\n");
+    xcb_disconnect (conn);
+    return nsnull;
+  }
+
+  const xcb_query_extension_reply_t *damageExt =
+    xcb_get_extension_data (conn, &xcb_damage_id);
+  if (!damageExt || !damageExt->present) {
+    xcb_disconnect (conn);
+    return nsnull;
+  }
+
+  // The version has to be negotiated before any other damage request.
+  xcb_damage_query_version_reply_t *version =
+    xcb_damage_query_version_reply (conn,
+                                    xcb_damage_query_version (conn,
+                                                              XCB_DAMAGE_MAJOR_VERSION,
+                                                              XCB_DAMAGE_MINOR_VERSION),
+                                    NULL);
+  if (!version) {
+    xcb_disconnect (conn);
+    return nsnull;
+  }
+  free (version);
+
+  nsAutoPtr<compzillaEventThread> thread =
+    new compzillaEventThread (conn, damageExt->first_event);
+  if (!thread) {
+    xcb_disconnect (conn);
+    return nsnull;
+  }
+
+  if (!thread->mLock ||
+      !thread->mDamages.Init () ||
+      !thread->mPendingDamage.Init () ||
+      !MakePipe (thread->mCommandPipe) ||
+      !MakePipe (thread->mWakePipe)) {
+    return nsnull;
+  }
+
+  thread->mThread = PR_CreateThread (PR_USER_THREAD,
+                                     ThreadFunc,
+                                     thread.get (),
+                                     PR_PRIORITY_NORMAL,
+                                     PR_GLOBAL_THREAD,
+                                     PR_JOINABLE_THREAD,
+                                     0);
+  if (!thread->mThread) {
+    WARNING ("Can't start the event thread\n");
+    return nsnull;
+  }
+
+  INFO ("Reading window events on a separate thread\n");
+  return thread.forget ();
+}
+
+
+void
+compzillaEventThread::Watch (Window win)
+{
+  Command cmd = { win, true };
+
+  PR_Lock (mLock);
+  mCommands.AppendElement (cmd);
+  PR_Unlock (mLock);
+
+  write (mCommandPipe[1], "", 1);
+}
+
+
+void
+compzillaEventThread::Unwatch (Window win)
+{
+  Command cmd = { win, false };
+
+  PR_Lock (mLock);
+  mCommands.AppendElement (cmd);
+  PR_Unlock (mLock);
+
+  write (mCommandPipe[1], "", 1);
+}
+
+
+/*
+ * Copy up to max records into records.  Call until it returns less than
+ * max, records left behind don't wake the main thread again.
+ */
+PRUint32
+compzillaEventThread::Read (Record *records, PRUint32 max)
+{
+  // Clear the wakeup before reading, so anything pushed from here on wakes
+  // us again.
+  PR_AtomicSet (&mWakePending, 0);
+  DrainPipe (mWakePipe[0]);
+
+  PRInt32 head = PR_AtomicAdd (&mHead, 0);
+  PRUint32 count = 0;
+
+  while (count < max && mTail != head) {
+    records[count++] = mRing[mTail & (RING_SIZE - 1)];
+    PR_AtomicSet (&mTail, PRInt32 (PRUint32 (mTail) + 1));
+  }
+
+  return count;
+}
+
+
+void
+compzillaEventThread::ThreadFunc (void *arg)
+{
+  static_cast<compzillaEventThread *>(arg)->Run ();
+}
+
+
+void
+compzillaEventThread::Run ()
+{
+  struct pollfd fds[2];
+  fds[0].fd = xcb_get_file_descriptor (mConnection);
+  fds[0].events = POLLIN;
+  fds[1].fd = mCommandPipe[0];
+  fds[1].events = POLLIN;
+
+  bool moreEvents = false;
+
+  while (true) {
+    xcb_flush (mConnection);
+
+    if (xcb_connection_has_error (mConnection)) {
+      WARNING ("Event thread lost its display connection\n");
+      break;
+    }
+
+    // ReadEvents leaves nothing queued unless it stopped early, so the
+    // socket can be polled.
+    if (!moreEvents) {
+      bool waiting = !mPendingRecords.IsEmpty () || mPendingDamage.Count ();
+      poll (fds, 2, waiting ? RETRY_INTERVAL_MS : -1);
+    }
+
+    DrainPipe (mCommandPipe[0]);
+
+    PR_Lock (mLock);
+    bool stopped = mStopped;
+    PR_Unlock (mLock);
+
+    if (stopped)
+      break;
+
+    RunCommands ();
+    moreEvents = ReadEvents ();
+    Publish ();
+  }
+}
+
+
+void
+compzillaEventThread::RunCommands ()
+{
+  nsTArray<Command> commands;
+
+  PR_Lock (mLock);
+  commands.SwapElements (mCommands);
+  PR_Unlock (mLock);
+
+  nsTArray<Window> watched;
+
+  for (PRUint32 i = 0; i < commands.Length (); i++) {
+    Window win = commands[i].mWindow;
+
+    // Requests for windows which are already gone fail harmlessly, their
+    // errors are dropped by ReadEvents.
+    if (commands[i].mWatch) {
+      PRUint32 mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+      xcb_change_window_attributes (mConnection, win,
+                                    XCB_CW_EVENT_MASK, &mask);
+
+      xcb_damage_damage_t damage = xcb_generate_id (mConnection);
+      xcb_damage_create (mConnection, damage, win,
+                         XCB_DAMAGE_REPORT_LEVEL_RAW_RECTANGLES);
+      mDamages.Put (win, damage);
+      watched.AppendElement (win);
+    } else {
+      xcb_damage_damage_t damage;
+      if (mDamages.Get (win, &damage)) {
+        xcb_damage_destroy (mConnection, damage);
+        mDamages.Remove (win);
+      }
+
+      PRUint32 mask = XCB_EVENT_MASK_NO_EVENT;
+      xcb_change_window_attributes (mConnection, win,
+                                    XCB_CW_EVENT_MASK, &mask);
+
+      mPendingDamage.Remove (win);
+      for (PRUint32 j = mPendingRecords.Length () - 1; j != PRUint32(-1); --j) {
+        if (mPendingRecords[j].mWindow == win)
+          mPendingRecords.RemoveElementAt (j);
+      }
+    }
+  }
+
+  if (watched.IsEmpty ())
+    return;
+
+  // The main connection stops selecting these events when it gets the
+  // WATCHED record, so the server must have our selections by then.
+  Sync ();
+
+  for (PRUint32 i = 0; i < watched.Length (); i++) {
+    Record record;
+    record.mType = Record::WATCHED;
+    record.mWindow = watched[i];
+    mPendingRecords.AppendElement (record);
+  }
+}
+
+
+/*
+ * Wait until the server has processed everything sent so far.  Events read
+ * meanwhile stay queued for ReadEvents.
+ */
+void
+compzillaEventThread::Sync ()
+{
+  free (xcb_get_input_focus_reply (mConnection,
+                                   xcb_get_input_focus (mConnection),
+                                   NULL));
+}
+
+
+/*
+ * Returns true if it stopped with events possibly left to read.
+ */
+bool
+compzillaEventThread::ReadEvents ()
+{
+  for (int n = 0; n < MAX_EVENTS_PER_PASS; n++) {
+    xcb_generic_event_t *ev = xcb_poll_for_event (mConnection);
+    if (!ev)
+      return false;
+
+    PRUint8 type = ev->response_type & ~0x80;
+
+    if (type == mDamageEvent + XCB_DAMAGE_NOTIFY) {
+      xcb_damage_notify_event_t *damage_ev = (xcb_damage_notify_event_t *) ev;
+
+      compzillaRegion *region;
+      if (!mPendingDamage.Get (damage_ev->drawable, &region)) {
+        region = new compzillaRegion ();
+        if (!region) {
+          free (ev);
+          continue;
+        }
+        mPendingDamage.Put (damage_ev->drawable, region);
+      }
+
+      region->UnionRect (damage_ev->area.x, damage_ev->area.y,
+                         damage_ev->area.width, damage_ev->area.height);
+      if (region->NumRects () > MAX_PENDING_RECTS)
+        region->Simplify (MAX_DAMAGE_RECTS);
+    } else if (type == XCB_PROPERTY_NOTIFY) {
+      xcb_property_notify_event_t *prop_ev = (xcb_property_notify_event_t *) ev;
+
+      Record record;
+      record.mType = Record::PROPERTY;
+      record.mWindow = prop_ev->window;
+      record.mAtom = prop_ev->atom;
+      record.mDeleted = prop_ev->state == XCB_PROPERTY_DELETE;
+
+      // Only the latest change to a property matters.
+      for (PRUint32 i = mPendingRecords.Length () - 1; i != PRUint32(-1); --i) {
+        Record& pending = mPendingRecords[i];
+        if (pending.mType == Record::PROPERTY &&
+            pending.mWindow == record.mWindow &&
+            pending.mAtom == record.mAtom) {
+          mPendingRecords.RemoveElementAt (i);
+          break;
+        }
+      }
+
+      mPendingRecords.AppendElement (record);
+    }
+
+    // Errors (type 0) land here too, and are dropped.
+    free (ev);
+  }
+
+  return true;
+}
+
+
+bool
+compzillaEventThread::Push (const Record& record)
+{
+  PRInt32 tail = PR_AtomicAdd (&mTail, 0);
+  if (PRUint32 (mHead) - PRUint32 (tail) >= RING_SIZE)
+    return false;
+
+  mRing[mHead & (RING_SIZE - 1)] = record;
+
+  // Publishes the record.
+  PR_AtomicSet (&mHead, PRInt32 (PRUint32 (mHead) + 1));
+  return true;
+}
+
+
+PLDHashOperator
+compzillaEventThread::PublishDamage (const PRUint32& key,
+                                     nsAutoPtr<compzillaRegion>& region,
+                                     void *userdata)
+{
+  compzillaEventThread *thread = static_cast<compzillaEventThread *>(userdata);
+
+  region->Simplify (MAX_DAMAGE_RECTS);
+
+  // All of a window's boxes go at once, or none do.
+  PRInt32 tail = PR_AtomicAdd (&thread->mTail, 0);
+  PRUint32 space = RING_SIZE - (PRUint32 (thread->mHead) - PRUint32 (tail));
+  if (space < region->NumRects ())
+    return PL_DHASH_STOP;
+
+  const compzillaBox *boxes = region->Rects ();
+  for (PRUint32 i = 0; i < region->NumRects (); i++) {
+    Record record;
+    record.mType = Record::DAMAGE;
+    record.mWindow = key;
+    record.mRect.x = boxes[i].x1;
+    record.mRect.y = boxes[i].y1;
+    record.mRect.width = boxes[i].x2 - boxes[i].x1;
+    record.mRect.height = boxes[i].y2 - boxes[i].y1;
+    thread->Push (record);
+  }
+
+  return PL_DHASH_REMOVE;
+}
+
+
+void
+compzillaEventThread::Publish ()
+{
+  PRInt32 head = mHead;
+
+  PRUint32 sent = 0;
+  while (sent < mPendingRecords.Length () && Push (mPendingRecords[sent]))
+    sent++;
+  mPendingRecords.RemoveElementsAt (0, sent);
+
+  // Damage after the watch acks and property changes it follows.
+  if (mPendingRecords.IsEmpty ())
+    mPendingDamage.Enumerate (PublishDamage, this);
+
+  if (mHead != head && PR_AtomicSet (&mWakePending, 1) == 0)
+    write (mWakePipe[1], "", 1);
+}
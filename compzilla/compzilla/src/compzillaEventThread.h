@@ -0,0 +1,116 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaEventThread_h___
+#define compzillaEventThread_h___
+
+
+#include <nsClassHashtable.h>
+#include <nsDataHashtable.h>
+#include <nsTArray.h>
+#include <prlock.h>
+#include <prthread.h>
+
+extern "C" {
+#include <X11/Xlib.h>
+#include <xcb/xcb.h>
+#include <xcb/damage.h>
+}
+
+#include "compzillaRegion.h"
+
+
+/*
+ * Reads damage and property events for managed windows on a connection and
+ * thread of its own, so they keep being read, and coalesced, while the main
+ * thread is busy in Gecko.  The connection is plain XCB: Xlib wasn't set up
+ * with XInitThreads, and errors come back in the event stream instead of
+ * going through Xlib's process wide error handler.  The main thread asks for windows to be watched,
+ * gets woken through GetWakeFd when there is something to read, and takes
+ * the coalesced records with Read once per frame.
+ *
+ * Records travel through a single-producer single-consumer ring, so neither
+ * side blocks the other.  Watch requests go the other way under a lock,
+ * since there are few of them.
+ */
+class compzillaEventThread
+{
+public:
+    struct Record {
+        enum { DAMAGE, PROPERTY, WATCHED };
+
+        PRUint8 mType;
+        Window mWindow;
+
+        // DAMAGE
+        XRectangle mRect;
+
+        // PROPERTY
+        Atom mAtom;
+        bool mDeleted;
+    };
+
+    // Opens the thread's connection to mainDisplay's server and starts it.
+    // Returns null if it can't.  Errors on that connection are expected,
+    // for windows destroyed before the thread got to them, and dropped.
+    static compzillaEventThread *Create (Display *mainDisplay);
+    ~compzillaEventThread ();
+
+    // Start or stop reading events for win.  A WATCHED record is sent once
+    // the thread gets all of win's events, from then on the main connection
+    // can stop selecting them.
+    void Watch (Window win);
+    void Unwatch (Window win);
+
+    // Readable when records are waiting.  Read clears it.
+    int GetWakeFd () { return mWakePipe[0]; }
+    PRUint32 Read (Record *records, PRUint32 max);
+
+private:
+    compzillaEventThread (xcb_connection_t *conn, PRUint8 damageEvent);
+
+    struct Command {
+        Window mWindow;
+        bool mWatch;
+    };
+
+    static void ThreadFunc (void *arg);
+    void Run ();
+    void RunCommands ();
+    bool ReadEvents ();
+    void Sync ();
+    void Publish ();
+    bool Push (const Record& record);
+
+    static PLDHashOperator PublishDamage (const PRUint32& key,
+                                          nsAutoPtr<compzillaRegion>& region,
+                                          void *userdata);
+
+    xcb_connection_t *mConnection;
+    PRUint8 mDamageEvent;
+    PRThread *mThread;
+    bool mStopped;
+
+    // Main thread to event thread.
+    PRLock *mLock;
+    nsTArray<Command> mCommands;
+    int mCommandPipe[2];
+
+    // Event thread to main thread.  mHead is only written by the event
+    // thread, mTail only by the main thread, and both only ever grow.
+    // mWakePending is set while a wakeup byte is in the pipe.
+    enum { RING_SIZE = 4096 };
+    Record mRing[RING_SIZE];
+    PRInt32 mHead;
+    PRInt32 mTail;
+    PRInt32 mWakePending;
+    int mWakePipe[2];
+
+    // Event thread only.  Damage objects by window, and what has been read
+    // but not yet published.
+    nsDataHashtable<nsUint32HashKey, xcb_damage_damage_t> mDamages;
+    nsClassHashtable<nsUint32HashKey, compzillaRegion> mPendingDamage;
+    nsTArray<Record> mPendingRecords;
+};
+
+
+#endif
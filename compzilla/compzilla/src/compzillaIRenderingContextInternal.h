@@ -7,9 +7,9 @@
 #include <nsICanvasRenderingContextInternal.h> // unstable
 
 
-// {fa62d345-f608-47eb-9401-533984cfd471}
+// {3e8b1c52-7d9a-4f06-b3c4-2a61e05f9d87}
 #define COMPZILLA_RENDERING_CONTEXT_INTERNAL_IID \
-    { 0xfa62d345, 0xf608, 0x47eb, { 0x94, 0x01, 0x53, 0x39, 0x84, 0xcf, 0xd4, 0x71 } }
+    { 0x3e8b1c52, 0x7d9a, 0x4f06, { 0xb3, 0xc4, 0x2a, 0x61, 0xe0, 0x5f, 0x9d, 0x87 } }
 
 class compzillaIRenderingContextInternal 
     : public nsICanvasRenderingContextInternal 
@@ -28,6 +28,9 @@ public:
     NS_IMETHOD Redraw(const gfxRect&) = 0;
 
     NS_IMETHOD SetDrawable (Display *dpy, Drawable drawable, Visual *visual) = 0;
+
+    // Draw from a client side surface, such as a MIT-SHM copy of the window.
+    NS_IMETHOD SetSurface (gfxASurface *surface) = 0;
 };
 
 NS_DEFINE_STATIC_IID_ACCESSOR(compzillaIRenderingContextInternal, COMPZILLA_RENDERING_CONTEXT_INTERNAL_IID)
@@ -0,0 +1,420 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <nsAutoPtr.h>
+#include <nsIThread.h>
+#include <nsThreadUtils.h>
+
+#include <gfxImageSurface.h> // unstable
+
+#include "compzillaIconLoader.h"
+#include "compzillaWindow.h"
+#include "compzillaXcb.h"
+#include "Debug.h"
+#include "XAtoms.h"
+
+extern "C" {
+#include <X11/Xatom.h>
+}
+
+extern XAtoms atoms;
+
+
+// Property values are read this many 32 bit units at a time.  The first
+// chunk usually holds every image small enough for a frame.
+#define ICON_CHUNK_LENGTH 4096
+
+// Images larger than this, or past this many in the property, are ignored.
+#define MAX_ICON_SIZE 1024
+#define MAX_ICON_IMAGES 32
+
+
+nsIThread *compzillaIconLoader::sThread = nsnull;
+
+
+/*
+ * Prefer the smallest image at least size pixels big, else the largest.
+ */
+static bool
+IsBetterFit (PRUint32 width, PRUint32 height,
+             PRUint32 bestWidth, PRUint32 bestHeight,
+             PRUint32 size)
+{
+  if (bestWidth == 0)
+    return true;
+
+  PRUint32 extent = PR_MAX (width, height);
+  PRUint32 bestExtent = PR_MAX (bestWidth, bestHeight);
+
+  if (bestExtent >= size)
+    return extent >= size && extent < bestExtent;
+
+  return extent > bestExtent;
+}
+
+
+/*
+ * FNV-1a over the size and pixels.
+ */
+static PRUint32
+HashImage (const nsTArray<PRUint32>& pixels, PRUint32 width, PRUint32 height)
+{
+  PRUint32 hash = 2166136261U;
+
+  hash = (hash ^ width) * 16777619U;
+  hash = (hash ^ height) * 16777619U;
+
+  for (PRUint32 i = 0; i < pixels.Length (); i++) {
+    hash = (hash ^ pixels[i]) * 16777619U;
+  }
+
+  return hash;
+}
+
+
+bool
+compzillaIconLoader::Fetch (Display *dpy,
+                            Window win,
+                            const nsTArray<PRUint32>& sizes,
+                            Layout& layout,
+                            nsTArray<Image>& images,
+                            nsTArray<PRUint32>& picked)
+{
+  Atom prop = atoms.x._NET_WM_ICON;
+
+  // The first chunk, and the headers the last layout had past it, all in
+  // one round trip.
+  xcb_get_property_cookie_t firstCookie =
+    compzillaPropertyReply::Request (dpy, win, prop, XA_CARDINAL,
+                                     0, ICON_CHUNK_LENGTH);
+
+  nsTArray<PRUint32> guessOffsets;
+  nsTArray<xcb_get_property_cookie_t> guessCookies;
+  for (PRUint32 i = 0; i < layout.Length (); i++) {
+    if (layout[i].mOffset + 2 <= ICON_CHUNK_LENGTH)
+      continue;
+
+    guessOffsets.AppendElement (layout[i].mOffset);
+    guessCookies.AppendElement (compzillaPropertyReply::Request (dpy, win, prop,
+                                                                 XA_CARDINAL,
+                                                                 layout[i].mOffset,
+                                                                 2));
+  }
+
+  compzillaPropertyReply first;
+  bool found = first.Get (dpy, firstCookie) &&
+    first.Type () == XA_CARDINAL && first.Format () == 32;
+
+  // Every reply is collected, even after a failure.  They hold what is at
+  // those offsets now, and are used if the walk gets to the same offsets.
+  Layout guessed;
+  for (PRUint32 i = 0; i < guessCookies.Length (); i++) {
+    compzillaPropertyReply header;
+    if (!header.Get (dpy, guessCookies[i]) ||
+        header.Format () != 32 || header.Count () < 2)
+      continue;
+
+    Header h = { guessOffsets[i],
+                 ((PRUint32 *) header.Value ())[0],
+                 ((PRUint32 *) header.Value ())[1] };
+    guessed.AppendElement (h);
+  }
+
+  layout.Clear ();
+  if (!found)
+    return false;
+
+  const PRUint32 *data = (const PRUint32 *) first.Value ();
+  PRUint32 fetched = first.Count ();
+  PRUint32 total = fetched + first.BytesAfter () / 4;
+
+  // Each image is its width and height followed by the pixels.  Headers
+  // past the first chunk which weren't requested above are read on their
+  // own, skipping the pixels.
+  PRUint32 pos = 0;
+  PRUint32 guess = 0;
+
+  for (PRUint32 n = 0; n < MAX_ICON_IMAGES && pos + 2 <= total; n++) {
+    PRUint32 w, h;
+
+    while (guess < guessed.Length () && guessed[guess].mOffset < pos)
+      guess++;
+
+    if (pos + 2 <= fetched) {
+      w = data[pos];
+      h = data[pos + 1];
+    } else if (guess < guessed.Length () && guessed[guess].mOffset == pos) {
+      w = guessed[guess].mWidth;
+      h = guessed[guess].mHeight;
+    } else {
+      compzillaPropertyReply header;
+      if (!header.Get (dpy,
+                       compzillaPropertyReply::Request (dpy, win, prop,
+                                                        XA_CARDINAL, pos, 2)) ||
+          header.Format () != 32 || header.Count () < 2)
+        break;
+
+      w = ((PRUint32 *) header.Value ())[0];
+      h = ((PRUint32 *) header.Value ())[1];
+    }
+
+    if (w == 0 || h == 0 || w > MAX_ICON_SIZE || h > MAX_ICON_SIZE ||
+        w * h > total - pos - 2) {
+      WARNING ("Invalid _NET_WM_ICON image %dx%d on window %p\n", w, h, win);
+      break;
+    }
+
+    Header entry = { pos, w, h };
+    layout.AppendElement (entry);
+
+    pos += 2 + w * h;
+  }
+
+  if (layout.IsEmpty ())
+    return false;
+
+  // The best image for each size.  Images fitting several sizes are only
+  // read once.
+  nsTArray<PRUint32> wanted;
+  if (!picked.SetLength (sizes.Length ()))
+    return false;
+
+  for (PRUint32 s = 0; s < sizes.Length (); s++) {
+    PRUint32 best = 0;
+    for (PRUint32 i = 1; i < layout.Length (); i++) {
+      if (IsBetterFit (layout[i].mWidth, layout[i].mHeight,
+                       layout[best].mWidth, layout[best].mHeight,
+                       sizes[s]))
+        best = i;
+    }
+
+    PRUint32 index = wanted.IndexOf (best);
+    if (index == wanted.NoIndex) {
+      index = wanted.Length ();
+      wanted.AppendElement (best);
+    }
+    picked[s] = index;
+  }
+
+  if (!images.SetLength (wanted.Length ()))
+    return false;
+
+  // Request the chunks of every image past the first chunk before
+  // collecting any of them.
+  nsTArray<xcb_get_property_cookie_t> cookies;
+  nsTArray<PRUint32> cookieImages;
+
+  for (PRUint32 i = 0; i < wanted.Length (); i++) {
+    const Header& header = layout[wanted[i]];
+    Image& image = images[i];
+
+    PRUint32 start = header.mOffset + 2;
+    PRUint32 count = header.mWidth * header.mHeight;
+
+    image.mWidth = header.mWidth;
+    image.mHeight = header.mHeight;
+    if (!image.mPixels.SetLength (count))
+      return false;
+
+    if (start + count <= fetched) {
+      memcpy (image.mPixels.Elements (), data + start,
+              count * sizeof (PRUint32));
+      continue;
+    }
+
+    for (PRUint32 offset = start; offset < start + count;
+         offset += ICON_CHUNK_LENGTH) {
+      PRUint32 length = PR_MIN (ICON_CHUNK_LENGTH, start + count - offset);
+      cookies.AppendElement (compzillaPropertyReply::Request (dpy, win, prop,
+                                                              XA_CARDINAL,
+                                                              offset, length));
+      cookieImages.AppendElement (i);
+    }
+  }
+
+  // Each image's chunks are together and in order.
+  bool complete = true;
+  PRUint32 copied = 0;
+
+  for (PRUint32 c = 0; c < cookies.Length (); c++) {
+    Image& image = images[cookieImages[c]];
+    if (c == 0 || cookieImages[c] != cookieImages[c - 1])
+      copied = 0;
+
+    compzillaPropertyReply chunk;
+    if (chunk.Get (dpy, cookies[c]) && chunk.Format () == 32) {
+      PRUint32 n = PR_MIN (chunk.Count (), image.mPixels.Length () - copied);
+      memcpy (image.mPixels.Elements () + copied, chunk.Value (),
+              n * sizeof (PRUint32));
+      copied += n;
+    }
+
+    if ((c + 1 == cookies.Length () || cookieImages[c + 1] != cookieImages[c]) &&
+        copied != image.mPixels.Length ())
+      complete = false;
+  }
+
+  // The property changed in between.  Its PropertyNotify loads it again.
+  if (!complete)
+    return false;
+
+  for (PRUint32 i = 0; i < images.Length (); i++) {
+    images[i].mHash = HashImage (images[i].mPixels,
+                                 images[i].mWidth, images[i].mHeight);
+  }
+
+  return true;
+}
+
+
+/*
+ * Box filter: each destination pixel averages the source pixels it
+ * covers, weighted by alpha, so the result comes out premultiplied as cairo
+ * wants it.  Upscaling repeats pixels.
+ */
+static void
+ScalePixels (const PRUint32 *src, PRUint32 srcWidth, PRUint32 srcHeight,
+             PRUint8 *dest, PRUint32 destWidth, PRUint32 destHeight,
+             PRUint32 destStride)
+{
+  for (PRUint32 dy = 0; dy < destHeight; dy++) {
+    PRUint32 sy0 = dy * srcHeight / destHeight;
+    PRUint32 sy1 = PR_MAX ((dy + 1) * srcHeight / destHeight, sy0 + 1);
+
+    PRUint32 *row = (PRUint32 *) (dest + dy * destStride);
+
+    for (PRUint32 dx = 0; dx < destWidth; dx++) {
+      PRUint32 sx0 = dx * srcWidth / destWidth;
+      PRUint32 sx1 = PR_MAX ((dx + 1) * srcWidth / destWidth, sx0 + 1);
+
+      PRUint32 a = 0, r = 0, g = 0, b = 0;
+      for (PRUint32 sy = sy0; sy < sy1; sy++) {
+        const PRUint32 *p = src + sy * srcWidth;
+        for (PRUint32 sx = sx0; sx < sx1; sx++) {
+          PRUint32 alpha = p[sx] >> 24;
+          a += alpha;
+          r += ((p[sx] >> 16) & 0xff) * alpha;
+          g += ((p[sx] >> 8) & 0xff) * alpha;
+          b += (p[sx] & 0xff) * alpha;
+        }
+      }
+
+      PRUint32 n = (sy1 - sy0) * (sx1 - sx0);
+      row[dx] = ((a / n) << 24 |
+                 (r / (255 * n)) << 16 |
+                 (g / (255 * n)) << 8 |
+                 (b / (255 * n)));
+    }
+  }
+}
+
+
+/*
+ * Scales on the worker thread, then dispatches itself back to the main
+ * thread to deliver the surface.  The window and surface aren't thread
+ * safe, so they are only referenced and released on the main thread.
+ */
+class IconScaleJob : public nsRunnable
+{
+public:
+  IconScaleJob (compzillaWindow *window,
+                PRUint32 size,
+                PRUint32 hash,
+                gfxImageSurface *surface,
+                nsTArray<PRUint32>& pixels,
+                PRUint32 width,
+                PRUint32 height)
+    : mWindow (window),
+      mSize (size),
+      mHash (hash),
+      mSurface (surface),
+      mWidth (width),
+      mHeight (height)
+  {
+    mPixels.SwapElements (pixels);
+  }
+
+  NS_IMETHOD Run ()
+  {
+    if (!NS_IsMainThread ()) {
+      ScalePixels (mPixels.Elements (), mWidth, mHeight,
+                   mSurface->Data (),
+                   mSurface->Width (), mSurface->Height (),
+                   mSurface->Stride ());
+      mPixels.Clear ();
+
+      nsresult rv = NS_DispatchToMainThread (this);
+      if (NS_FAILED (rv)) {
+        // Shutting down.  Leak rather than release on this thread.
+        mWindow.forget ();
+        mSurface.forget ();
+      }
+      return rv;
+    }
+
+    mSurface->MarkDirty ();
+    mWindow->IconLoaded (mSize, mHash, mSurface);
+
+    mWindow = nsnull;
+    mSurface = nsnull;
+
+    return NS_OK;
+  }
+
+private:
+  nsRefPtr<compzillaWindow> mWindow;
+  PRUint32 mSize;
+  PRUint32 mHash;
+  nsRefPtr<gfxImageSurface> mSurface;
+  nsTArray<PRUint32> mPixels;
+  PRUint32 mWidth;
+  PRUint32 mHeight;
+};
+
+
+nsresult
+compzillaIconLoader::Scale (compzillaWindow *window,
+                            PRUint32 size,
+                            PRUint32 hash,
+                            nsTArray<PRUint32>& pixels,
+                            PRUint32 width,
+                            PRUint32 height)
+{
+  if (!sThread) {
+    nsresult rv = NS_NewThread (&sThread);
+    if (NS_FAILED (rv)) {
+      ERROR ("Failed to create the icon thread\n");
+      return rv;
+    }
+  }
+
+  // Fit size x size, keeping the aspect ratio.
+  PRUint32 destWidth = size, destHeight = size;
+  if (width > height)
+    destHeight = PR_MAX (height * size / width, 1);
+  else
+    destWidth = PR_MAX (width * size / height, 1);
+
+  nsRefPtr<gfxImageSurface> surface =
+    new gfxImageSurface (gfxIntSize (destWidth, destHeight),
+                         gfxASurface::ImageFormatARGB32);
+  if (!surface || surface->CairoStatus ())
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  nsCOMPtr<nsIRunnable> job = new IconScaleJob (window, size, hash, surface,
+                                                pixels, width, height);
+  if (!job)
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  return sThread->Dispatch (job, NS_DISPATCH_NORMAL);
+}
+
+
+void
+compzillaIconLoader::Shutdown ()
+{
+  if (sThread) {
+    // Runs the pending deliveries.
+    sThread->Shutdown ();
+    NS_RELEASE (sThread);
+  }
+}
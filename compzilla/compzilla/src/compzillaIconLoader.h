@@ -0,0 +1,79 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaIconLoader_h___
+#define compzillaIconLoader_h___
+
+
+#include <nsTArray.h>
+
+extern "C" {
+#include <X11/Xlib.h>
+}
+
+
+class compzillaWindow;
+class nsIThread;
+
+
+/*
+ * Reads window icons from _NET_WM_ICON and scales them for display.
+ *
+ * The property often holds several images, some of them large.  Fetch walks
+ * the image headers and only reads the pixels of the images fitting best, in
+ * chunks, so an app updating a big or animated icon costs about one small
+ * image per update.  Scaling and premultiplying run on a worker thread, and
+ * the window gets the finished surface on the main thread.
+ */
+class compzillaIconLoader
+{
+public:
+    struct Image {
+        // Unpremultiplied ARGB.
+        nsTArray<PRUint32> mPixels;
+        PRUint32 mWidth;
+        PRUint32 mHeight;
+
+        // Identifies the image, to find out whether it changed.
+        PRUint32 mHash;
+    };
+
+    // Where the images were in the property at the last Fetch.  Apps
+    // updating their icon usually keep the same sizes, so the next Fetch
+    // requests all these headers along with the first chunk, and only reads
+    // headers one at a time where the layout changed.
+    struct Header {
+        PRUint32 mOffset;
+        PRUint32 mWidth;
+        PRUint32 mHeight;
+    };
+    typedef nsTArray<Header> Layout;
+
+    // Read the property once, for all of sizes.  picked[i] is the index in
+    // images of the image best fitting sizes[i] x sizes[i]; sizes fitted by
+    // the same image share it.  layout is used and updated.  Returns false
+    // if the window has no usable icon.
+    static bool Fetch (Display *dpy,
+                       Window win,
+                       const nsTArray<PRUint32>& sizes,
+                       Layout& layout,
+                       nsTArray<Image>& images,
+                       nsTArray<PRUint32>& picked);
+
+    // Scale the pixels to fit size x size on the worker thread, then pass
+    // the surface to window->IconLoaded on the main thread.  Takes the
+    // contents of pixels.
+    static nsresult Scale (compzillaWindow *window,
+                           PRUint32 size,
+                           PRUint32 hash,
+                           nsTArray<PRUint32>& pixels,
+                           PRUint32 width,
+                           PRUint32 height);
+
+    static void Shutdown ();
+
+private:
+    static nsIThread *sThread;
+};
+
+
+#endif
@@ -12,8 +12,11 @@
 #include <nsISupportsUtils.h>
 #include <nsServiceManagerUtils.h>
 
+#include "compzillaAtomCache.h"
 #include "compzillaControl.h"
 #include "compzillaRenderingContext.h"
+#include "compzillaSurfaceCache.h"
+#include "compzillaWindow.h"
 
 
 NS_GENERIC_FACTORY_CONSTRUCTOR(compzillaControl)
@@ -58,11 +61,22 @@ static const mozilla::Module::CategoryEntry kCompzillaCategories[] = {
     { NULL }
 };
 
+static void
+CompzillaModuleDestructor()
+{
+    compzillaSurfaceCache::Shutdown ();
+    compzillaAtomCache::Shutdown ();
+    compzillaWindow::Shutdown ();
+}
+
 static const mozilla::Module kCompzillaModule = {
     mozilla::Module::kVersion,
     kCompzillaCIDs,
     kCompzillaContracts,
-    kCompzillaCategories
+    kCompzillaCategories,
+    NULL,
+    NULL,
+    CompzillaModuleDestructor
 };
 
 NSMODULE_DEFN(nsCompzillaModule) = &kCompzillaModule;
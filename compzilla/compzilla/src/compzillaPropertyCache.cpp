@@ -0,0 +1,109 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <stdio.h>
+
+#include "compzillaPropertyCache.h"
+#include "Debug.h"
+
+
+// Longest property value kept, in 32 bit units.  Longer values are cut.
+#define MAX_PROPERTY_LENGTH BUFSIZ
+
+
+compzillaPropertyCache::compzillaPropertyCache (Display *dpy, Window win)
+  : mDisplay (dpy),
+    mWindow (win)
+{
+  mEntries.Init (16);
+}
+
+
+compzillaPropertyCache::~compzillaPropertyCache ()
+{
+  Clear ();
+}
+
+
+void
+compzillaPropertyCache::Request (Atom prop)
+{
+  if (mEntries.Get (prop, nsnull))
+    return;
+
+  Entry *entry = new Entry ();
+  entry->mCookie = compzillaPropertyReply::Request (mDisplay, mWindow, prop,
+                                                    AnyPropertyType,
+                                                    MAX_PROPERTY_LENGTH);
+  mEntries.Put (prop, entry);
+}
+
+
+void
+compzillaPropertyCache::Request (const Atom *props, PRUint32 count)
+{
+  for (PRUint32 i = 0; i < count; i++) {
+    Request (props[i]);
+  }
+}
+
+
+compzillaPropertyReply *
+compzillaPropertyCache::Lookup (Atom prop)
+{
+  Entry *entry;
+  if (!mEntries.Get (prop, &entry)) {
+    Request (prop);
+    mEntries.Get (prop, &entry);
+  }
+
+  if (entry->mIsPending) {
+    entry->mExists = entry->mReply.Get (mDisplay, entry->mCookie);
+    entry->mIsPending = false;
+  }
+
+  return entry->mExists ? &entry->mReply : NULL;
+}
+
+
+void
+compzillaPropertyCache::Invalidate (Atom prop)
+{
+  Entry *entry;
+  if (mEntries.Get (prop, &entry)) {
+    Discard (entry);
+    mEntries.Remove (prop);
+  }
+}
+
+
+void
+compzillaPropertyCache::Clear ()
+{
+  mEntries.EnumerateRead (DiscardEntry, this);
+  mEntries.Clear ();
+}
+
+
+/*
+ * XCB keeps replies until they are collected, so replies of requests
+ * nobody looked at need throwing away.
+ */
+void
+compzillaPropertyCache::Discard (Entry *entry)
+{
+  if (entry->mIsPending) {
+    xcb_discard_reply (XGetXCBConnection (mDisplay), entry->mCookie.sequence);
+    entry->mIsPending = false;
+  }
+}
+
+
+PLDHashOperator
+compzillaPropertyCache::DiscardEntry (const PRUint32& key,
+                                      Entry *entry,
+                                      void *userArg)
+{
+  compzillaPropertyCache *cache = (compzillaPropertyCache *) userArg;
+  cache->Discard (entry);
+  return PL_DHASH_NEXT;
+}
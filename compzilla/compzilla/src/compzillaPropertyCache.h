@@ -0,0 +1,61 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaPropertyCache_h___
+#define compzillaPropertyCache_h___
+
+
+#include <nsClassHashtable.h>
+#include <nsHashKeys.h>
+
+#include "compzillaXcb.h"
+
+
+/*
+ * Raw property values of one window, fetched once and kept until the
+ * property changes.  Request only sends the GetProperty request, so a batch
+ * of properties can be requested together and share one round trip when
+ * the first of them is looked up.
+ *
+ * The window must select PropertyChangeMask before anything is requested,
+ * and pass every PropertyNotify to Invalidate, or stale values are kept.
+ */
+class compzillaPropertyCache
+{
+public:
+    compzillaPropertyCache (Display *dpy, Window win);
+    ~compzillaPropertyCache ();
+
+    // Does nothing for properties already cached or requested.
+    void Request (Atom prop);
+    void Request (const Atom *props, PRUint32 count);
+
+    // Waits for the value if it was only requested.  Returns NULL if the
+    // property doesn't exist.
+    compzillaPropertyReply *Lookup (Atom prop);
+
+    void Invalidate (Atom prop);
+    void Clear ();
+
+private:
+    struct Entry {
+        Entry () : mIsPending(true), mExists(false) { }
+
+        xcb_get_property_cookie_t mCookie;
+        bool mIsPending;
+        bool mExists;
+        compzillaPropertyReply mReply;
+    };
+
+    void Discard (Entry *entry);
+
+    static PLDHashOperator DiscardEntry (const PRUint32& key,
+                                         Entry *entry,
+                                         void *userArg);
+
+    Display *mDisplay;
+    Window mWindow;
+    nsClassHashtable<nsUint32HashKey, Entry> mEntries;
+};
+
+
+#endif
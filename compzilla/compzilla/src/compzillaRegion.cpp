@@ -0,0 +1,775 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * The band walking in Op and the overlap functions follow pixman's
+ * pixman-region.c, which in turn comes from the X server's mi region code.
+ */
+
+#include <string.h>
+#include <prmem.h>
+
+#include "compzillaRegion.h"
+
+
+// Above this many bands Simplify merges in fixed size groups instead of
+// searching for the cheapest pair each time.
+#define SIMPLIFY_SEARCH_LIMIT 8
+
+
+static inline PRInt64
+BoxArea (const compzillaBox& box)
+{
+  return (PRInt64) (box.x2 - box.x1) * (box.y2 - box.y1);
+}
+
+
+compzillaRegion::compzillaRegion ()
+  : mRects(&mInline),
+    mNumRects(0),
+    mCapacity(1)
+{
+  mExtents.x1 = mExtents.y1 = mExtents.x2 = mExtents.y2 = 0;
+}
+
+
+compzillaRegion::compzillaRegion (PRInt32 x, PRInt32 y,
+                                  PRInt32 width, PRInt32 height)
+  : mRects(&mInline),
+    mNumRects(0),
+    mCapacity(1)
+{
+  SetRect (x, y, width, height);
+}
+
+
+compzillaRegion::compzillaRegion (const compzillaRegion& aOther)
+  : mRects(&mInline),
+    mNumRects(0),
+    mCapacity(1)
+{
+  *this = aOther;
+}
+
+
+compzillaRegion::~compzillaRegion ()
+{
+  if (mRects != &mInline)
+    PR_Free (mRects);
+}
+
+
+compzillaRegion&
+compzillaRegion::operator= (const compzillaRegion& aOther)
+{
+  if (this == &aOther)
+    return *this;
+
+  if (!Reserve (aOther.mNumRects)) {
+    SetEmpty ();
+    return *this;
+  }
+
+  memcpy (mRects, aOther.mRects, aOther.mNumRects * sizeof (compzillaBox));
+  mNumRects = aOther.mNumRects;
+  mExtents = aOther.mExtents;
+
+  return *this;
+}
+
+
+void
+compzillaRegion::SetEmpty ()
+{
+  mNumRects = 0;
+  mExtents.x1 = mExtents.y1 = mExtents.x2 = mExtents.y2 = 0;
+}
+
+
+void
+compzillaRegion::SetRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height)
+{
+  if (width <= 0 || height <= 0) {
+    SetEmpty ();
+    return;
+  }
+
+  mRects[0].x1 = x;
+  mRects[0].y1 = y;
+  mRects[0].x2 = x + width;
+  mRects[0].y2 = y + height;
+  mNumRects = 1;
+  mExtents = mRects[0];
+}
+
+
+/*
+ * Build the region from unsorted, possibly overlapping boxes by unioning
+ * halves, which keeps thousands of small damage rectangles at O(n log n)
+ * instead of one full region walk per rectangle.
+ */
+bool
+compzillaRegion::SetRects (const compzillaBox *boxes, PRUint32 count)
+{
+  if (count == 0) {
+    SetEmpty ();
+    return true;
+  }
+
+  if (count == 1) {
+    SetRect (boxes[0].x1, boxes[0].y1,
+             boxes[0].x2 - boxes[0].x1, boxes[0].y2 - boxes[0].y1);
+    return true;
+  }
+
+  compzillaRegion right;
+  if (!SetRects (boxes, count / 2) ||
+      !right.SetRects (boxes + count / 2, count - count / 2))
+    return Fail ();
+
+  return Union (right);
+}
+
+
+bool
+compzillaRegion::Contains (PRInt32 x, PRInt32 y) const
+{
+  if (mNumRects == 0 ||
+      x < mExtents.x1 || x >= mExtents.x2 ||
+      y < mExtents.y1 || y >= mExtents.y2)
+    return false;
+
+  for (PRUint32 i = 0; i < mNumRects; i++) {
+    const compzillaBox& box = mRects[i];
+    if (y >= box.y2)
+      continue;
+    if (y < box.y1)
+      break;
+    if (x >= box.x1 && x < box.x2)
+      return true;
+  }
+
+  return false;
+}
+
+
+bool
+compzillaRegion::ContainsBox (const compzillaBox& box) const
+{
+  compzillaRegion remainder (box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+  remainder.Subtract (*this);
+  return remainder.IsEmpty ();
+}
+
+
+bool
+compzillaRegion::Intersects (const compzillaBox& box) const
+{
+  if (mNumRects == 0 ||
+      box.x2 <= mExtents.x1 || box.x1 >= mExtents.x2 ||
+      box.y2 <= mExtents.y1 || box.y1 >= mExtents.y2)
+    return false;
+
+  for (PRUint32 i = 0; i < mNumRects; i++) {
+    const compzillaBox& r = mRects[i];
+    if (r.y2 <= box.y1)
+      continue;
+    if (r.y1 >= box.y2)
+      break;
+    if (r.x1 < box.x2 && r.x2 > box.x1)
+      return true;
+  }
+
+  return false;
+}
+
+
+bool
+compzillaRegion::Equals (const compzillaRegion& aOther) const
+{
+  return mNumRects == aOther.mNumRects &&
+    memcmp (mRects, aOther.mRects, mNumRects * sizeof (compzillaBox)) == 0;
+}
+
+
+bool
+compzillaRegion::Union (const compzillaRegion& aOther)
+{
+  if (aOther.IsEmpty () || this == &aOther)
+    return true;
+
+  if (IsEmpty ()) {
+    *this = aOther;
+    return mNumRects == aOther.mNumRects;
+  }
+
+  // One side swallows the other.
+  if (mNumRects == 1 &&
+      mExtents.x1 <= aOther.mExtents.x1 && mExtents.x2 >= aOther.mExtents.x2 &&
+      mExtents.y1 <= aOther.mExtents.y1 && mExtents.y2 >= aOther.mExtents.y2)
+    return true;
+
+  if (aOther.mNumRects == 1 &&
+      aOther.mExtents.x1 <= mExtents.x1 && aOther.mExtents.x2 >= mExtents.x2 &&
+      aOther.mExtents.y1 <= mExtents.y1 && aOther.mExtents.y2 >= mExtents.y2) {
+    SetRect (aOther.mExtents.x1, aOther.mExtents.y1,
+             aOther.mExtents.x2 - aOther.mExtents.x1,
+             aOther.mExtents.y2 - aOther.mExtents.y1);
+    return true;
+  }
+
+  return Op (*this, aOther, &compzillaRegion::UnionO, true, true);
+}
+
+
+bool
+compzillaRegion::UnionRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height)
+{
+  compzillaRegion rect (x, y, width, height);
+  return Union (rect);
+}
+
+
+bool
+compzillaRegion::Intersect (const compzillaRegion& aOther)
+{
+  if (this == &aOther)
+    return true;
+
+  if (IsEmpty () || aOther.IsEmpty () ||
+      mExtents.x2 <= aOther.mExtents.x1 || mExtents.x1 >= aOther.mExtents.x2 ||
+      mExtents.y2 <= aOther.mExtents.y1 || mExtents.y1 >= aOther.mExtents.y2) {
+    SetEmpty ();
+    return true;
+  }
+
+  if (mNumRects == 1 && aOther.mNumRects == 1) {
+    PRInt32 x1 = PR_MAX (mExtents.x1, aOther.mExtents.x1);
+    PRInt32 y1 = PR_MAX (mExtents.y1, aOther.mExtents.y1);
+    PRInt32 x2 = PR_MIN (mExtents.x2, aOther.mExtents.x2);
+    PRInt32 y2 = PR_MIN (mExtents.y2, aOther.mExtents.y2);
+    SetRect (x1, y1, x2 - x1, y2 - y1);
+    return true;
+  }
+
+  return Op (*this, aOther, &compzillaRegion::IntersectO, false, false);
+}
+
+
+bool
+compzillaRegion::IntersectRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height)
+{
+  compzillaRegion rect (x, y, width, height);
+  return Intersect (rect);
+}
+
+
+bool
+compzillaRegion::Subtract (const compzillaRegion& aOther)
+{
+  if (this == &aOther) {
+    SetEmpty ();
+    return true;
+  }
+
+  if (IsEmpty () || aOther.IsEmpty () ||
+      mExtents.x2 <= aOther.mExtents.x1 || mExtents.x1 >= aOther.mExtents.x2 ||
+      mExtents.y2 <= aOther.mExtents.y1 || mExtents.y1 >= aOther.mExtents.y2)
+    return true;
+
+  return Op (*this, aOther, &compzillaRegion::SubtractO, true, false);
+}
+
+
+bool
+compzillaRegion::SubtractRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height)
+{
+  compzillaRegion rect (x, y, width, height);
+  return Subtract (rect);
+}
+
+
+void
+compzillaRegion::Translate (PRInt32 dx, PRInt32 dy)
+{
+  if (mNumRects == 0)
+    return;
+
+  for (PRUint32 i = 0; i < mNumRects; i++) {
+    mRects[i].x1 += dx;
+    mRects[i].y1 += dy;
+    mRects[i].x2 += dx;
+    mRects[i].y2 += dy;
+  }
+
+  mExtents.x1 += dx;
+  mExtents.y1 += dy;
+  mExtents.x2 += dx;
+  mExtents.y2 += dy;
+}
+
+
+bool
+compzillaRegion::Simplify (PRUint32 maxRects)
+{
+  if (mNumRects <= maxRects)
+    return true;
+
+  if (maxRects <= 1) {
+    compzillaBox e = mExtents;
+    SetRect (e.x1, e.y1, e.x2 - e.x1, e.y2 - e.y1);
+    return true;
+  }
+
+  // Collapse each band to its bounding box.  Boxes in a band are x-sorted,
+  // so the first has the smallest x1 and the last the largest x2.
+  PRUint32 n = 0;
+  for (PRUint32 i = 0; i < mNumRects; ) {
+    PRUint32 j = i + 1;
+    while (j < mNumRects && mRects[j].y1 == mRects[i].y1)
+      j++;
+
+    compzillaBox band = mRects[i];
+    band.x2 = mRects[j - 1].x2;
+
+    // Vertically touching bands with the same span merge for free.
+    if (n > 0 &&
+        mRects[n - 1].y2 == band.y1 &&
+        mRects[n - 1].x1 == band.x1 &&
+        mRects[n - 1].x2 == band.x2) {
+      mRects[n - 1].y2 = band.y2;
+    } else {
+      mRects[n++] = band;
+    }
+
+    i = j;
+  }
+  mNumRects = n;
+
+  // Too many bands to search for the best pairs, merge fixed size runs of
+  // bands down to a searchable count first.
+  if (mNumRects > maxRects * SIMPLIFY_SEARCH_LIMIT) {
+    PRUint32 target = maxRects * SIMPLIFY_SEARCH_LIMIT;
+    PRUint32 group = (mNumRects + target - 1) / target;
+
+    n = 0;
+    for (PRUint32 i = 0; i < mNumRects; i += group) {
+      compzillaBox merged = mRects[i];
+      PRUint32 end = PR_MIN (i + group, mNumRects);
+      for (PRUint32 j = i + 1; j < end; j++) {
+        merged.x1 = PR_MIN (merged.x1, mRects[j].x1);
+        merged.x2 = PR_MAX (merged.x2, mRects[j].x2);
+        merged.y2 = mRects[j].y2;
+      }
+      mRects[n++] = merged;
+    }
+    mNumRects = n;
+  }
+
+  // Merge the neighbouring pair which adds the least area until small enough.
+  while (mNumRects > maxRects) {
+    PRUint32 best = 0;
+    PRInt64 bestCost = -1;
+
+    for (PRUint32 i = 0; i + 1 < mNumRects; i++) {
+      const compzillaBox& a = mRects[i];
+      const compzillaBox& b = mRects[i + 1];
+      compzillaBox merged = { PR_MIN (a.x1, b.x1), a.y1, PR_MAX (a.x2, b.x2), b.y2 };
+      PRInt64 cost = BoxArea (merged) - BoxArea (a) - BoxArea (b);
+
+      if (bestCost < 0 || cost < bestCost) {
+        best = i;
+        bestCost = cost;
+      }
+    }
+
+    compzillaBox& a = mRects[best];
+    const compzillaBox& b = mRects[best + 1];
+    a.x1 = PR_MIN (a.x1, b.x1);
+    a.x2 = PR_MAX (a.x2, b.x2);
+    a.y2 = b.y2;
+
+    memmove (&mRects[best + 1], &mRects[best + 2],
+             (mNumRects - best - 2) * sizeof (compzillaBox));
+    mNumRects--;
+  }
+
+  ComputeExtents ();
+  return true;
+}
+
+
+/*
+ * Walk both regions band by band.  Parts of a band covered by only one
+ * region are copied if appendNon1/appendNon2 say so, parts covered by both
+ * go through overlapFunc.  The result is built in a fresh region, so either
+ * operand may be this.
+ */
+bool
+compzillaRegion::Op (const compzillaRegion& reg1, const compzillaRegion& reg2,
+                     OverlapFunc overlapFunc, bool appendNon1, bool appendNon2)
+{
+  compzillaRegion result;
+  if (!result.Reserve (PR_MAX (reg1.mNumRects, reg2.mNumRects) * 2))
+    return Fail ();
+
+  const compzillaBox *r1 = reg1.mRects;
+  const compzillaBox *r1End = r1 + reg1.mNumRects;
+  const compzillaBox *r2 = reg2.mRects;
+  const compzillaBox *r2End = r2 + reg2.mNumRects;
+  const compzillaBox *r1BandEnd, *r2BandEnd;
+
+  PRInt32 ybot = PR_MIN (r1->y1, r2->y1);
+  PRInt32 ytop;
+  PRUint32 prevBand = 0, curBand;
+
+  do {
+    r1BandEnd = r1;
+    while (r1BandEnd != r1End && r1BandEnd->y1 == r1->y1)
+      r1BandEnd++;
+
+    r2BandEnd = r2;
+    while (r2BandEnd != r2End && r2BandEnd->y1 == r2->y1)
+      r2BandEnd++;
+
+    if (r1->y1 < r2->y1) {
+      if (appendNon1) {
+        PRInt32 top = PR_MAX (r1->y1, ybot);
+        PRInt32 bot = PR_MIN (r1->y2, r2->y1);
+        if (top != bot) {
+          curBand = result.mNumRects;
+          if (!result.AppendNonO (r1, r1BandEnd, top, bot))
+            return Fail ();
+          prevBand = result.Coalesce (prevBand, curBand);
+        }
+      }
+      ytop = r2->y1;
+    } else if (r2->y1 < r1->y1) {
+      if (appendNon2) {
+        PRInt32 top = PR_MAX (r2->y1, ybot);
+        PRInt32 bot = PR_MIN (r2->y2, r1->y1);
+        if (top != bot) {
+          curBand = result.mNumRects;
+          if (!result.AppendNonO (r2, r2BandEnd, top, bot))
+            return Fail ();
+          prevBand = result.Coalesce (prevBand, curBand);
+        }
+      }
+      ytop = r1->y1;
+    } else {
+      ytop = r1->y1;
+    }
+
+    ybot = PR_MIN (r1->y2, r2->y2);
+    if (ybot > ytop) {
+      curBand = result.mNumRects;
+      if (!(result.*overlapFunc) (r1, r1BandEnd, r2, r2BandEnd, ytop, ybot))
+        return Fail ();
+      prevBand = result.Coalesce (prevBand, curBand);
+    }
+
+    if (r1->y2 == ybot)
+      r1 = r1BandEnd;
+    if (r2->y2 == ybot)
+      r2 = r2BandEnd;
+  } while (r1 != r1End && r2 != r2End);
+
+  // One region is done.  The first leftover band may still coalesce with
+  // the last band written, the rest is copied as is.
+  const compzillaBox *rest = NULL, *restEnd = NULL;
+  if (r1 != r1End && appendNon1) {
+    rest = r1;
+    restEnd = r1End;
+  } else if (r2 != r2End && appendNon2) {
+    rest = r2;
+    restEnd = r2End;
+  }
+
+  if (rest) {
+    const compzillaBox *restBandEnd = rest;
+    while (restBandEnd != restEnd && restBandEnd->y1 == rest->y1)
+      restBandEnd++;
+
+    curBand = result.mNumRects;
+    if (!result.AppendNonO (rest, restBandEnd, PR_MAX (rest->y1, ybot), rest->y2))
+      return Fail ();
+    result.Coalesce (prevBand, curBand);
+
+    PRUint32 count = restEnd - restBandEnd;
+    if (count) {
+      if (!result.Reserve (result.mNumRects + count))
+        return Fail ();
+      memcpy (result.mRects + result.mNumRects, restBandEnd,
+              count * sizeof (compzillaBox));
+      result.mNumRects += count;
+    }
+  }
+
+  result.ComputeExtents ();
+  Swap (result);
+  return true;
+}
+
+
+bool
+compzillaRegion::UnionO (const compzillaBox *r1, const compzillaBox *r1End,
+                         const compzillaBox *r2, const compzillaBox *r2End,
+                         PRInt32 y1, PRInt32 y2)
+{
+  PRInt32 x1, x2;
+
+  if (r1->x1 < r2->x1) {
+    x1 = r1->x1;
+    x2 = r1->x2;
+    r1++;
+  } else {
+    x1 = r2->x1;
+    x2 = r2->x2;
+    r2++;
+  }
+
+  while (r1 != r1End || r2 != r2End) {
+    const compzillaBox *r;
+    if (r2 == r2End || (r1 != r1End && r1->x1 < r2->x1))
+      r = r1++;
+    else
+      r = r2++;
+
+    if (r->x1 <= x2) {
+      if (x2 < r->x2)
+        x2 = r->x2;
+    } else {
+      if (!AppendBox (x1, y1, x2, y2))
+        return false;
+      x1 = r->x1;
+      x2 = r->x2;
+    }
+  }
+
+  return AppendBox (x1, y1, x2, y2);
+}
+
+
+bool
+compzillaRegion::IntersectO (const compzillaBox *r1, const compzillaBox *r1End,
+                             const compzillaBox *r2, const compzillaBox *r2End,
+                             PRInt32 y1, PRInt32 y2)
+{
+  do {
+    PRInt32 x1 = PR_MAX (r1->x1, r2->x1);
+    PRInt32 x2 = PR_MIN (r1->x2, r2->x2);
+
+    if (x1 < x2 && !AppendBox (x1, y1, x2, y2))
+      return false;
+
+    if (r1->x2 == x2)
+      r1++;
+    if (r2->x2 == x2)
+      r2++;
+  } while (r1 != r1End && r2 != r2End);
+
+  return true;
+}
+
+
+bool
+compzillaRegion::SubtractO (const compzillaBox *r1, const compzillaBox *r1End,
+                            const compzillaBox *r2, const compzillaBox *r2End,
+                            PRInt32 y1, PRInt32 y2)
+{
+  PRInt32 x1 = r1->x1;
+
+  do {
+    if (r2->x2 <= x1) {
+      // Subtrahend entirely to the left.
+      r2++;
+    } else if (r2->x1 <= x1) {
+      // Subtrahend covers the left part of the minuend.
+      x1 = r2->x2;
+      if (x1 >= r1->x2) {
+        r1++;
+        if (r1 != r1End)
+          x1 = r1->x1;
+      } else {
+        r2++;
+      }
+    } else if (r2->x1 < r1->x2) {
+      // Left part of the minuend is uncovered.
+      if (!AppendBox (x1, y1, r2->x1, y2))
+        return false;
+
+      x1 = r2->x2;
+      if (x1 >= r1->x2) {
+        r1++;
+        if (r1 != r1End)
+          x1 = r1->x1;
+      } else {
+        r2++;
+      }
+    } else {
+      // Minuend used up by the subtrahends so far.
+      if (r1->x2 > x1 && !AppendBox (x1, y1, r1->x2, y2))
+        return false;
+
+      r1++;
+      if (r1 != r1End)
+        x1 = r1->x1;
+    }
+  } while (r1 != r1End && r2 != r2End);
+
+  while (r1 != r1End) {
+    if (!AppendBox (x1, y1, r1->x2, y2))
+      return false;
+
+    r1++;
+    if (r1 != r1End)
+      x1 = r1->x1;
+  }
+
+  return true;
+}
+
+
+bool
+compzillaRegion::AppendNonO (const compzillaBox *r, const compzillaBox *rEnd,
+                             PRInt32 y1, PRInt32 y2)
+{
+  for (; r != rEnd; r++) {
+    if (!AppendBox (r->x1, y1, r->x2, y2))
+      return false;
+  }
+
+  return true;
+}
+
+
+/*
+ * Merge the band starting at curStart into the one at prevStart if they
+ * touch and have boxes in the same places.  Returns the start of the band
+ * the next band should try to coalesce with.
+ */
+PRUint32
+compzillaRegion::Coalesce (PRUint32 prevStart, PRUint32 curStart)
+{
+  PRUint32 count = curStart - prevStart;
+
+  if (count == 0 || count != mNumRects - curStart)
+    return curStart;
+
+  compzillaBox *prev = mRects + prevStart;
+  compzillaBox *cur = mRects + curStart;
+
+  if (prev->y2 != cur->y1)
+    return curStart;
+
+  for (PRUint32 i = 0; i < count; i++) {
+    if (prev[i].x1 != cur[i].x1 || prev[i].x2 != cur[i].x2)
+      return curStart;
+  }
+
+  PRInt32 y2 = cur->y2;
+  for (PRUint32 i = 0; i < count; i++)
+    prev[i].y2 = y2;
+
+  mNumRects -= count;
+  return prevStart;
+}
+
+
+bool
+compzillaRegion::AppendBox (PRInt32 x1, PRInt32 y1, PRInt32 x2, PRInt32 y2)
+{
+  if (mNumRects == mCapacity && !Reserve (mNumRects + 1))
+    return false;
+
+  compzillaBox& box = mRects[mNumRects++];
+  box.x1 = x1;
+  box.y1 = y1;
+  box.x2 = x2;
+  box.y2 = y2;
+
+  return true;
+}
+
+
+bool
+compzillaRegion::Reserve (PRUint32 count)
+{
+  if (count <= mCapacity)
+    return true;
+
+  PRUint32 capacity = PR_MAX (count, mCapacity * 2);
+  compzillaBox *rects;
+
+  if (mRects == &mInline) {
+    rects = (compzillaBox *) PR_Malloc (capacity * sizeof (compzillaBox));
+    if (rects && mNumRects)
+      memcpy (rects, mRects, mNumRects * sizeof (compzillaBox));
+  } else {
+    rects = (compzillaBox *) PR_Realloc (mRects, capacity * sizeof (compzillaBox));
+  }
+
+  if (!rects)
+    return false;
+
+  mRects = rects;
+  mCapacity = capacity;
+  return true;
+}
+
+
+void
+compzillaRegion::ComputeExtents ()
+{
+  if (mNumRects == 0) {
+    SetEmpty ();
+    return;
+  }
+
+  mExtents.x1 = mRects[0].x1;
+  mExtents.y1 = mRects[0].y1;
+  mExtents.x2 = mRects[0].x2;
+  mExtents.y2 = mRects[mNumRects - 1].y2;
+
+  for (PRUint32 i = 1; i < mNumRects; i++) {
+    if (mRects[i].x1 < mExtents.x1)
+      mExtents.x1 = mRects[i].x1;
+    if (mRects[i].x2 > mExtents.x2)
+      mExtents.x2 = mRects[i].x2;
+  }
+}
+
+
+void
+compzillaRegion::Swap (compzillaRegion& aOther)
+{
+  // Inline storage moves with the struct, heap storage with the pointer.
+  compzillaBox *mine = (mRects == &mInline) ? &aOther.mInline : mRects;
+  compzillaBox *theirs = (aOther.mRects == &aOther.mInline) ? &mInline : aOther.mRects;
+
+  compzillaBox tmpBox = mInline;
+  mInline = aOther.mInline;
+  aOther.mInline = tmpBox;
+
+  tmpBox = mExtents;
+  mExtents = aOther.mExtents;
+  aOther.mExtents = tmpBox;
+
+  PRUint32 tmp = mNumRects;
+  mNumRects = aOther.mNumRects;
+  aOther.mNumRects = tmp;
+
+  tmp = mCapacity;
+  mCapacity = aOther.mCapacity;
+  aOther.mCapacity = tmp;
+
+  mRects = theirs;
+  aOther.mRects = mine;
+}
+
+
+bool
+compzillaRegion::Fail ()
+{
+  SetEmpty ();
+  return false;
+}
@@ -0,0 +1,102 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaRegion_h___
+#define compzillaRegion_h___
+
+
+#include <prtypes.h>
+
+
+struct compzillaBox
+{
+  PRInt32 x1, y1, x2, y2;
+};
+
+
+/*
+ * Client side region, stored as y-x banded boxes like pixman and the X
+ * server do.  Rectangles are y-sorted into bands of equal height, each band
+ * is x-sorted with no touching boxes, and vertically adjacent identical bands
+ * are coalesced.  This lets damage, occlusion and clipping math run without
+ * XFixes round trips.
+ *
+ * Operations returning bool return false if they ran out of memory, in which
+ * case the region is left empty.
+ */
+class compzillaRegion
+{
+public:
+  compzillaRegion ();
+  compzillaRegion (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height);
+  compzillaRegion (const compzillaRegion& aOther);
+  ~compzillaRegion ();
+
+  compzillaRegion& operator= (const compzillaRegion& aOther);
+
+  void SetEmpty ();
+  void SetRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height);
+  bool SetRects (const compzillaBox *boxes, PRUint32 count);
+
+  bool IsEmpty () const { return mNumRects == 0; }
+  PRUint32 NumRects () const { return mNumRects; }
+  const compzillaBox *Rects () const { return mRects; }
+  const compzillaBox& Extents () const { return mExtents; }
+
+  bool Contains (PRInt32 x, PRInt32 y) const;
+  bool ContainsBox (const compzillaBox& box) const;
+  bool Intersects (const compzillaBox& box) const;
+  bool Equals (const compzillaRegion& aOther) const;
+
+  bool Union (const compzillaRegion& aOther);
+  bool UnionRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height);
+  bool Intersect (const compzillaRegion& aOther);
+  bool IntersectRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height);
+  bool Subtract (const compzillaRegion& aOther);
+  bool SubtractRect (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height);
+  void Translate (PRInt32 dx, PRInt32 dy);
+
+  // Grow the region until it has at most maxRects boxes, adding as little
+  // area as possible.  The result always covers the original region.
+  bool Simplify (PRUint32 maxRects);
+
+private:
+  typedef bool (compzillaRegion::*OverlapFunc) (const compzillaBox *r1,
+                                                const compzillaBox *r1End,
+                                                const compzillaBox *r2,
+                                                const compzillaBox *r2End,
+                                                PRInt32 y1, PRInt32 y2);
+
+  bool Op (const compzillaRegion& reg1, const compzillaRegion& reg2,
+           OverlapFunc overlapFunc, bool appendNon1, bool appendNon2);
+
+  bool UnionO (const compzillaBox *r1, const compzillaBox *r1End,
+               const compzillaBox *r2, const compzillaBox *r2End,
+               PRInt32 y1, PRInt32 y2);
+  bool IntersectO (const compzillaBox *r1, const compzillaBox *r1End,
+                   const compzillaBox *r2, const compzillaBox *r2End,
+                   PRInt32 y1, PRInt32 y2);
+  bool SubtractO (const compzillaBox *r1, const compzillaBox *r1End,
+                  const compzillaBox *r2, const compzillaBox *r2End,
+                  PRInt32 y1, PRInt32 y2);
+
+  bool AppendNonO (const compzillaBox *r, const compzillaBox *rEnd,
+                   PRInt32 y1, PRInt32 y2);
+  PRUint32 Coalesce (PRUint32 prevStart, PRUint32 curStart);
+
+  bool AppendBox (PRInt32 x1, PRInt32 y1, PRInt32 x2, PRInt32 y2);
+  bool Reserve (PRUint32 count);
+  void ComputeExtents ();
+  void Swap (compzillaRegion& aOther);
+  bool Fail ();
+
+  compzillaBox mExtents;
+  compzillaBox *mRects;
+  PRUint32 mNumRects;
+  PRUint32 mCapacity;
+
+  // Single rectangle regions don't allocate.
+  compzillaBox mInline;
+};
+
+
+#endif
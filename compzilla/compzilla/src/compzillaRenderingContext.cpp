@@ -13,6 +13,7 @@ class nsHTMLCanvasElement;
 
 #include "compzillaIRenderingContext.h"
 #include "compzillaRenderingContext.h"
+#include "compzillaSurfaceCache.h"
 #include "Debug.h"
 
 #include <gdk/gdk.h>
@@ -153,9 +154,8 @@ compzillaRenderingContext::GetThebesSurface(gfxASurface **surface)
 
 
 /*
- * FIXME: This currently gets called before each Redraw, so do nothing if the
- *        values haven't changed.  This is broken.  SetDrawable should only be
- *        called when the backing pixmap gets recreated.
+ * Called when the backing pixmap gets recreated.  The surface is shared with
+ * any other context showing the same pixmap.
  */
 NS_IMETHODIMP
 compzillaRenderingContext::SetDrawable(Display *dpy,
@@ -169,8 +169,25 @@ compzillaRenderingContext::SetDrawable(Display *dpy,
   mXDisplay = dpy;
   mXDrawable = drawable;
   mXVisual = visual;
-  mGfxSurf = new gfxXlibSurface(mXDisplay, mXDrawable, mXVisual,
-                                gfxIntSize(mWidth, mHeight));
+  nsRefPtr<gfxXlibSurface> surf =
+    compzillaSurfaceCache::Lookup(mXDisplay, mXDrawable, mXVisual,
+                                  gfxIntSize(mWidth, mHeight));
+  mGfxSurf = surf.get();
+
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaRenderingContext::SetSurface(gfxASurface *surface)
+{
+  // Make a later SetDrawable with the old values take effect again.
+  mXDisplay = NULL;
+  mXDrawable = None;
+  mXVisual = NULL;
+
+  mValid = surface != nsnull;
+  mGfxSurf = surface;
 
   return NS_OK;
 }
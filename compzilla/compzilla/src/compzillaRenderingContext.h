@@ -72,6 +72,8 @@ public:
 
     NS_IMETHOD SetDrawable (Display *dpy, Drawable drawable, Visual *visual);
 
+    NS_IMETHOD SetSurface (gfxASurface *surface);
+
     already_AddRefed<CanvasLayer> GetCanvasLayer(CanvasLayer *aOldLayer,
                                                  LayerManager *aManager) {
       if (!mValid)
@@ -107,7 +109,7 @@ private:
     Visual *mXVisual;
     Pixmap mXDrawable;
 
-    nsRefPtr<gfxXlibSurface> mGfxSurf;
+    nsRefPtr<gfxASurface> mGfxSurf;
     PRInt32 mWidth, mHeight;
     PRBool mValid;
 };
@@ -0,0 +1,282 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <prcpucfg.h>
+
+#include "compzillaErrorTrap.h"
+#include "compzillaShmImage.h"
+#include "Debug.h"
+
+extern "C" {
+#include <sys/ipc.h>
+#include <sys/shm.h>
+}
+
+
+#ifdef IS_LITTLE_ENDIAN
+#define NATIVE_BYTE_ORDER LSBFirst
+#else
+#define NATIVE_BYTE_ORDER MSBFirst
+#endif
+
+// Segments are sized for dimensions rounded up to this many pixels, and
+// given up once the image uses less than 1/SHM_SHRINK_FACTOR of them.
+#define SHM_BUCKET 128
+#define SHM_SHRINK_FACTOR 4
+
+
+/*
+ * A shared memory segment attached to the X server.  Held by the image and
+ * by every surface drawing from it, since canvases may still paint an old
+ * surface after the window has moved on to a new one.
+ */
+class compzillaShmImage::Segment
+{
+public:
+  NS_INLINE_DECL_REFCOUNTING(Segment)
+
+  Segment (Display *dpy)
+    : mDisplay(dpy),
+      mSize(0),
+      mIsAttached(false)
+  {
+    mInfo.shmid = -1;
+    mInfo.shmaddr = (char *) -1;
+    mInfo.readOnly = False;
+  }
+
+  ~Segment ()
+  {
+    if (mIsAttached)
+      XShmDetach (mDisplay, &mInfo);
+    if (mInfo.shmaddr != (char *) -1)
+      shmdt (mInfo.shmaddr);
+  }
+
+  Display *mDisplay;
+  XShmSegmentInfo mInfo;
+  size_t mSize;
+  bool mIsAttached;
+};
+
+
+static cairo_user_data_key_t sSegmentKey;
+
+
+void
+compzillaShmImage::ReleaseSegment (void *data)
+{
+  static_cast<Segment *>(data)->Release ();
+}
+
+
+int compzillaShmImage::sShmState = compzillaShmImage::SHM_UNKNOWN;
+
+
+compzillaShmImage::compzillaShmImage (Display *dpy,
+                                      Visual *visual,
+                                      int depth,
+                                      gfxASurface::gfxImageFormat format)
+  : mDisplay(dpy),
+    mVisual(visual),
+    mDepth(depth),
+    mFormat(format),
+    mImage(NULL)
+{
+}
+
+
+compzillaShmImage::~compzillaShmImage ()
+{
+  if (mImage) {
+    // The data is the shm segment, not malloced memory.
+    mImage->data = NULL;
+    XDestroyImage (mImage);
+  }
+}
+
+
+bool
+compzillaShmImage::IsAvailable (Display *dpy)
+{
+  if (sShmState == SHM_UNKNOWN) {
+    int major, minor;
+    Bool pixmaps;
+    if (!XShmQueryVersion (dpy, &major, &minor, &pixmaps)) {
+      INFO ("MIT-SHM not available, drawing windows from their pixmaps\n");
+      sShmState = SHM_UNAVAILABLE;
+    }
+  }
+
+  return sShmState != SHM_UNAVAILABLE;
+}
+
+
+already_AddRefed<compzillaShmImage>
+compzillaShmImage::Create (Display *dpy,
+                           Visual *visual,
+                           int depth,
+                           PRInt32 width,
+                           PRInt32 height)
+{
+  if (width <= 0 || height <= 0 || !IsAvailable (dpy))
+    return nsnull;
+
+  gfxASurface::gfxImageFormat format;
+  if (depth == 32)
+    format = gfxASurface::ImageFormatARGB32;
+  else if (depth == 24)
+    format = gfxASurface::ImageFormatRGB24;
+  else
+    return nsnull;
+
+  if (visual->red_mask != 0xff0000 ||
+      visual->green_mask != 0xff00 ||
+      visual->blue_mask != 0xff)
+    return nsnull;
+
+  nsRefPtr<compzillaShmImage> img =
+    new compzillaShmImage (dpy, visual, depth, format);
+  if (!img)
+    return nsnull;
+
+  img->mSegment = new Segment (dpy);
+  if (!img->mSegment || !img->CreateImage (width, height))
+    return nsnull;
+
+  if (img->mImage->bits_per_pixel != 32 ||
+      img->mImage->byte_order != NATIVE_BYTE_ORDER)
+    return nsnull;
+
+  // Room for the next few resizes.
+  PRInt32 bucketWidth = (width + SHM_BUCKET - 1) / SHM_BUCKET * SHM_BUCKET;
+  PRInt32 bucketHeight = (height + SHM_BUCKET - 1) / SHM_BUCKET * SHM_BUCKET;
+  img->mSegment->mSize = bucketWidth * 4 * bucketHeight;
+
+  if (!img->CreateSegment () || !img->CreateImage (width, height))
+    return nsnull;
+
+  return img.forget ();
+}
+
+
+bool
+compzillaShmImage::CreateSegment ()
+{
+  XShmSegmentInfo &info = mSegment->mInfo;
+
+  info.shmid = shmget (IPC_PRIVATE, mSegment->mSize, IPC_CREAT | 0600);
+  if (info.shmid < 0) {
+    WARNING ("shmget failed for %lu byte window image\n",
+             (unsigned long) mSegment->mSize);
+    return false;
+  }
+
+  info.shmaddr = (char *) shmat (info.shmid, NULL, 0);
+  if (info.shmaddr == (char *) -1) {
+    shmctl (info.shmid, IPC_RMID, NULL);
+    return false;
+  }
+
+  // The attach only fails asynchronously.  Trap it, so only an error for
+  // the attach itself counts, and other errors the sync flushes still go
+  // to the control's handler.
+  unsigned long serial = compzillaErrorTrap::Trap (mDisplay);
+  XShmAttach (mDisplay, &info);
+  XSync (mDisplay, False);
+
+  // Freed once both sides have detached.
+  shmctl (info.shmid, IPC_RMID, NULL);
+
+  if (compzillaErrorTrap::Check (mDisplay, serial) !=
+      compzillaErrorTrap::SUCCEEDED) {
+    INFO ("XShmAttach failed, drawing windows from their pixmaps\n");
+    sShmState = SHM_UNAVAILABLE;
+    return false;
+  }
+
+  sShmState = SHM_AVAILABLE;
+  mSegment->mIsAttached = true;
+  return true;
+}
+
+
+/*
+ * (Re)create the XImage header and surface for the given size on top of the
+ * segment.  Before the segment is allocated this only creates the header,
+ * so Create can check the image format.
+ */
+bool
+compzillaShmImage::CreateImage (PRInt32 width, PRInt32 height)
+{
+  if (mImage) {
+    mImage->data = NULL;
+    XDestroyImage (mImage);
+  }
+  mSurface = nsnull;
+
+  mImage = XShmCreateImage (mDisplay, mVisual, mDepth, ZPixmap, NULL,
+                            &mSegment->mInfo, width, height);
+  if (!mImage)
+    return false;
+
+  if (!mSegment->mIsAttached)
+    return true;
+
+  mImage->data = mSegment->mInfo.shmaddr;
+
+  nsRefPtr<gfxImageSurface> surface =
+    new gfxImageSurface ((unsigned char *) mImage->data,
+                         gfxIntSize (width, height),
+                         mImage->bytes_per_line,
+                         mFormat);
+  if (!surface || surface->CairoStatus ())
+    return false;
+
+  mSegment->AddRef ();
+  surface->SetData (&sSegmentKey, mSegment.get (), ReleaseSegment);
+
+  mSurface = surface;
+  return true;
+}
+
+
+bool
+compzillaShmImage::Resize (PRInt32 width, PRInt32 height)
+{
+  if (width <= 0 || height <= 0)
+    return false;
+
+  size_t needed = width * 4 * height;
+  if (needed > mSegment->mSize ||
+      needed * SHM_SHRINK_FACTOR < mSegment->mSize)
+    return false;
+
+  return CreateImage (width, height);
+}
+
+
+/*
+ * XShmGetImage always fills the whole width of the image it is given, so the
+ * update is done with a full width band: a copy of the XImage whose data
+ * starts at the first damaged row.  Xlib sends the band's offset into the
+ * segment, so only the damaged rows cross the wire.
+ */
+bool
+compzillaShmImage::Update (Drawable drawable,
+                           PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height)
+{
+  PRInt32 top = PR_MAX (y, 0);
+  PRInt32 bottom = PR_MIN (y + height, mImage->height);
+  if (!mSurface || top >= bottom || width <= 0)
+    return true;
+
+  XImage band = *mImage;
+  band.height = bottom - top;
+  band.data = mImage->data + top * mImage->bytes_per_line;
+
+  if (!XShmGetImage (mDisplay, drawable, &band, 0, top, AllPlanes))
+    return false;
+
+  mSurface->MarkDirty (gfxRect (0, top, mImage->width, bottom - top));
+  return true;
+}
@@ -0,0 +1,83 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaShmImage_h___
+#define compzillaShmImage_h___
+
+
+#include <nsAutoPtr.h>
+#include <nsISupportsImpl.h>
+
+#include <gfxImageSurface.h> // unstable
+
+extern "C" {
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+}
+
+
+/*
+ * Window contents copied into a MIT-SHM XImage and exposed as a client side
+ * gfxImageSurface, so Gecko composites from local memory instead of turning
+ * every paint into X rendering requests.  Only 24 and 32 bit visuals in the
+ * host's byte order are supported; Create returns null for anything else, or
+ * if SHM can't be used on this display, and callers fall back to drawing
+ * from the pixmap.
+ *
+ * The shared memory is allocated in size buckets so a window being resized
+ * can usually keep its segment, and it stays alive until the last surface
+ * using it is gone.
+ */
+class compzillaShmImage
+{
+public:
+    NS_INLINE_DECL_REFCOUNTING(compzillaShmImage)
+
+    static already_AddRefed<compzillaShmImage> Create (Display *dpy,
+                                                       Visual *visual,
+                                                       int depth,
+                                                       PRInt32 width,
+                                                       PRInt32 height);
+
+    // Change the image size, keeping the shared memory if it is still a
+    // sensible fit.  Replaces the surface.  Returns false if a new image
+    // needs to be created instead.
+    bool Resize (PRInt32 width, PRInt32 height);
+
+    // Copy the rows covering the given area from drawable into the image.
+    bool Update (Drawable drawable,
+                 PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height);
+
+    gfxImageSurface *GetSurface () { return mSurface; }
+    PRInt32 Width () { return mImage->width; }
+    PRInt32 Height () { return mImage->height; }
+
+private:
+    class Segment;
+
+    compzillaShmImage (Display *dpy, Visual *visual, int depth,
+                       gfxASurface::gfxImageFormat format);
+    ~compzillaShmImage ();
+
+    bool CreateImage (PRInt32 width, PRInt32 height);
+    bool CreateSegment ();
+
+    static bool IsAvailable (Display *dpy);
+    static void ReleaseSegment (void *data);
+
+    Display *mDisplay;
+    Visual *mVisual;
+    int mDepth;
+    gfxASurface::gfxImageFormat mFormat;
+
+    nsRefPtr<Segment> mSegment;
+    XImage *mImage;
+    nsRefPtr<gfxImageSurface> mSurface;
+
+    // Unknown until the first attach has been tried, since MIT-SHM is
+    // advertised to remote clients that can't actually use it.
+    enum { SHM_UNKNOWN, SHM_AVAILABLE, SHM_UNAVAILABLE };
+    static int sShmState;
+};
+
+
+#endif
@@ -0,0 +1,324 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <stdlib.h>
+
+#include "compzillaSubwindowTree.h"
+#include "compzillaXcb.h"
+#include "Debug.h"
+
+
+// Larger trees are left to XTranslateCoordinates.
+#define MAX_SUBWINDOWS 4096
+
+
+compzillaSubwindowTree::compzillaSubwindowTree (Display *dpy, Window win)
+  : mDisplay (dpy),
+    mWindow (win)
+{
+  mIndices.Init (32);
+}
+
+
+compzillaSubwindowTree::Status
+compzillaSubwindowTree::Build ()
+{
+  Clear ();
+
+  xcb_connection_t *conn = XGetXCBConnection (mDisplay);
+
+  Node *root = mNodes.AppendElement ();
+  if (!root)
+    return FAILED;
+
+  root->mWindow = mWindow;
+  root->mX = root->mY = 0;
+  root->mWidth = root->mHeight = 0;
+  root->mBorder = 0;
+  root->mIsMapped = true;
+  root->mParent = PRUint32(-1);
+  root->mFirstChild = 0;
+  root->mChildCount = 0;
+
+  nsTArray<xcb_query_tree_cookie_t> trees;
+  nsTArray<compzillaXcb::AttributesCookie> attrs;
+  trees.AppendElement (xcb_query_tree (conn, mWindow));
+
+  // Each level's children are selected and queried together with their
+  // attributes, so the whole level costs one round trip.
+  PRUint32 levelStart = 0;
+  PRUint32 levelEnd = 1;
+  bool failed = false;
+  bool tooLarge = false;
+
+  while (levelStart < levelEnd) {
+    for (PRUint32 i = levelStart; i < levelEnd; i++) {
+      xcb_generic_error_t *error;
+      xcb_query_tree_reply_t *reply = (xcb_query_tree_reply_t *)
+        compzillaXcb::WaitForReply (mDisplay,
+                                    trees[i - levelStart].sequence,
+                                    &error);
+      free (error);
+
+      if (!reply) {
+        // Children destroyed meanwhile are cleared by the DestroyNotify.
+        if (i == 0)
+          failed = true;
+        continue;
+      }
+
+      PRUint32 count = xcb_query_tree_children_length (reply);
+      xcb_window_t *children = xcb_query_tree_children (reply);
+
+      if (!failed && mNodes.Length () + count > MAX_SUBWINDOWS)
+        failed = tooLarge = true;
+
+      if (failed) {
+        free (reply);
+        continue;
+      }
+
+      mNodes[i].mFirstChild = mNodes.Length ();
+      mNodes[i].mChildCount = count;
+
+      Node *nodes = mNodes.AppendElements (count);
+      if (!nodes) {
+        failed = true;
+        free (reply);
+        continue;
+      }
+
+      for (PRUint32 c = 0; c < count; c++) {
+        nodes[c].mWindow = children[c];
+        nodes[c].mParent = i;
+        nodes[c].mFirstChild = 0;
+        nodes[c].mChildCount = 0;
+      }
+
+      free (reply);
+    }
+
+    if (failed)
+      break;
+
+    levelStart = levelEnd;
+    levelEnd = mNodes.Length ();
+
+    trees.Clear ();
+    attrs.Clear ();
+
+    for (PRUint32 i = levelStart; i < levelEnd; i++) {
+      // Checked, so a window gone meanwhile doesn't reach the error handler.
+      PRUint32 mask = XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+      xcb_void_cookie_t select =
+        xcb_change_window_attributes_checked (conn, mNodes[i].mWindow,
+                                              XCB_CW_EVENT_MASK, &mask);
+      xcb_discard_reply (conn, select.sequence);
+
+      attrs.AppendElement (compzillaXcb::RequestAttributes (mDisplay,
+                                                            mNodes[i].mWindow));
+      trees.AppendElement (xcb_query_tree (conn, mNodes[i].mWindow));
+    }
+
+    for (PRUint32 i = levelStart; i < levelEnd; i++) {
+      XWindowAttributes xattrs;
+      Node& node = mNodes[i];
+
+      if (compzillaXcb::GetAttributes (mDisplay, attrs[i - levelStart], &xattrs)) {
+        node.mX = xattrs.x;
+        node.mY = xattrs.y;
+        node.mWidth = xattrs.width;
+        node.mHeight = xattrs.height;
+        node.mBorder = xattrs.border_width;
+        node.mIsMapped = xattrs.map_state != IsUnmapped;
+      } else {
+        node.mX = node.mY = 0;
+        node.mWidth = node.mHeight = 0;
+        node.mBorder = 0;
+        node.mIsMapped = false;
+      }
+    }
+  }
+
+  if (failed) {
+    WARNING ("Not caching subwindows of 0x%0x%s\n", mWindow,
+             tooLarge ? ", too many" : "");
+    Clear ();
+    return tooLarge ? TOO_LARGE : FAILED;
+  }
+
+  for (PRUint32 i = 0; i < mNodes.Length (); i++) {
+    if (!mIndices.Put (mNodes[i].mWindow, i)) {
+      Clear ();
+      return FAILED;
+    }
+  }
+
+  SPEW ("Cached %d subwindows of 0x%0x\n", Count (), mWindow);
+  return BUILT;
+}
+
+
+void
+compzillaSubwindowTree::Clear ()
+{
+  mNodes.Clear ();
+  mIndices.Clear ();
+}
+
+
+PRUint32
+compzillaSubwindowTree::Count () const
+{
+  return mNodes.IsEmpty () ? 0 : mNodes.Length () - 1;
+}
+
+
+Window
+compzillaSubwindowTree::WindowAt (PRUint32 i) const
+{
+  return mNodes[i + 1].mWindow;
+}
+
+
+compzillaSubwindowTree::Node *
+compzillaSubwindowTree::GetNode (Window win)
+{
+  PRUint32 index;
+  if (!mIndices.Get (win, &index))
+    return NULL;
+  return &mNodes[index];
+}
+
+
+/*
+ * Same walk as XTranslateCoordinates from each window to the child under
+ * the point: the topmost mapped child whose border box holds it.
+ */
+Window
+compzillaSubwindowTree::Find (int *x, int *y)
+{
+  if (!IsBuilt ())
+    return mWindow;
+
+  PRUint32 index = 0;
+
+  for (;;) {
+    const Node& node = mNodes[index];
+    PRUint32 found = PRUint32(-1);
+
+    for (PRUint32 c = node.mChildCount - 1; c != PRUint32(-1); --c) {
+      const Node& child = mNodes[node.mFirstChild + c];
+      if (!child.mIsMapped)
+        continue;
+
+      if (*x >= child.mX && *x < child.mX + child.mWidth + 2 * child.mBorder &&
+          *y >= child.mY && *y < child.mY + child.mHeight + 2 * child.mBorder) {
+        found = node.mFirstChild + c;
+        break;
+      }
+    }
+
+    if (found == PRUint32(-1))
+      return node.mWindow;
+
+    *x -= mNodes[found].mX + mNodes[found].mBorder;
+    *y -= mNodes[found].mY + mNodes[found].mBorder;
+    index = found;
+  }
+}
+
+
+bool
+compzillaSubwindowTree::Configured (Window win,
+                                    PRInt32 x, PRInt32 y,
+                                    PRInt32 width, PRInt32 height,
+                                    PRInt32 border,
+                                    Window above)
+{
+  Node *node = GetNode (win);
+  if (!node || node->mParent == PRUint32(-1))
+    return true;
+
+  node->mX = x;
+  node->mY = y;
+  node->mWidth = width;
+  node->mHeight = height;
+  node->mBorder = border;
+
+  return Restack (node - mNodes.Elements (), above);
+}
+
+
+void
+compzillaSubwindowTree::Moved (Window win, PRInt32 x, PRInt32 y)
+{
+  Node *node = GetNode (win);
+  if (node) {
+    node->mX = x;
+    node->mY = y;
+  }
+}
+
+
+void
+compzillaSubwindowTree::SetMapped (Window win, bool mapped)
+{
+  Node *node = GetNode (win);
+  if (node)
+    node->mIsMapped = mapped;
+}
+
+
+/*
+ * Move the node at index to right above its sibling above, or to the
+ * bottom if above is None.
+ */
+bool
+compzillaSubwindowTree::Restack (PRUint32 index, Window above)
+{
+  const Node& parent = mNodes[mNodes[index].mParent];
+  PRUint32 first = parent.mFirstChild;
+  PRUint32 count = parent.mChildCount;
+  PRUint32 from = index - first;
+  PRUint32 to = 0;
+
+  if (above != None) {
+    Node *aboveNode = GetNode (above);
+    if (!aboveNode || aboveNode->mParent != mNodes[index].mParent)
+      return false;
+
+    PRUint32 abovePos = (aboveNode - mNodes.Elements ()) - first;
+    to = abovePos < from ? abovePos + 1 : abovePos;
+  }
+
+  if (to == from)
+    return true;
+
+  Node moved = mNodes[index];
+  if (to < from) {
+    for (PRUint32 i = from; i > to; i--)
+      mNodes[first + i] = mNodes[first + i - 1];
+  } else {
+    for (PRUint32 i = from; i < to; i++)
+      mNodes[first + i] = mNodes[first + i + 1];
+  }
+  mNodes[first + to] = moved;
+
+  return Reindex (first, count);
+}
+
+
+// Siblings moved within first..first + count, fix the references to them.
+bool
+compzillaSubwindowTree::Reindex (PRUint32 first, PRUint32 count)
+{
+  for (PRUint32 i = first; i < first + count; i++) {
+    const Node& node = mNodes[i];
+    if (!mIndices.Put (node.mWindow, i))
+      return false;
+
+    for (PRUint32 c = 0; c < node.mChildCount; c++)
+      mNodes[node.mFirstChild + c].mParent = i;
+  }
+  return true;
+}
@@ -0,0 +1,90 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaSubwindowTree_h___
+#define compzillaSubwindowTree_h___
+
+
+#include <nsDataHashtable.h>
+#include <nsHashKeys.h>
+#include <nsTArray.h>
+
+extern "C" {
+#include <X11/Xlib.h>
+}
+
+
+/*
+ * Client side copy of the subwindows of a toplevel, so pointer events can
+ * find the subwindow under the pointer without XTranslateCoordinates round
+ * trips for every level of nesting.
+ *
+ * Build selects SubstructureNotifyMask on the toplevel's subwindows and
+ * reads the tree, one round trip per level.  The owner must select it on
+ * the toplevel first, and pass on every substructure event reported for
+ * the tree.  Geometry and map changes are applied in place.  Anything else
+ * changing the tree means the owner has to clear it and build it again.
+ *
+ * Shapes aren't tracked, so shaped subwindows are hit by their bounding
+ * rectangle.
+ */
+class compzillaSubwindowTree
+{
+public:
+    compzillaSubwindowTree (Display *dpy, Window win);
+
+    bool IsBuilt () const { return !mNodes.IsEmpty (); }
+
+    // FAILED if the toplevel couldn't be read, which may not last.
+    // TOO_LARGE if it has more subwindows than are worth caching.
+    enum Status { BUILT, FAILED, TOO_LARGE };
+
+    Status Build ();
+    void Clear ();
+
+    // Subwindows in the tree, not including the toplevel.
+    PRUint32 Count () const;
+    Window WindowAt (PRUint32 i) const;
+
+    // The deepest mapped subwindow containing *x, *y, which are relative
+    // to the toplevel and are made relative to the subwindow found.
+    // Returns the toplevel if no subwindow contains the point.
+    Window Find (int *x, int *y);
+
+    // These return false if the tree no longer matches the server, and
+    // needs building again.
+    bool Configured (Window win,
+                     PRInt32 x, PRInt32 y,
+                     PRInt32 width, PRInt32 height,
+                     PRInt32 border,
+                     Window above);
+    void Moved (Window win, PRInt32 x, PRInt32 y);
+    void SetMapped (Window win, bool mapped);
+
+private:
+    // Nodes are stored breadth first, so each node's children are together,
+    // bottom to top.
+    struct Node {
+        Window mWindow;
+        PRInt32 mX, mY;
+        PRInt32 mWidth, mHeight;
+        PRInt32 mBorder;
+        bool mIsMapped;
+
+        PRUint32 mParent;
+        PRUint32 mFirstChild;
+        PRUint32 mChildCount;
+    };
+
+    Node *GetNode (Window win);
+    bool Restack (PRUint32 index, Window above);
+    bool Reindex (PRUint32 first, PRUint32 count);
+
+    Display *mDisplay;
+    Window mWindow;
+
+    nsTArray<Node> mNodes;
+    nsDataHashtable<nsUint32HashKey, PRUint32> mIndices;
+};
+
+
+#endif
@@ -0,0 +1,84 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <nsClassHashtable.h>
+#include <nsHashKeys.h>
+
+#include "compzillaSurfaceCache.h"
+#include "Debug.h"
+
+
+struct SurfaceEntry
+{
+  nsRefPtr<gfxXlibSurface> mSurface;
+  Visual *mVisual;
+  gfxIntSize mSize;
+};
+
+typedef nsClassHashtable<nsUint32HashKey, SurfaceEntry> SurfaceTable;
+
+// Created on first use, torn down when the module unloads.
+static SurfaceTable *sSurfaces = nsnull;
+
+
+already_AddRefed<gfxXlibSurface>
+compzillaSurfaceCache::Lookup (Display *dpy,
+                               Pixmap pixmap,
+                               Visual *visual,
+                               const gfxIntSize& size)
+{
+  if (!sSurfaces) {
+    sSurfaces = new SurfaceTable();
+    if (!sSurfaces || !sSurfaces->Init()) {
+      delete sSurfaces;
+      sSurfaces = nsnull;
+    }
+  }
+
+  SurfaceEntry *entry = nsnull;
+  if (sSurfaces && sSurfaces->Get(pixmap, &entry) &&
+      entry->mVisual == visual && entry->mSize == size) {
+    nsRefPtr<gfxXlibSurface> surface = entry->mSurface;
+    return surface.forget();
+  }
+
+  SPEW ("SurfaceCache: new surface for pixmap=%p, %dx%d\n",
+        pixmap, size.width, size.height);
+
+  nsRefPtr<gfxXlibSurface> surface = new gfxXlibSurface(dpy, pixmap, visual, size);
+  if (!surface || surface->CairoStatus())
+    return nsnull;
+
+  if (sSurfaces) {
+    if (!entry) {
+      entry = new SurfaceEntry();
+      if (entry && !sSurfaces->Put(pixmap, entry)) {
+        delete entry;
+        entry = nsnull;
+      }
+    }
+
+    if (entry) {
+      entry->mSurface = surface;
+      entry->mVisual = visual;
+      entry->mSize = size;
+    }
+  }
+
+  return surface.forget();
+}
+
+
+void
+compzillaSurfaceCache::Forget (Pixmap pixmap)
+{
+  if (sSurfaces)
+    sSurfaces->Remove(pixmap);
+}
+
+
+void
+compzillaSurfaceCache::Shutdown ()
+{
+  delete sSurfaces;
+  sSurfaces = nsnull;
+}
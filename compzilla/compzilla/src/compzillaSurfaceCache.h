@@ -0,0 +1,35 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaSurfaceCache_h___
+#define compzillaSurfaceCache_h___
+
+
+#include <nsAutoPtr.h>
+
+#include <gfxXlibSurface.h> // unstable
+
+extern "C" {
+#include <X11/Xlib.h>
+}
+
+
+/*
+ * Shares one gfxXlibSurface per window pixmap between every rendering
+ * context showing that window, so expose clones and thumbnails don't each
+ * wrap the same pixmap.  Entries are keyed by pixmap and only reused if the
+ * visual and size still match.  The owner of the pixmap must call Forget
+ * before freeing it.
+ */
+class compzillaSurfaceCache
+{
+public:
+    static already_AddRefed<gfxXlibSurface> Lookup (Display *dpy,
+                                                    Pixmap pixmap,
+                                                    Visual *visual,
+                                                    const gfxIntSize& size);
+    static void Forget (Pixmap pixmap);
+    static void Shutdown ();
+};
+
+
+#endif
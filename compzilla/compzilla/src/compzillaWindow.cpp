@@ -2,12 +2,21 @@
 
 
 #include "compzillaWindow.h"
+#include "compzillaAtomCache.h"
+#include "compzillaControl.h"
+#include "compzillaErrorTrap.h"
+#include "compzillaEventJournal.h"
+#include "compzillaIconLoader.h"
+#include "compzillaRegion.h"
+#include "compzillaSurfaceCache.h"
+#include "compzillaXcb.h"
 #include "Debug.h"
 #include "nsKeycodes.h"
 #include "XAtoms.h"
 
 #include <nsMemory.h>
 #include <nsRect.h>
+#include <nsTArray.h>
 #include <nsIDOMClassInfo.h>         // unstable
 #include <nsIDOMEventTarget.h>
 #include <nsIDOMHTMLCanvasElement.h> // unstable
@@ -22,6 +31,7 @@ class nsIFrame;
 extern "C" {
 #include <stdio.h>
 #include <X11/Xatom.h>
+#include <X11/Xatomtype.h>
 #include <X11/extensions/shape.h>
 #include <X11/extensions/Xcomposite.h>
 
@@ -38,6 +48,27 @@ extern "C" {
 extern XAtoms atoms;
 
 
+// How often the damage event rate is sampled, in milliseconds.
+#define DAMAGE_RATE_PERIOD 1000
+
+// Damage is simplified down to this many rectangles before redrawing.
+#define MAX_REDRAW_RECTS 4
+
+// Icons are scaled for canvases up to this size, and this many scaled
+// icons are kept per window.
+#define MAX_ICON_NODE_SIZE 256
+#define MAX_CACHED_ICONS 8
+
+// Values in a WM_NORMAL_HINTS property, flags included.
+#define SIZE_HINTS_COUNT NumPropSizeElements
+
+PRUint32 compzillaWindow::sDamageIdleRate = 10;
+PRUint32 compzillaWindow::sDamageBoundingBoxRate = 100;
+PRUint32 compzillaWindow::sDamageNonEmptyRate = 500;
+bool compzillaWindow::sUseShm = true;
+bool compzillaWindow::sCoalesceMotion = true;
+
+
 NS_IMPL_CLASSINFO(compzillaWindow, NULL, 0, COMPZILLA_WINDOW_CID)
 NS_IMPL_ADDREF(compzillaWindow)
 NS_IMPL_RELEASE(compzillaWindow)
@@ -56,12 +87,14 @@ NS_IMPL_CI_INTERFACE_GETTER2(compzillaWindow,
                              nsIDOMEventListener)
 
 nsresult
-CZ_NewCompzillaWindow(Display *display, Window win,
-                      XWindowAttributes *attrs, compzillaWindow** retval)
+CZ_NewCompzillaWindow(compzillaControl *control, Display *display, Window win,
+                      XWindowAttributes *attrs, bool isShaped,
+                      compzillaWindow** retval)
 {
   *retval = nsnull;
 
-  compzillaWindow *window = new compzillaWindow(display, win, attrs);
+  compzillaWindow *window = new compzillaWindow(control, display, win, attrs,
+                                                isShaped);
   if (!window)
     return NS_ERROR_OUT_OF_MEMORY;
 
@@ -72,20 +105,52 @@ CZ_NewCompzillaWindow(Display *display, Window win,
 }
 
 
-compzillaWindow::compzillaWindow(Display *display, Window win, XWindowAttributes *attrs)
+compzillaWindow::compzillaWindow(compzillaControl *control,
+                                 Display *display,
+                                 Window win,
+                                 XWindowAttributes *attrs,
+                                 bool isShaped)
 : mAttr(*attrs),
+  mHasIcon(false),
   mDisplay(display),
   mWindow(win),
+  mProperties(display, win),
+  mControl(control),
   mPixmap(None),
   mDamage(None),
+  mDamageRegion(None),
+  mIsDamagePending(false),
+  mIsFullyDamaged(false),
+  mDamageLevel(XDamageReportRawRectangles),
+  mDamageEventCount(0),
+  mDamageRateStart(PR_IntervalNow()),
+  mIsOccluded(false),
+  mIsShaped(isShaped),
+  mIsBypassed(false),
   mLastEntered(None),
+  mPendingMotionWindow(None),
+  mPendingMotionMask(0),
+  mIsMotionPending(false),
+  mGrabState(GRAB_NONE),
+  mHasFocus(false),
+  mGrabRequests(0),
+  mFocusChanges(0),
+  mSubwindows(display, win),
+  mIsSubwindowTreeFailed(false),
+  mIsSubwindowTreeTooLarge(false),
+  mEventMask(PropertyChangeMask | EnterWindowMask | FocusChangeMask),
   mIsDestroyed(false),
   mIsRedirected(false),
+  mIsPixmapStale(false),
+  mIsPixmapFailed(false),
+  mPixmapSerial(0),
   mIsResizePending(false)
 {
-  XSelectInput(display, win, (PropertyChangeMask | EnterWindowMask | FocusChangeMask));
+  XSelectInput(display, win, mEventMask);
+  PrefetchProperties();
 
 #if HAVE_XSHAPE
+  // Whether the window is shaped was queried along with its attributes.
   XShapeSelectInput(display, win, ShapeNotifyMask);
 #endif
 
@@ -94,16 +159,16 @@ compzillaWindow::compzillaWindow(Display *display, Window win, XWindowAttributes
   // for a given window.
   //XFixesSelectCursorInput(display, win, XFixesDisplayCursorNotifyMask);
 
-  XGrabButton(display, AnyButton, AnyModifier, win, true, 
-              (ButtonPressMask | ButtonReleaseMask | ButtonMotionMask),
-              GrabModeSync, GrabModeSync, None, None);
+  SetGrabState(GRAB_BUTTONS_SYNC);
 
   /* 
    * Set up damage notification.  RawRectangles gives us smaller grain
    * changes, versus NonEmpty which seems to always include the entire
-   * contents.
+   * contents.  Busy windows get switched to a coarser level by
+   * UpdateDamageRate.
    */
-  mDamage = XDamageCreate(mDisplay, mWindow, XDamageReportRawRectangles);
+  mDamage = XDamageCreate(mDisplay, mWindow, mDamageLevel);
+  mDamageRegion = XFixesCreateRegion(mDisplay, NULL, 0);
 
   if (mAttr.map_state == IsViewable) {
     mAttr.map_state = IsUnmapped;
@@ -128,42 +193,100 @@ compzillaWindow::~compzillaWindow()
 
 
 void
-compzillaWindow::UpdateAttributes()
+compzillaWindow::BindWindow()
 {
-  XGetWindowAttributes(mDisplay, mWindow, &mAttr);
+  if (mIsBypassed)
+    return;
+
+  RedirectWindow();
+
+  // Not viewable windows are bound from Mapped.
+  if (!mPixmap && !mIsPixmapFailed && mAttr.map_state == IsViewable)
+    NamePixmap();
 }
 
 
+/*
+ * Set up the persistent offscreen window contents pixmap.  This used to
+ * grab the server to make sure the window was still viewable, freezing
+ * every client.  Now the pixmap is named optimistically, and if the window
+ * was unmapped meanwhile CheckPixmap finds out from the trapped error.
+ */
 void
-compzillaWindow::BindWindow()
+compzillaWindow::NamePixmap()
 {
-  RedirectWindow();
+  mPixmapSerial = compzillaErrorTrap::Trap(mDisplay);
+  mPixmap = XCompositeNameWindowPixmap(mDisplay, mWindow);
+
+  if (mPixmap == None) {
+    ERROR("XCompositeNameWindowPixmap failed for window %p\n", mWindow);
+    mPixmapSerial = 0;
+  }
+}
 
-  if (!mPixmap) {
-    XGrabServer(mDisplay);
 
-    UpdateAttributes();
+/*
+ * Returns false if naming mPixmap failed, dropping it.  Not retried until
+ * the window is mapped again.  Until the server has got to the request the
+ * pixmap is assumed good; drawing from a bad one only fails harmlessly.
+ */
+bool
+compzillaWindow::CheckPixmap()
+{
+  if (!mPixmapSerial)
+    return mPixmap != None;
+
+  compzillaErrorTrap::Status status =
+    compzillaErrorTrap::Check(mDisplay, mPixmapSerial);
+  if (status == compzillaErrorTrap::PENDING)
+    return true;
+
+  mPixmapSerial = 0;
+  if (status == compzillaErrorTrap::SUCCEEDED)
+    return true;
+
+  SPEW("CheckPixmap: naming pixmap failed for window %p\n", mWindow);
+
+  // There is no pixmap to free.
+  compzillaSurfaceCache::Forget(mPixmap);
+  mPixmap = None;
+  mIsPixmapFailed = true;
+  ForgetDrawables();
+  return false;
+}
 
-    if (mAttr.map_state == IsViewable) {
-      // Set up persistent offscreen window contents pixmap.
-      mPixmap = XCompositeNameWindowPixmap(mDisplay, mWindow);
 
-      if (mPixmap == None) {
-        ERROR("XCompositeNameWindowPixmap failed for window %p\n", mWindow);
+void 
+compzillaWindow::ReleaseWindow()
+{
+  if (mPixmap) {
+    compzillaSurfaceCache::Forget(mPixmap);
+
+    if (mPixmapSerial) {
+      // The pixmap may never have been created.
+      if (compzillaErrorTrap::Check(mDisplay, mPixmapSerial) !=
+          compzillaErrorTrap::FAILED) {
+        compzillaErrorTrap::Trap(mDisplay);
+        XFreePixmap(mDisplay, mPixmap);
       }
+      mPixmapSerial = 0;
+    } else {
+      XFreePixmap(mDisplay, mPixmap);
     }
+    mPixmap = None;
 
-    XUngrabServer(mDisplay);
+    // The XID may be handed out again for the next pixmap, so make sure
+    // it is pushed to the contexts regardless.
+    ForgetDrawables();
   }
 }
 
 
-void 
-compzillaWindow::ReleaseWindow()
+void
+compzillaWindow::ForgetDrawables()
 {
-  if (mPixmap) {
-    XFreePixmap(mDisplay, mPixmap);
-    mPixmap = None;
+  for (PRUint32 i = 0; i < mContentNodes.Length(); i++) {
+    mContentNodes[i].mDrawable = None;
   }
 }
 
@@ -186,6 +309,7 @@ compzillaWindow::UnredirectWindow()
     return;
 
   ReleaseWindow();
+  mShmImage = nsnull;
 
   XCompositeUnredirectWindow(mDisplay, mWindow, CompositeRedirectManual);
   mIsRedirected = false;
@@ -260,6 +384,99 @@ compzillaWindow::GetNativeWindowId(PRInt32 *aId)
 }
 
 
+NS_IMETHODIMP
+compzillaWindow::GetDamageReportLevel(PRInt32 *aLevel)
+{
+  *aLevel = mDamageLevel;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::GetGrabState(PRInt32 *aGrabState)
+{
+  *aGrabState = mGrabState;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::GetHasFocus(PRBool *aHasFocus)
+{
+  *aHasFocus = mHasFocus;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::GetGrabRequests(PRUint32 *aGrabRequests)
+{
+  *aGrabRequests = mGrabRequests;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::GetFocusChanges(PRUint32 *aFocusChanges)
+{
+  *aFocusChanges = mFocusChanges;
+  return NS_OK;
+}
+
+
+void
+compzillaWindow::SetGrabState(PRInt32 state)
+{
+  if (state == mGrabState)
+    return;
+
+  SPEW_EVENT("SetGrabState: win=%p, state=%d -> %d\n", mWindow, mGrabState, state);
+
+  switch (state) {
+    case GRAB_BUTTONS_SYNC:
+      XGrabButton(mDisplay, AnyButton, AnyModifier, mWindow, true, 
+                  (ButtonPressMask | ButtonReleaseMask | ButtonMotionMask),
+                  GrabModeSync, GrabModeSync, None, None);
+      mGrabRequests++;
+
+      if (mGrabState == GRAB_INPUT_ASYNC) {
+        XUngrabKey(mDisplay, AnyKey, AnyModifier, mWindow);
+        mGrabRequests++;
+      }
+      break;
+
+    case GRAB_INPUT_ASYNC:
+      // Start a passive grab.  The window's app can override this.
+      XGrabButton(mDisplay, AnyButton, AnyModifier, 
+                  mWindow, True, 
+                  (ButtonPressMask | ButtonReleaseMask | EnterWindowMask | 
+                   LeaveWindowMask | PointerMotionMask),
+                  GrabModeAsync, GrabModeAsync,  None, None);
+
+      XGrabKey(mDisplay, AnyKey, AnyModifier, mWindow, True, GrabModeAsync, 
+               GrabModeAsync);
+      mGrabRequests += 2;
+      break;
+
+    case GRAB_NONE:
+      XUngrabButton(mDisplay, AnyButton, AnyModifier, mWindow);
+      mGrabRequests++;
+
+      if (mGrabState == GRAB_INPUT_ASYNC) {
+        XUngrabKey(mDisplay, AnyKey, AnyModifier, mWindow);
+        mGrabRequests++;
+      }
+      break;
+
+    default:
+      NS_NOTREACHED("Unknown grab state");
+      return;
+  }
+
+  mGrabState = state;
+}
+
+
 NS_IMETHODIMP
 compzillaWindow::AddContentNode(nsIDOMHTMLCanvasElement* aContent)
 {
@@ -278,21 +495,27 @@ compzillaWindow::AddContentNode(nsIDOMHTMLCanvasElement* aContent)
   if (!internal)
     return NS_ERROR_FAILURE;
 
-  mContentNodes.AppendObject(aContent);
+  ContentNode *node = mContentNodes.AppendElement();
+  if (!node)
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  node->mCanvas = aContent;
+  node->mContext = internal;
+  node->mDrawable = None;
+
+  if (mControl)
+    mControl->StackingChanged();
+
   ConnectListeners(true, aContent);
 
   aContent->SetWidth(mAttr.width);
   aContent->SetHeight(mAttr.height);
 
   /* when initially adding a content node, we need to force a redraw
-     to that node if we have an existing pixmap. */
+     to that node if we have an existing pixmap.  This happens on the next
+     frame, along with any other damage. */
   if (mPixmap) {
-    XRectangle r;
-    r.x = r.y = 0;
-    r.width = mAttr.width;
-    r.height = mAttr.height;
-
-    RedrawContentNode(aContent, &r);
+    Damaged(NULL);
   }
 
   return NS_OK;
@@ -308,10 +531,70 @@ compzillaWindow::RemoveContentNode(nsIDOMHTMLCanvasElement* aContent)
     return NS_OK;
 
   // Allow a caller to remove O(N^2) behavior by removing end-to-start.
-  for (PRUint32 i = mContentNodes.Count() - 1; i != PRUint32(-1); --i) {
-    if (mContentNodes.ObjectAt(i) == aContent) {
-      mContentNodes.RemoveObjectAt(i);
+  for (PRUint32 i = mContentNodes.Length() - 1; i != PRUint32(-1); --i) {
+    if (mContentNodes[i].mCanvas == aContent) {
+      mContentNodes.RemoveElementAt(i);
+      if (mControl)
+        mControl->StackingChanged();
       ConnectListeners(false, aContent);
+
+      // Nothing left to take focus, so forward the next FocusIn.
+      if (mContentNodes.IsEmpty())
+        mHasFocus = false;
+      break;
+    }
+  }
+
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::AddIconNode(nsIDOMHTMLCanvasElement* aIcon, PRUint32 aSize)
+{
+  SPEW("AddIconNode this=%p, canvas=%p, size=%d\n", this, aIcon, aSize);
+
+  if (mIsDestroyed)
+    return NS_ERROR_FAILURE;
+
+  if (aSize == 0 || aSize > MAX_ICON_NODE_SIZE)
+    return NS_ERROR_INVALID_ARG;
+
+  nsCOMPtr<compzillaIRenderingContextInternal> internal;
+  nsresult rv = aIcon->GetContext(NS_LITERAL_STRING("compzilla"),
+                                  JSVAL_VOID,
+                                  getter_AddRefs(internal));
+  if (NS_FAILED(rv))
+    return rv;
+
+  if (!internal)
+    return NS_ERROR_FAILURE;
+
+  IconNode *node = mIconNodes.AppendElement();
+  if (!node)
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  node->mCanvas = aIcon;
+  node->mContext = internal;
+  node->mSize = aSize;
+  node->mHash = 0;
+  node->mIsLoading = false;
+  node->mIsStale = false;
+
+  LoadIcons();
+
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::RemoveIconNode(nsIDOMHTMLCanvasElement* aIcon)
+{
+  SPEW("RemoveIconNode this=%p, canvas=%p\n", this, aIcon);
+
+  for (PRUint32 i = mIconNodes.Length() - 1; i != PRUint32(-1); --i) {
+    if (mIconNodes[i].mCanvas == aIcon) {
+      mIconNodes.RemoveElementAt(i);
       break;
     }
   }
@@ -320,6 +603,142 @@ compzillaWindow::RemoveContentNode(nsIDOMHTMLCanvasElement* aContent)
 }
 
 
+NS_IMETHODIMP
+compzillaWindow::GetHasIcon(PRBool *aHasIcon)
+{
+  *aHasIcon = mHasIcon;
+  return NS_OK;
+}
+
+
+/*
+ * Fetch the icon images fitting every node and show them, reading the
+ * property once for all of them.  Images seen recently are taken from
+ * mIconCache, others are scaled by compzillaIconLoader and shown in
+ * IconLoaded.
+ */
+void
+compzillaWindow::LoadIcons()
+{
+  // Nodes still being scaled load again once that is done.
+  nsTArray<PRUint32> sizes;
+  for (PRUint32 i = 0; i < mIconNodes.Length(); i++) {
+    IconNode& node = mIconNodes[i];
+    if (node.mIsLoading)
+      node.mIsStale = true;
+    else if (!sizes.Contains(node.mSize))
+      sizes.AppendElement(node.mSize);
+  }
+
+  if (sizes.IsEmpty())
+    return;
+
+  nsTArray<compzillaIconLoader::Image> images;
+  nsTArray<PRUint32> picked;
+  mHasIcon = compzillaIconLoader::Fetch(mDisplay, mWindow, sizes,
+                                        mIconLayout, images, picked);
+
+  for (PRUint32 s = 0; s < sizes.Length(); s++) {
+    compzillaIconLoader::Image *image = mHasIcon ? &images[picked[s]] : nsnull;
+
+    gfxImageSurface *cached = nsnull;
+    for (PRUint32 i = 0; image && i < mIconCache.Length(); i++) {
+      if (mIconCache[i].mSize == sizes[s] && mIconCache[i].mHash == image->mHash) {
+        cached = mIconCache[i].mSurface;
+        break;
+      }
+    }
+
+    bool scale = false;
+    for (PRUint32 i = 0; i < mIconNodes.Length(); i++) {
+      IconNode& node = mIconNodes[i];
+      if (node.mSize != sizes[s] || node.mIsLoading)
+        continue;
+
+      if (!image) {
+        ShowIcon(node, 0, nsnull);
+      } else if (node.mHash == image->mHash) {
+        // Unchanged
+      } else if (cached) {
+        ShowIcon(node, image->mHash, cached);
+      } else {
+        node.mIsLoading = true;
+        scale = true;
+      }
+    }
+
+    if (!scale)
+      continue;
+
+    // Copied, the image may fit other sizes too.
+    nsTArray<PRUint32> pixels(image->mPixels);
+    if (NS_FAILED(compzillaIconLoader::Scale(this, sizes[s], image->mHash,
+                                             pixels,
+                                             image->mWidth, image->mHeight))) {
+      for (PRUint32 i = 0; i < mIconNodes.Length(); i++) {
+        if (mIconNodes[i].mSize == sizes[s])
+          mIconNodes[i].mIsLoading = false;
+      }
+    }
+  }
+}
+
+
+void
+compzillaWindow::ShowIcon(IconNode& node, PRUint32 hash, gfxImageSurface *surface)
+{
+  node.mHash = hash;
+
+  if (surface) {
+    node.mCanvas->SetWidth(surface->Width());
+    node.mCanvas->SetHeight(surface->Height());
+  }
+
+  node.mContext->SetSurface(surface);
+
+  if (surface) {
+    node.mContext->Redraw(gfxRect(0, 0, surface->Width(), surface->Height()));
+  }
+}
+
+
+void
+compzillaWindow::IconLoaded(PRUint32 size, PRUint32 hash, gfxImageSurface *surface)
+{
+  if (mIsDestroyed)
+    return;
+
+  // Most recently used last.
+  if (mIconCache.Length() >= MAX_CACHED_ICONS)
+    mIconCache.RemoveElementAt(0);
+
+  CachedIcon *cached = mIconCache.AppendElement();
+  if (cached) {
+    cached->mSize = size;
+    cached->mHash = hash;
+    cached->mSurface = surface;
+  }
+
+  bool stale = false;
+  for (PRUint32 i = 0; i < mIconNodes.Length(); i++) {
+    IconNode& node = mIconNodes[i];
+    if (!node.mIsLoading || node.mSize != size)
+      continue;
+
+    node.mIsLoading = false;
+    ShowIcon(node, hash, surface);
+
+    if (node.mIsStale) {
+      node.mIsStale = false;
+      stale = true;
+    }
+  }
+
+  if (stale)
+    LoadIcons();
+}
+
+
 NS_IMETHODIMP
 compzillaWindow::AddObserver(compzillaIWindowObserver *aObserver)
 {
@@ -361,51 +780,128 @@ compzillaWindow::RemoveObserver(compzillaIWindowObserver *aObserver)
     }
   }
 
+  for (PRUint32 i = mSubscriptions.Length() - 1; i != PRUint32(-1); --i) {
+    if (mSubscriptions[i].mObserver == aObserver) {
+      mSubscriptions.RemoveElementAt(i);
+      break;
+    }
+  }
+
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::SubscribeProperties(compzillaIWindowObserver *aObserver,
+    PRUint32 count,
+    PRUint32 *atoms)
+{
+  return Subscribe(aObserver, count, atoms, false);
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::SubscribeClientMessages(compzillaIWindowObserver *aObserver,
+    PRUint32 count,
+    PRUint32 *messageTypes)
+{
+  return Subscribe(aObserver, count, messageTypes, true);
+}
+
+
+compzillaWindow::Subscription *
+compzillaWindow::GetSubscription(compzillaIWindowObserver *observer)
+{
+  for (PRUint32 i = 0; i < mSubscriptions.Length(); i++) {
+    if (mSubscriptions[i].mObserver == observer)
+      return &mSubscriptions[i];
+  }
+  return NULL;
+}
+
+
+nsresult
+compzillaWindow::Subscribe(compzillaIWindowObserver *observer,
+    PRUint32 count,
+    PRUint32 *atoms,
+    bool messageTypes)
+{
+  if (mIsDestroyed)
+    return NS_ERROR_FAILURE;
+
+  // The subscription only keeps a weak pointer, removed with the observer.
+  if (mObservers.IndexOf(observer) == -1)
+    return NS_ERROR_INVALID_ARG;
+
+  Subscription *sub = GetSubscription(observer);
+  if (!sub) {
+    sub = mSubscriptions.AppendElement();
+    if (!sub)
+      return NS_ERROR_OUT_OF_MEMORY;
+
+    sub->mObserver = observer;
+    sub->mFilterProperties = false;
+    sub->mFilterMessageTypes = false;
+  }
+
+  nsTArray<PRUint32>& list = messageTypes ? sub->mMessageTypes : sub->mProperties;
+  if (!list.ReplaceElementsAt(0, list.Length(), atoms, count))
+    return NS_ERROR_OUT_OF_MEMORY;
+  list.Sort();
+
+  if (messageTypes)
+    sub->mFilterMessageTypes = true;
+  else
+    sub->mFilterProperties = true;
+
   return NS_OK;
 }
 
 
+bool
+compzillaWindow::IsSubscribed(compzillaIWindowObserver *observer,
+    Atom atom,
+    bool messageType)
+{
+  Subscription *sub = GetSubscription(observer);
+  if (!sub)
+    return true;
+
+  if (messageType) {
+    return !sub->mFilterMessageTypes ||
+      sub->mMessageTypes.BinaryIndexOf(PRUint32(atom)) != sub->mMessageTypes.NoIndex;
+  }
+
+  return !sub->mFilterProperties ||
+    sub->mProperties.BinaryIndexOf(PRUint32(atom)) != sub->mProperties.NoIndex;
+}
+
+
 nsresult
 compzillaWindow::GetUTF8StringProperty(Atom prop, nsACString& utf8Value)
 {
-  SPEW("GetUTF8StringProperty this=%p, prop=%s\n", this, XGetAtomName(mDisplay, prop));
-
-  Atom actual_type;
-  int format;
-  unsigned long nitems;
-  unsigned long bytes_after_return;
-  unsigned char *data;
-
-  if (XGetWindowProperty(mDisplay,
-                         mWindow, 
-                         prop,
-                         0,
-                         BUFSIZ, 
-                         false, 
-                         AnyPropertyType,
-                         &actual_type, 
-                         &format,  
-                         &nitems, 
-                         &bytes_after_return, 
-                         &data) != Success ||
-    format == None) {
+  SPEW("GetUTF8StringProperty this=%p, prop=%s\n", this, compzillaAtomCache::GetName(mDisplay, prop));
+
+  compzillaPropertyReply *reply = mProperties.Lookup(prop);
+  if (!reply) {
     SPEW(" + (Not Found)\n");
 
     return NS_ERROR_FAILURE;
   }
 
-  if (actual_type == atoms.x.UTF8_STRING) {
-    utf8Value =(char*) data;
+  if (reply->Type() == atoms.x.UTF8_STRING) {
+    utf8Value.Assign((char *) reply->Value(), reply->Length());
   }
-  else if (actual_type == XA_STRING) {
+  else if (reply->Type() == XA_STRING) {
     char **list = NULL;
     int count;
 
-    count = gdk_text_property_to_utf8_list(gdk_x11_xatom_to_atom(actual_type),
-                                           format, data, nitems, &list);
+    count = gdk_text_property_to_utf8_list(gdk_x11_xatom_to_atom(reply->Type()),
+                                           reply->Format(),
+                                           (guchar *) reply->Value(),
+                                           reply->Length(), &list);
 
     if (count == 0) {
-      XFree(data);
       return NS_ERROR_FAILURE;
     }
 
@@ -415,14 +911,11 @@ compzillaWindow::GetUTF8StringProperty(Atom prop, nsACString& utf8Value)
   }
   else {
     WARNING("invalid type for string property '%s': '%s'\n",
-            XGetAtomName(mDisplay, prop),
-            XGetAtomName(mDisplay, actual_type));
-    XFree(data);
+            compzillaAtomCache::GetName(mDisplay, prop),
+            compzillaAtomCache::GetName(mDisplay, reply->Type()));
     return NS_ERROR_FAILURE;
   }
 
-  XFree(data);
-
   return NS_OK;
 }
 
@@ -430,37 +923,19 @@ compzillaWindow::GetUTF8StringProperty(Atom prop, nsACString& utf8Value)
 nsresult
 compzillaWindow::GetAtomProperty(Atom prop, PRUint32* value)
 {
-  SPEW("GetAtomProperty this=%p, prop=%s\n", this, XGetAtomName(mDisplay, prop));
-
-  Atom actual_type;
-  int format;
-  unsigned long nitems;
-  unsigned long bytes_after_return;
-  unsigned char *data;
-
-  if(XGetWindowProperty(mDisplay, 
-                        mWindow, 
-                        prop,
-                        0, 
-                        BUFSIZ, 
-                        false, 
-                        XA_ATOM,
-                        &actual_type, 
-                        &format,
-                        &nitems,
-                        &bytes_after_return, 
-                        &data) != Success || 
-      format == None) {
+  SPEW("GetAtomProperty this=%p, prop=%s\n", this, compzillaAtomCache::GetName(mDisplay, prop));
+
+  compzillaPropertyReply *reply = mProperties.Lookup(prop);
+  if (!reply || reply->Type() != XA_ATOM ||
+      reply->Format() != 32 || reply->Count() == 0) {
     SPEW(" + (Not Found)\n");
 
     return NS_ERROR_FAILURE;
   }
 
-  *value = *(Atom*) data;
+  *value = *(PRUint32 *) reply->Value();
 
-  SPEW(" + %d (%s)\n", *value, XGetAtomName(mDisplay, *value));
-
-  XFree(data);
+  SPEW(" + %d (%s)\n", *value, compzillaAtomCache::GetName(mDisplay, *value));
 
   return NS_OK;
 }
@@ -543,6 +1018,9 @@ compzillaWindow::DOMKeyCodeToKeySym(PRUint32 vkCode)
 void
 compzillaWindow::SendKeyEvent(int eventType, nsIDOMKeyEvent *keyEv)
 {
+  // Queued motion happened before the key, so it goes first.
+  FlushMotion();
+
   DOMTimeStamp timestamp;
   PRBool ctrl, shift, alt, meta;
   int state = 0;
@@ -651,6 +1129,8 @@ compzillaWindow::SendKeyEvent(int eventType, nsIDOMKeyEvent *keyEv)
 void
 compzillaWindow::SendKeyEvent(int eventType, nsIDOMKeyEvent *keyEv)
 {
+  FlushMotion();
+
   GdkEvent *gdkev = gtk_get_current_event();
 
   // Build up the XEvent we will send
@@ -731,11 +1211,25 @@ compzillaWindow::KeyUp(nsIDOMEvent* aDOMEvent)
 
 Window
 compzillaWindow::GetSubwindowAtPoint(int *x, int *y)
+{
+  if (!mSubwindows.IsBuilt() && !mIsSubwindowTreeFailed)
+    BuildSubwindowTree();
+
+  if (mSubwindows.IsBuilt())
+    return mSubwindows.Find(x, y);
+
+  return QuerySubwindowAtPoint(x, y);
+}
+
+
+Window
+compzillaWindow::QuerySubwindowAtPoint(int *x, int *y)
 {
   Window last_child, child, new_child;
   last_child = child = mWindow;
 
   do {
+    compzillaXcb::CountRoundTrip();
     if (!XTranslateCoordinates(mDisplay, last_child, child, 
                                *x, *y, x, y, &new_child))
       break;
@@ -749,31 +1243,110 @@ compzillaWindow::GetSubwindowAtPoint(int *x, int *y)
 
 
 void
-compzillaWindow::SendMouseEvent(int eventType, nsIDOMMouseEvent *mouseEv, bool isScroll)
+compzillaWindow::BuildSubwindowTree()
 {
-  DOMTimeStamp timestamp;
-  PRUint16 button;
-  int x, y;
-  int x_root, y_root;
-  PRBool ctrl, shift, alt, meta;
-  int state = 0;
+  if (mIsDestroyed || !mControl)
+    return;
 
-  mouseEv->GetTimeStamp(&timestamp);
-  if (!timestamp) {
-    timestamp = gtk_get_current_event_time(); // CurrentTime;
+  // Changes to the tree are reported from now on, so none are missed
+  // while it is read.
+  if (!(mEventMask & SubstructureNotifyMask)) {
+    mEventMask |= SubstructureNotifyMask;
+    XSelectInput(mDisplay, mWindow, mEventMask);
   }
 
-  mouseEv->GetScreenX(&x_root);
-  mouseEv->GetScreenY(&y_root);
-  mouseEv->GetClientX(&x);
-  mouseEv->GetClientY(&y);
-
-  /*
-   * Use the cached Xwindow properties.  These may be incorrect due to a bug
-   * we have where the window isn't moved after initially being shown.
-   */
-  x -= mAttr.x;
-  y -= mAttr.y;
+  compzillaSubwindowTree::Status status = mSubwindows.Build();
+  if (status != compzillaSubwindowTree::BUILT) {
+    mIsSubwindowTreeFailed = true;
+    mIsSubwindowTreeTooLarge = status == compzillaSubwindowTree::TOO_LARGE;
+    return;
+  }
+
+  for (PRUint32 i = 0; i < mSubwindows.Count(); i++) {
+    mControl->AddSubwindow(mSubwindows.WindowAt(i), this);
+  }
+}
+
+
+void
+compzillaWindow::ClearSubwindowTree()
+{
+  if (mControl) {
+    for (PRUint32 i = 0; i < mSubwindows.Count(); i++) {
+      mControl->RemoveSubwindow(mSubwindows.WindowAt(i), this);
+    }
+  }
+
+  mSubwindows.Clear();
+}
+
+
+void
+compzillaWindow::SubwindowEvent(XEvent *xev)
+{
+  bool isCurrent = true;
+
+  switch (xev->type) {
+    case ConfigureNotify:
+      isCurrent = mSubwindows.Configured(xev->xconfigure.window,
+          xev->xconfigure.x,
+          xev->xconfigure.y,
+          xev->xconfigure.width,
+          xev->xconfigure.height,
+          xev->xconfigure.border_width,
+          xev->xconfigure.above);
+      break;
+    case GravityNotify:
+      mSubwindows.Moved(xev->xgravity.window, xev->xgravity.x, xev->xgravity.y);
+      break;
+    case MapNotify:
+      mSubwindows.SetMapped(xev->xmap.window, true);
+      break;
+    case UnmapNotify:
+      mSubwindows.SetMapped(xev->xunmap.window, false);
+      break;
+    default:
+      // Created, destroyed, reparented or circulated.  Read the tree again
+      // when the pointer next needs it, unless it was too large to cache:
+      // building it again would only fail again after thousands of
+      // requests, so it stays with XTranslateCoordinates.
+      isCurrent = false;
+      if (!mIsSubwindowTreeTooLarge)
+        mIsSubwindowTreeFailed = false;
+      break;
+  }
+
+  if (!isCurrent)
+    ClearSubwindowTree();
+}
+
+
+void
+compzillaWindow::SendMouseEvent(int eventType, nsIDOMMouseEvent *mouseEv, bool isScroll)
+{
+  DOMTimeStamp timestamp;
+  PRUint16 button;
+  int x, y;
+  int x_root, y_root;
+  PRBool ctrl, shift, alt, meta;
+  int state = 0;
+
+  mouseEv->GetTimeStamp(&timestamp);
+  if (!timestamp) {
+    timestamp = gtk_get_current_event_time(); // CurrentTime;
+  }
+
+  mouseEv->GetScreenX(&x_root);
+  mouseEv->GetScreenY(&y_root);
+  mouseEv->GetClientX(&x);
+  mouseEv->GetClientY(&y);
+
+  /*
+   * Use the cached Xwindow properties.  These may be incorrect due to a bug
+   * we have where the window isn't moved after initially being shown.
+   */
+  x -= mAttr.x;
+  y -= mAttr.y;
 
   mouseEv->GetButton(&button);
 
@@ -812,6 +1385,10 @@ compzillaWindow::SendMouseEvent(int eventType, nsIDOMMouseEvent *mouseEv, bool i
 
   Window destChild = GetSubwindowAtPoint(&x, &y);
 
+  // Queued motion goes first, and to the subwindow it was meant for.
+  if (eventType != MotionNotify || destChild != mLastEntered)
+    FlushMotion();
+
   if (destChild != mLastEntered && (eventType != EnterNotify)) {
     if (mLastEntered) {
       XEvent xev = { 0 };
@@ -923,21 +1500,21 @@ compzillaWindow::SendMouseEvent(int eventType, nsIDOMMouseEvent *mouseEv, bool i
              mWindow, destChild, x, y, state, button + 1, timestamp);
 
   if (eventType == ButtonPress) {
+    // Always ungrab: gdk_pointer_is_grabbed() doesn't know about the
+    // implicit grab from this click, which would keep the pointer from
+    // the client.  These are GDK's grabs, not the window's, so they aren't
+    // counted in mGrabRequests.
     gdk_pointer_ungrab(GDK_CURRENT_TIME);
     gdk_keyboard_ungrab(GDK_CURRENT_TIME);
 
-    // Start a passive grab.  The window's app can override this.
-    XGrabButton(mDisplay, AnyButton, AnyModifier, 
-                mWindow, True, 
-                (ButtonPressMask | ButtonReleaseMask | EnterWindowMask | 
-                 LeaveWindowMask | PointerMotionMask),
-                 GrabModeAsync, GrabModeAsync,  None, None);
-
-    XGrabKey(mDisplay, AnyKey, AnyModifier, mWindow, True, GrabModeAsync, 
-             GrabModeAsync);
+    SetGrabState(GRAB_INPUT_ASYNC);
   }
 
-  XSendEvent(mDisplay, destChild, True, xevMask, &xev);
+  if (eventType == MotionNotify && sCoalesceMotion && mControl) {
+    QueueMotion(destChild, xevMask, &xev);
+  } else {
+    XSendEvent(mDisplay, destChild, True, xevMask, &xev);
+  }
 
   // Stop processing event
   if (eventType != MotionNotify) {
@@ -947,6 +1524,40 @@ compzillaWindow::SendMouseEvent(int eventType, nsIDOMMouseEvent *mouseEv, bool i
 }
 
 
+void
+compzillaWindow::QueueMotion(Window dest, long mask, XEvent *xev)
+{
+  if (mIsMotionPending && mPendingMotionWindow != dest)
+    FlushMotion();
+
+  bool wasPending = mIsMotionPending;
+
+  mPendingMotion = *xev;
+  mPendingMotionWindow = dest;
+  mPendingMotionMask = mask;
+  mIsMotionPending = true;
+
+  if (!wasPending)
+    mControl->MotionQueued(this);
+}
+
+
+void
+compzillaWindow::FlushMotion()
+{
+  if (!mIsMotionPending)
+    return;
+
+  mIsMotionPending = false;
+
+  SPEW_EVENT("FlushMotion: win=%p, child=%p, x=%d, y=%d\n",
+             mWindow, mPendingMotionWindow,
+             mPendingMotion.xmotion.x, mPendingMotion.xmotion.y);
+
+  XSendEvent(mDisplay, mPendingMotionWindow, True, mPendingMotionMask, &mPendingMotion);
+}
+
+
 NS_IMETHODIMP
 compzillaWindow::MouseDown(nsIDOMEvent* aDOMEvent)
 {
@@ -1020,6 +1631,14 @@ compzillaWindow::FocusIn(nsIDOMEvent* aDOMEvent)
 {
   SPEW_EVENT("DOM FocusIn: win=%p\n", mWindow);
 
+  FlushMotion();
+
+  if (mHasFocus)
+    return NS_OK;
+
+  mHasFocus = true;
+  mFocusChanges++;
+
   XEvent xev = { 0 };
   xev.xfocus.type = _FocusIn;
   xev.xfocus.serial = 0;
@@ -1040,6 +1659,14 @@ compzillaWindow::FocusOut(nsIDOMEvent* aDOMEvent)
 {
   SPEW_EVENT("DOM FocusOut: win=%p\n", mWindow);
 
+  FlushMotion();
+
+  if (!mHasFocus)
+    return NS_OK;
+
+  mHasFocus = false;
+  mFocusChanges++;
+
   XEvent xev = { 0 };
   xev.xfocus.type = _FocusOut;
   xev.xfocus.serial = 0;
@@ -1087,22 +1714,40 @@ void
 compzillaWindow::Destroyed()
 {
   SPEW("DestroyWindow this=%p, window=%p, observers=%d, canvases=%d\n", 
-      this, mWindow, mObservers.Count(), mContentNodes.Count());
+      this, mWindow, mObservers.Count(), mContentNodes.Length());
 
   if (mIsDestroyed)
     return;
 
   mIsDestroyed = true;
+  mIsMotionPending = false;
+  mHasFocus = false;
+  ClearSubwindowTree();
+  mControl = nsnull;
+
+  mProperties.Clear();
+
+  if (mDamageRegion) {
+    XFixesDestroyRegion(mDisplay, mDamageRegion);
+    mDamageRegion = None;
+  }
+
+  mShmImage = nsnull;
 
   // Allow a caller to remove O(N^2) behavior by removing end-to-start.
-  for (PRUint32 i = mContentNodes.Count() - 1; i != PRUint32(-1); --i) {
-    ConnectListeners(false, mContentNodes.ObjectAt(i));
+  for (PRUint32 i = mContentNodes.Length() - 1; i != PRUint32(-1); --i) {
+    ConnectListeners(false, mContentNodes[i].mCanvas);
   }
   mContentNodes.Clear();
 
+  mIconNodes.Clear();
+  mIconCache.Clear();
+  mIconLayout.Clear();
+
   // Copy the observers so list iteration is reentrant.
   nsCOMArray<compzillaIWindowObserver> observers(mObservers);
   mObservers.Clear();
+  mSubscriptions.Clear();
 
   for (PRUint32 i = observers.Count() - 1; i != PRUint32(-1); --i) {
     observers.ObjectAt(i)->Destroy();
@@ -1120,12 +1765,17 @@ compzillaWindow::Mapped(bool override_redirect)
   mAttr.map_state = IsViewable;
   mAttr.override_redirect = override_redirect;
 
+  // Try naming the pixmap again if it failed before.
+  mIsPixmapFailed = false;
   BindWindow();
 
   for (PRUint32 i = mObservers.Count() - 1; i != PRUint32(-1); --i) {
     nsCOMPtr<compzillaIWindowObserver> observer = mObservers.ObjectAt(i);
     observer->Map(override_redirect);
   }
+  compzillaEventJournal *journal = GetJournal();
+  if (journal)
+    journal->Append(compzillaIBatchObserver::MAP, this, override_redirect);
 }
 
 
@@ -1137,327 +1787,507 @@ compzillaWindow::Unmapped()
 
   mAttr.map_state = IsUnmapped;
 
+  // The client loses focus when unmapped, and must get FocusIn again when
+  // it comes back.
+  mHasFocus = false;
+
   ReleaseWindow();
+  mShmImage = nsnull;
 
   for (PRUint32 i = mObservers.Count() - 1; i != PRUint32(-1); --i) {
     nsCOMPtr<compzillaIWindowObserver> observer = mObservers.ObjectAt(i);
     observer->Unmap();
   }
+  compzillaEventJournal *journal = GetJournal();
+  if (journal)
+    journal->Append(compzillaIBatchObserver::UNMAP, this);
 }
 
 
 nsresult
 compzillaWindow::GetCardinalListProperty(Atom prop, 
-    PRUint32 **values, 
+    PRUint32 *values, 
     PRUint32 expected_nitems)
 {
-  SPEW("GetCardinalListProperty this=%p, prop=%s\n", this, XGetAtomName(mDisplay, prop));
-
-  Atom actual_type;
-  int format;
-  unsigned long bytes_after_return;
-  unsigned char *data;
-  unsigned long nitems;
-
-  if (XGetWindowProperty(mDisplay, 
-                         mWindow, 
-                         prop,
-                         0, 
-                         expected_nitems, 
-                         false, 
-                         XA_CARDINAL,
-                         &actual_type, 
-                         &format, 
-                         &nitems, 
-                         &bytes_after_return, 
-                         &data) != Success || 
-    format == None) {
+  SPEW("GetCardinalListProperty this=%p, prop=%s\n", this, compzillaAtomCache::GetName(mDisplay, prop));
+
+  compzillaPropertyReply *reply = mProperties.Lookup(prop);
+  if (!reply || reply->Type() != XA_CARDINAL || reply->Format() != 32) {
     SPEW(" + (Not Found)\n");
 
     return NS_ERROR_FAILURE;
   }
 
-  if (nitems != expected_nitems) {
-    ERROR("XGetWindowProperty (%s) expected %d items, received %d\n",
-          XGetAtomName(mDisplay, prop), expected_nitems, nitems);
+  // Extra items are ignored, as when only expected_nitems are requested.
+  if (reply->Count() < expected_nitems) {
+    ERROR("GetCardinalListProperty (%s) expected %d items, received %d\n",
+          compzillaAtomCache::GetName(mDisplay, prop), expected_nitems, reply->Count());
 
-    XFree(data);
     return NS_ERROR_FAILURE;
   }
 
-  *values = (PRUint32*) data;
+  memcpy(values, reply->Value(), expected_nitems * sizeof(PRUint32));
   return NS_OK;
 }
 
 
+/*
+ * Request the properties the frame reads when a window shows up, so they
+ * arrive together instead of one round trip each.  The replies are only
+ * collected when looked up.
+ */
+void
+compzillaWindow::PrefetchProperties()
+{
+  Atom props[] = {
+    XA_WM_NAME,
+    XA_WM_ICON_NAME,
+    XA_WM_HINTS,
+    XA_WM_NORMAL_HINTS,
+    XA_WM_CLASS,
+    atoms.x.WM_PROTOCOLS,
+    atoms.x._NET_WM_NAME,
+    atoms.x._NET_WM_ICON_NAME,
+    atoms.x._NET_WM_WINDOW_TYPE,
+    atoms.x._NET_WM_STRUT,
+    atoms.x._NET_WM_STRUT_PARTIAL,
+    atoms.x._NET_WM_ICON_GEOMETRY,
+  };
+
+  mProperties.Request(props, sizeof(props) / sizeof(props[0]));
+}
+
+
 NS_IMETHODIMP
-compzillaWindow::GetProperty(PRUint32 iprop, nsIPropertyBag2 **bag2)
+compzillaWindow::GetProperties(PRUint32 count,
+                               PRUint32 *props,
+                               PRUint32 *bagCount,
+                               nsIPropertyBag2 ***bags)
 {
-  *bag2 = nsnull;
+  *bagCount = 0;
+  *bags = nsnull;
 
-  Atom prop = (Atom) iprop;
+  nsIPropertyBag2 **result =
+    (nsIPropertyBag2 **) nsMemory::Alloc(PR_MAX(count, 1) * sizeof(nsIPropertyBag2 *));
+  if (!result)
+    return NS_ERROR_OUT_OF_MEMORY;
 
-  nsISupports *bag;
-  nsCOMPtr<nsIWritablePropertyBag2> wbag;
-  nsCOMPtr<nsIPropertyBag2> rbag;
+  // Send all the requests before waiting for any of them.
+  for (PRUint32 i = 0; i < count; i++) {
+    mProperties.Request((Atom) props[i]);
+  }
 
-  nsresult rv = CallCreateInstance("@mozilla.org/hash-property-bag;1", &bag);
-  if (NS_FAILED(rv)) {
-    return rv;
+  for (PRUint32 i = 0; i < count; i++) {
+    nsresult rv = GetProperty(props[i], &result[i]);
+    if (NS_FAILED(rv)) {
+      NS_FREE_XPCOM_ISUPPORTS_POINTER_ARRAY(i, result);
+      return rv;
+    }
+  }
+
+  *bagCount = count;
+  *bags = result;
+
+  return NS_OK;
+}
+
+
+/*
+ * Decoders turning a property's cached value into a property bag, by atom.
+ * Properties without a decoder, or which aren't set, have no bag.
+ */
+nsDataHashtable<nsUint32HashKey, compzillaWindow::PropertyDecoder> *
+compzillaWindow::sPropertyDecoders = nsnull;
+
+
+bool
+compzillaWindow::InitPropertyDecoders()
+{
+  if (sPropertyDecoders)
+    return true;
+
+  sPropertyDecoders =
+    new nsDataHashtable<nsUint32HashKey, compzillaWindow::PropertyDecoder>();
+  if (!sPropertyDecoders || !sPropertyDecoders->Init(32)) {
+    Shutdown();
+    return false;
   }
 
-  wbag = do_QueryInterface(bag);
-  rbag = do_QueryInterface(bag);
+  // ICCCM properties
+
+  // XXX this is missing some massaging, since the WM_NAME
+  // property isn't in utf8, but in some locale character set
+  // (latin1?  who knows).  Check the gtk+ source on how to
+  // handle this.
+  sPropertyDecoders->Put(XA_WM_NAME, &compzillaWindow::DecodeText);
+  sPropertyDecoders->Put(XA_WM_ICON_NAME, &compzillaWindow::DecodeText);
+  sPropertyDecoders->Put(XA_WM_CLIENT_MACHINE, &compzillaWindow::DecodeText);
+  sPropertyDecoders->Put(XA_WM_HINTS, &compzillaWindow::DecodeWMHints);
+  sPropertyDecoders->Put(XA_WM_NORMAL_HINTS, &compzillaWindow::DecodeSizeHints);
+  sPropertyDecoders->Put(XA_WM_CLASS, &compzillaWindow::DecodeWMClass);
+
+  // XXX WM_TRANSIENT_FOR should give the parent X window's canvas element,
+  // WM_PROTOCOLS an array of atoms.
+
+  // EWMH properties
+  sPropertyDecoders->Put(atoms.x._NET_WM_NAME, &compzillaWindow::DecodeText);
+  sPropertyDecoders->Put(atoms.x._NET_WM_VISIBLE_NAME, &compzillaWindow::DecodeText);
+  sPropertyDecoders->Put(atoms.x._NET_WM_ICON_NAME, &compzillaWindow::DecodeText);
+  sPropertyDecoders->Put(atoms.x._NET_WM_VISIBLE_ICON_NAME, &compzillaWindow::DecodeText);
+  sPropertyDecoders->Put(atoms.x._NET_WM_WINDOW_TYPE, &compzillaWindow::DecodeWindowType);
+  sPropertyDecoders->Put(atoms.x._NET_WM_STRUT, &compzillaWindow::DecodeStrut);
+  sPropertyDecoders->Put(atoms.x._NET_WM_STRUT_PARTIAL, &compzillaWindow::DecodeStrut);
+  sPropertyDecoders->Put(atoms.x._NET_WM_ICON_GEOMETRY, &compzillaWindow::DecodeIconGeometry);
+
+  return true;
+}
+
+
+void
+compzillaWindow::Shutdown()
+{
+  delete sPropertyDecoders;
+  sPropertyDecoders = nsnull;
+}
 
-#define SET_BAG() do { \
-  NS_ADDREF (rbag); \
-  *bag2 = rbag; \
-} while (0)
 
 #define SET_PROP(_bag, _type, _key, _val) \
     (_bag)->SetPropertyAs##_type (NS_LITERAL_STRING (_key), _val)
 
-  switch (prop) {
-    // ICCCM properties
-
-    case XA_WM_NAME:
-    case XA_WM_ICON_NAME: {
-      // XXX this is missing some massaging, since the WM_NAME
-      // property isn't in utf8, but in some locale character set
-      // (latin1?  who knows).  Check the gtk+ source on how to
-      // handle this.
-      nsCAutoString str;
-      if (NS_OK == GetUTF8StringProperty(prop, str)) {
-        SET_BAG();
-        SET_PROP(wbag, AUTF8String, "text", str);
-      }
-      break;
-    }
 
-    case XA_WM_HINTS: {
-      XWMHints *wmHints;
-
-      wmHints = XGetWMHints(mDisplay, mWindow);
-      if (wmHints) {
-        SET_BAG();
-        SET_PROP(wbag, Int32, "wmHints.flags", wmHints->flags);
-        SET_PROP(wbag, Bool, "wmHints.input", wmHints->input);
-        SET_PROP(wbag, Int32, "wmHints.initialState", wmHints->initial_state);
-        SET_PROP(wbag, Uint32, "wmHints.iconPixmap", wmHints->icon_pixmap);
-        SET_PROP(wbag, Uint32, "wmHints.iconWindow", wmHints->icon_window);
-        SET_PROP(wbag, Int32, "wmHints.iconX", wmHints->icon_x);
-        SET_PROP(wbag, Int32, "wmHints.iconY", wmHints->icon_y);
-        SET_PROP(wbag, Uint32, "wmHints.iconMask", wmHints->icon_mask);
-        SET_PROP(wbag, Uint32, "wmHints.windowGroup", wmHints->window_group);
-
-        XFree(wmHints);
-      }
-      break;
-    }
+nsresult
+compzillaWindow::NewPropertyBag(nsIWritablePropertyBag2 **bag)
+{
+  nsISupports *supports;
+  nsresult rv = CallCreateInstance("@mozilla.org/hash-property-bag;1", &supports);
+  if (NS_FAILED(rv)) {
+    return rv;
+  }
 
-    case XA_WM_NORMAL_HINTS: {
-      XSizeHints sizeHints;
-      long supplied;
-
-      // XXX check return value
-      XGetWMNormalHints(mDisplay, mWindow, &sizeHints, &supplied);
-
-      SET_BAG();
-      SET_PROP(wbag, Int32, "sizeHints.flags", sizeHints.flags);
-
-      SET_PROP(wbag, Int32, "sizeHints.x", sizeHints.x);
-      SET_PROP(wbag, Int32, "sizeHints.y", sizeHints.y);
-      SET_PROP(wbag, Int32, "sizeHints.width", sizeHints.width);
-      SET_PROP(wbag, Int32, "sizeHints.height", sizeHints.height);
-      SET_PROP(wbag, Int32, "sizeHints.minWidth", sizeHints.min_width);
-      SET_PROP(wbag, Int32, "sizeHints.minHeight", sizeHints.min_height);
-      SET_PROP(wbag, Int32, "sizeHints.maxWidth", sizeHints.max_width);
-      SET_PROP(wbag, Int32, "sizeHints.maxHeight", sizeHints.max_height);
-      SET_PROP(wbag, Int32, "sizeHints.widthInc", sizeHints.width_inc);
-      SET_PROP(wbag, Int32, "sizeHints.heightInc", sizeHints.height_inc);
-      SET_PROP(wbag, Int32, "sizeHints.minAspect.x", sizeHints.min_aspect.x);
-      SET_PROP(wbag, Int32, "sizeHints.minAspect.y", sizeHints.min_aspect.y);
-      SET_PROP(wbag, Int32, "sizeHints.maxAspect.x", sizeHints.max_aspect.x);
-      SET_PROP(wbag, Int32, "sizeHints.maxAspect.y", sizeHints.max_aspect.y);
-      if ((supplied & (PBaseSize|PWinGravity)) != 0) {
-        SET_PROP(wbag, Int32, "sizeHints.baseWidth", sizeHints.base_width);
-        SET_PROP(wbag, Int32, "sizeHints.baseHeight", sizeHints.base_height);
-        SET_PROP(wbag, Int32, "sizeHints.winGravity", sizeHints.win_gravity);
-      }
-      break;
-    }
+  rv = CallQueryInterface(supports, bag);
+  NS_RELEASE(supports);
 
-    case XA_WM_CLASS: {
-      // 2 strings, separated by a \0
-      char *instance, *_class;
-      Atom actual_type;
-      int format;
-      unsigned long nitems;
-      unsigned long bytes_after_return;
-      unsigned char *data;
+  return rv;
+}
 
-      XGetWindowProperty(mDisplay, mWindow, (Atom) prop, 0, BUFSIZ, false, XA_STRING,
-                         &actual_type, &format, &nitems, &bytes_after_return, &data);
 
-      instance = (char*) data;
-      _class = instance + strlen(instance) + 1;
+nsresult
+compzillaWindow::DecodeText(Atom prop, nsIWritablePropertyBag2 **bag)
+{
+  nsCAutoString str;
+  if (NS_OK != GetUTF8StringProperty(prop, str))
+    return NS_OK;
 
-      SET_BAG();
-      SET_PROP(wbag, ACString, "instanceName", nsCAutoString(instance));
-      SET_PROP(wbag, ACString, "className", nsCAutoString(_class));
+  nsresult rv = NewPropertyBag(bag);
+  NS_ENSURE_SUCCESS(rv, rv);
 
-      XFree(data);
-      break;
-    }
+  SET_PROP(*bag, AUTF8String, "text", str);
+  return NS_OK;
+}
 
-    case XA_WM_TRANSIENT_FOR: {
-      // the parent X window's canvas element
-      break;
-    }
 
-    case XA_WM_CLIENT_MACHINE: {
-      nsCAutoString str;
-      if (NS_OK == GetUTF8StringProperty(prop, str)) {
-        SET_BAG();
-        SET_PROP(wbag, AUTF8String, "text", str);
-      }
-    }
+nsresult
+compzillaWindow::DecodeWMHints(Atom prop, nsIWritablePropertyBag2 **bag)
+{
+  // Decoded like XGetWMHints does, from the cached value.
+  compzillaPropertyReply *reply = mProperties.Lookup(prop);
+  if (!reply || reply->Type() != XA_WM_HINTS || reply->Format() != 32 ||
+      reply->Count() < NumPropWMHintsElements - 1)
+    return NS_OK;
 
-    default:
-      // ICCCM properties which don't have predefined atoms
+  PRUint32 *hints = (PRUint32 *) reply->Value();
+
+  // Pre-ICCCM hints have no window group.
+  PRUint32 windowGroup = 0;
+  if (reply->Count() >= NumPropWMHintsElements)
+    windowGroup = hints[8];
+
+  nsresult rv = NewPropertyBag(bag);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  SET_PROP(*bag, Int32, "wmHints.flags", hints[0]);
+  SET_PROP(*bag, Bool, "wmHints.input", hints[1] != 0);
+  SET_PROP(*bag, Int32, "wmHints.initialState", hints[2]);
+  SET_PROP(*bag, Uint32, "wmHints.iconPixmap", hints[3]);
+  SET_PROP(*bag, Uint32, "wmHints.iconWindow", hints[4]);
+  SET_PROP(*bag, Int32, "wmHints.iconX", (PRInt32) hints[5]);
+  SET_PROP(*bag, Int32, "wmHints.iconY", (PRInt32) hints[6]);
+  SET_PROP(*bag, Uint32, "wmHints.iconMask", hints[7]);
+  SET_PROP(*bag, Uint32, "wmHints.windowGroup", windowGroup);
+  return NS_OK;
+}
 
-      if (prop == atoms.x.WM_COLORMAP_WINDOWS) {
-        // if we ever support this, shoot me..
-      }
-      else if (prop == atoms.x.WM_PROTOCOLS) {
-        // an array of Atoms.
-      }
 
-      // non - ICCCM properties go here
-
-      // EWMH properties
-      else if(prop == atoms.x._NET_WM_NAME ||
-               prop == atoms.x._NET_WM_VISIBLE_NAME ||
-               prop == atoms.x._NET_WM_ICON_NAME ||
-               prop == atoms.x._NET_WM_VISIBLE_ICON_NAME) {
-        // utf8 encoded string
-        nsCAutoString str;
-        if (NS_OK == GetUTF8StringProperty(prop, str)) {
-          SET_BAG();
-          SET_PROP(wbag, AUTF8String, "text", str);
-        }
-      }
-      else if (prop == atoms.x._NET_WM_DESKTOP) {
-      }
-      else if (prop == atoms.x._NET_WM_WINDOW_TYPE) {
-        // XXX _NET_WM_WINDOW_TYPE is actually an array of atoms, not just 1.
-        // this also needs fixing in the JS.
-        PRUint32 atom;
-        if (NS_OK == GetAtomProperty(prop, &atom)) {
-          SET_BAG();
-          SET_PROP(wbag, Uint32, "atom", atom);
-        }
-      }
-      else if (prop == atoms.x._NET_WM_STATE) {
-      }
-      else if (prop == atoms.x._NET_WM_ALLOWED_ACTIONS) {
-      }
-      else if (prop == atoms.x._NET_WM_STRUT) {
-        PRUint32 *cards;
-        PRUint32 nitems;
-
-        if (NS_OK == GetCardinalListProperty(prop, &cards, 4)) {
-          SET_BAG();
-          SET_PROP(wbag, Uint32, "left", cards[0]);
-          SET_PROP(wbag, Uint32, "right", cards[1]);
-          SET_PROP(wbag, Uint32, "top", cards[2]);
-          SET_PROP(wbag, Uint32, "bottom", cards[3]);
-
-          XFree(cards);
-        }
-      }
-      else if (prop == atoms.x._NET_WM_STRUT_PARTIAL) {
-        PRUint32 *cards;
-        PRUint32 nitems;
-
-        if (NS_OK == GetCardinalListProperty(prop, &cards, 12)) {
-          SET_BAG();
-          SET_PROP(wbag, Bool, "partial", true);
-
-          SET_PROP(wbag, Uint32, "left", cards[0]);
-          SET_PROP(wbag, Uint32, "right", cards[1]);
-          SET_PROP(wbag, Uint32, "top", cards[2]);
-          SET_PROP(wbag, Uint32, "bottom", cards[3]);
-
-          SET_PROP(wbag, Uint32, "leftStartY", cards[4]);
-          SET_PROP(wbag, Uint32, "leftEndY", cards[5]);
-          SET_PROP(wbag, Uint32, "rightStartY", cards[6]);
-          SET_PROP(wbag, Uint32, "rightEndY", cards[7]);
-
-          SET_PROP(wbag, Uint32, "topStartX", cards[8]);
-          SET_PROP(wbag, Uint32, "topEndX", cards[9]);
-          SET_PROP(wbag, Uint32, "bottomStartX", cards[10]);
-          SET_PROP(wbag, Uint32, "bottomEndX", cards[11]);
-
-          XFree(cards);
-        }
-      }
-      else if (prop == atoms.x._NET_WM_ICON_GEOMETRY) {
-        PRUint32 *cards;
-        PRUint32 nitems;
-
-        if (NS_OK == GetCardinalListProperty(prop, &cards, 4)) {
-          SET_BAG();
-          SET_PROP(wbag, Bool, "partial", false);
-          SET_PROP(wbag, Uint32, "x", cards[0]);
-          SET_PROP(wbag, Uint32, "y", cards[1]);
-          SET_PROP(wbag, Uint32, "width", cards[2]);
-          SET_PROP(wbag, Uint32, "height", cards[3]);
-          XFree(cards);
-        }
-      }
-      else if (prop == atoms.x._NET_WM_ICON) {
-        Atom actual_type;
-        int format;
-        unsigned long nitems;
-        unsigned long bytes_after_return;
-        unsigned char *data;
-
-        if (XGetWindowProperty(mDisplay, mWindow, prop, 0, BUFSIZ, false, XA_CARDINAL,
-                               &actual_type, &format, &nitems, &bytes_after_return, &data) == Success) {
-          nsCAutoString dataStr;
-          dataStr.Assign((char *) data, (format / 8) * nitems);
-
-          SET_BAG();
-          SET_PROP(wbag, ACString, "data", dataStr);
-          XFree(data);
-        }
-      }
-      else if (prop == atoms.x._NET_WM_PID) {
-      }
-      else if (prop == atoms.x._NET_WM_HANDLED_ICONS) {
-      }
-      else if (prop == atoms.x._NET_WM_USER_TIME) {
-      }
-      else if (prop == atoms.x._NET_FRAME_EXTENTS) {
-      }
-      break;
-    }
+/*
+ * WM_NORMAL_HINTS in ICCCM order, with the flags masked like
+ * XGetWMNormalHints does.  Pre-ICCCM hints get a zero base size and
+ * gravity.
+ */
+bool
+compzillaWindow::ReadSizeHints(PRInt32 *hints)
+{
+  compzillaPropertyReply *reply = mProperties.Lookup(XA_WM_NORMAL_HINTS);
+  if (!reply || reply->Type() != XA_WM_SIZE_HINTS || reply->Format() != 32 ||
+      reply->Count() < OldNumPropSizeElements)
+    return false;
+
+  long supplied = USPosition | USSize | PAllHints;
+  if (reply->Count() >= NumPropSizeElements)
+    supplied |= PBaseSize | PWinGravity;
+
+  memset(hints, 0, SIZE_HINTS_COUNT * sizeof(PRInt32));
+  memcpy(hints, reply->Value(),
+         PR_MIN(reply->Count(), SIZE_HINTS_COUNT) * sizeof(PRInt32));
+  hints[0] &= supplied;
+
+  return true;
+}
+
+
+nsresult
+compzillaWindow::DecodeSizeHints(Atom prop, nsIWritablePropertyBag2 **bag)
+{
+  PRInt32 hints[SIZE_HINTS_COUNT];
+  if (!ReadSizeHints(hints))
+    return NS_OK;
+
+  nsresult rv = NewPropertyBag(bag);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  SET_PROP(*bag, Int32, "sizeHints.flags", hints[0]);
+
+  SET_PROP(*bag, Int32, "sizeHints.x", hints[1]);
+  SET_PROP(*bag, Int32, "sizeHints.y", hints[2]);
+  SET_PROP(*bag, Int32, "sizeHints.width", hints[3]);
+  SET_PROP(*bag, Int32, "sizeHints.height", hints[4]);
+  SET_PROP(*bag, Int32, "sizeHints.minWidth", hints[5]);
+  SET_PROP(*bag, Int32, "sizeHints.minHeight", hints[6]);
+  SET_PROP(*bag, Int32, "sizeHints.maxWidth", hints[7]);
+  SET_PROP(*bag, Int32, "sizeHints.maxHeight", hints[8]);
+  SET_PROP(*bag, Int32, "sizeHints.widthInc", hints[9]);
+  SET_PROP(*bag, Int32, "sizeHints.heightInc", hints[10]);
+  SET_PROP(*bag, Int32, "sizeHints.minAspect.x", hints[11]);
+  SET_PROP(*bag, Int32, "sizeHints.minAspect.y", hints[12]);
+  SET_PROP(*bag, Int32, "sizeHints.maxAspect.x", hints[13]);
+  SET_PROP(*bag, Int32, "sizeHints.maxAspect.y", hints[14]);
+  if ((hints[0] & (PBaseSize|PWinGravity)) != 0) {
+    SET_PROP(*bag, Int32, "sizeHints.baseWidth", hints[15]);
+    SET_PROP(*bag, Int32, "sizeHints.baseHeight", hints[16]);
+    SET_PROP(*bag, Int32, "sizeHints.winGravity", hints[17]);
+  }
+  return NS_OK;
+}
+
+
+nsresult
+compzillaWindow::DecodeWMClass(Atom prop, nsIWritablePropertyBag2 **bag)
+{
+  // 2 strings, separated by a \0
+  compzillaPropertyReply *reply = mProperties.Lookup(prop);
+  if (!reply || reply->Type() != XA_STRING)
+    return NS_OK;
+
+  // Neither string is necessarily terminated.
+  const char *instance = (const char *) reply->Value();
+  PRUint32 length = reply->Length();
+  PRUint32 instanceLength = strnlen(instance, length);
+
+  const char *_class = instance + PR_MIN(instanceLength + 1, length);
+  PRUint32 classLength = strnlen(_class, instance + length - _class);
+
+  nsresult rv = NewPropertyBag(bag);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  SET_PROP(*bag, ACString, "instanceName", nsCAutoString(instance, instanceLength));
+  SET_PROP(*bag, ACString, "className", nsCAutoString(_class, classLength));
+  return NS_OK;
+}
+
+
+nsresult
+compzillaWindow::DecodeWindowType(Atom prop, nsIWritablePropertyBag2 **bag)
+{
+  // Only the preferred type, use GetWindowTypes for all of them.
+  PRUint32 atom;
+  if (NS_OK != GetAtomProperty(prop, &atom))
+    return NS_OK;
+
+  nsresult rv = NewPropertyBag(bag);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  SET_PROP(*bag, Uint32, "atom", atom);
+  return NS_OK;
+}
+
+
+nsresult
+compzillaWindow::DecodeStrut(Atom prop, nsIWritablePropertyBag2 **bag)
+{
+  PRUint32 cards[12];
+  bool partial = prop == atoms.x._NET_WM_STRUT_PARTIAL;
+
+  if (NS_OK != GetCardinalListProperty(prop, cards, partial ? 12 : 4))
+    return NS_OK;
+
+  nsresult rv = NewPropertyBag(bag);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  SET_PROP(*bag, Uint32, "left", cards[0]);
+  SET_PROP(*bag, Uint32, "right", cards[1]);
+  SET_PROP(*bag, Uint32, "top", cards[2]);
+  SET_PROP(*bag, Uint32, "bottom", cards[3]);
+
+  if (partial) {
+    SET_PROP(*bag, Bool, "partial", true);
+
+    SET_PROP(*bag, Uint32, "leftStartY", cards[4]);
+    SET_PROP(*bag, Uint32, "leftEndY", cards[5]);
+    SET_PROP(*bag, Uint32, "rightStartY", cards[6]);
+    SET_PROP(*bag, Uint32, "rightEndY", cards[7]);
+
+    SET_PROP(*bag, Uint32, "topStartX", cards[8]);
+    SET_PROP(*bag, Uint32, "topEndX", cards[9]);
+    SET_PROP(*bag, Uint32, "bottomStartX", cards[10]);
+    SET_PROP(*bag, Uint32, "bottomEndX", cards[11]);
+  }
+  return NS_OK;
+}
+
+
+nsresult
+compzillaWindow::DecodeIconGeometry(Atom prop, nsIWritablePropertyBag2 **bag)
+{
+  PRUint32 cards[4];
+  if (NS_OK != GetCardinalListProperty(prop, cards, 4))
+    return NS_OK;
+
+  nsresult rv = NewPropertyBag(bag);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  SET_PROP(*bag, Bool, "partial", false);
+  SET_PROP(*bag, Uint32, "x", cards[0]);
+  SET_PROP(*bag, Uint32, "y", cards[1]);
+  SET_PROP(*bag, Uint32, "width", cards[2]);
+  SET_PROP(*bag, Uint32, "height", cards[3]);
+  return NS_OK;
+}
+
 
 #undef SET_PROP
-#undef SET_BAG
+
+
+NS_IMETHODIMP
+compzillaWindow::GetProperty(PRUint32 iprop, nsIPropertyBag2 **bag2)
+{
+  *bag2 = nsnull;
+
+  if (!InitPropertyDecoders())
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  PropertyDecoder decoder;
+  if (!sPropertyDecoders->Get(iprop, &decoder))
+    return NS_OK;
+
+  nsCOMPtr<nsIWritablePropertyBag2> wbag;
+  nsresult rv = (this->*decoder)((Atom) iprop, getter_AddRefs(wbag));
+  if (NS_FAILED(rv) || !wbag)
+    return rv;
+
+  return CallQueryInterface(wbag, bag2);
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::GetTextProperty(PRUint32 prop, nsACString& text)
+{
+  if (NS_OK != GetUTF8StringProperty(prop, text))
+    text.SetIsVoid(PR_TRUE);
 
   return NS_OK;
 }
 
 
+NS_IMETHODIMP
+compzillaWindow::GetStrut(PRUint32 *count, PRUint32 **strut)
+{
+  *count = 0;
+  *strut = nsnull;
+
+  PRUint32 cards[12];
+  PRUint32 ncards = 12;
+
+  if (NS_OK != GetCardinalListProperty(atoms.x._NET_WM_STRUT_PARTIAL, cards, 12)) {
+    ncards = 4;
+    if (NS_OK != GetCardinalListProperty(atoms.x._NET_WM_STRUT, cards, 4))
+      return NS_OK;
+  }
+
+  *strut = (PRUint32 *) nsMemory::Clone(cards, ncards * sizeof(PRUint32));
+  if (!*strut)
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  *count = ncards;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::GetSizeHints(PRUint32 *count, PRInt32 **sizeHints)
+{
+  *count = 0;
+  *sizeHints = nsnull;
+
+  PRInt32 hints[SIZE_HINTS_COUNT];
+  if (!ReadSizeHints(hints))
+    return NS_OK;
+
+  *sizeHints = (PRInt32 *) nsMemory::Clone(hints, sizeof(hints));
+  if (!*sizeHints)
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  *count = SIZE_HINTS_COUNT;
+  return NS_OK;
+}
+
+
+NS_IMETHODIMP
+compzillaWindow::GetWindowTypes(PRUint32 *count, PRUint32 **types)
+{
+  *count = 0;
+  *types = nsnull;
+
+  compzillaPropertyReply *reply = mProperties.Lookup(atoms.x._NET_WM_WINDOW_TYPE);
+  if (!reply || reply->Type() != XA_ATOM || reply->Format() != 32 ||
+      reply->Count() == 0)
+    return NS_OK;
+
+  *types = (PRUint32 *) nsMemory::Clone(reply->Value(), reply->Length());
+  if (!*types)
+    return NS_ERROR_OUT_OF_MEMORY;
+
+  *count = reply->Count();
+  return NS_OK;
+}
+
+
 void
 compzillaWindow::PropertyChanged(Atom prop, bool deleted)
 {
+  mProperties.Invalidate(prop);
+
+  if (prop == atoms.x._NET_WM_ICON)
+    LoadIcons();
+
   for (PRUint32 i = mObservers.Count() - 1; i != PRUint32(-1); --i) {
+    if (!IsSubscribed(mObservers.ObjectAt(i), prop, false))
+      continue;
+
     nsCOMPtr<compzillaIWindowObserver> observer = mObservers.ObjectAt(i);
     observer->PropertyChange(prop, deleted);
   }
+  compzillaEventJournal *journal = GetJournal();
+  if (journal)
+    journal->Append(compzillaIBatchObserver::PROPERTY_CHANGE, this, prop, deleted);
 }
 
 
@@ -1465,44 +2295,450 @@ void
 compzillaWindow::ClientMessaged(Atom type, int format, long *data/*[5]*/)
 {
   for (PRUint32 i = mObservers.Count() - 1; i != PRUint32(-1); --i) {
+    if (!IsSubscribed(mObservers.ObjectAt(i), type, true))
+      continue;
+
     nsCOMPtr<compzillaIWindowObserver> observer = mObservers.ObjectAt(i);
     observer->ClientMessageRecv(type, format, data[0], data[1], data[2], data[3], data[4]);
   }
+  compzillaEventJournal *journal = GetJournal();
+  if (journal) {
+    journal->Append(compzillaIBatchObserver::CLIENT_MESSAGE, this,
+        type, format, data[0], data[1], data[2], data[3], data[4]);
+  }
 }
 
 
 void
-compzillaWindow::RedrawContentNode(nsIDOMHTMLCanvasElement *aContent, XRectangle *rect)
+compzillaWindow::RecordCreate(compzillaEventJournal *journal)
 {
-  nsCOMPtr<compzillaIRenderingContextInternal> internal;
-  nsresult rv = aContent->GetContext(NS_LITERAL_STRING("compzilla"),
-                                     JSVAL_VOID,
-                                     getter_AddRefs(internal));
+  journal->Append(compzillaIBatchObserver::WINDOW_CREATE, this);
+  RecordConfigure(journal,
+      mAttr.x, mAttr.y,
+      mAttr.width, mAttr.height,
+      mAttr.border_width,
+      NULL);
+}
+
 
-  if (NS_SUCCEEDED (rv)) {
-    internal->SetDrawable(mDisplay, mPixmap, mAttr.visual);
-    internal->Redraw(gfxRect(rect->x, rect->y, rect->width, rect->height));
+void
+compzillaWindow::RecordConfigure(compzillaEventJournal *journal,
+    PRInt32 x, PRInt32 y,
+    PRInt32 width, PRInt32 height,
+    PRInt32 border,
+    compzillaWindow *aboveWin)
+{
+  PRInt32 flags = 0;
+  if (mAttr.map_state == IsViewable)
+    flags |= compzillaIBatchObserver::CONFIGURE_MAPPED;
+  if (mAttr.override_redirect)
+    flags |= compzillaIBatchObserver::CONFIGURE_OVERRIDE_REDIRECT;
+
+  journal->Append(compzillaIBatchObserver::CONFIGURE, this,
+      flags, x, y, width, height, border,
+      journal->IndexOf(aboveWin));
+}
+
+
+compzillaEventJournal *
+compzillaWindow::GetJournal()
+{
+  return mControl ? mControl->GetJournal() : NULL;
+}
+
+
+void
+compzillaWindow::RedrawContentNode(ContentNode& node, XRectangle *rect)
+{
+  // Only hand the context a new drawable when the pixmap has been renamed.
+  if (node.mDrawable != mPixmap) {
+    if (mShmImage)
+      node.mContext->SetSurface(mShmImage->GetSurface());
+    else
+      node.mContext->SetDrawable(mDisplay, mPixmap, mAttr.visual);
+    node.mDrawable = mPixmap;
   }
+
+  node.mContext->Redraw(gfxRect(rect->x, rect->y, rect->width, rect->height));
 }
 
 
+/*
+ * Damage is not drawn here.  The server keeps accumulating it in mDamage, and
+ * we only remember that a flush is needed.  A NULL rect forces a redraw of
+ * the whole window on the next flush.
+ */
 void
-compzillaWindow::Damaged(XRectangle *rect)
+compzillaWindow::Damaged(XRectangle *rect, PRUint32 count)
 {
+  if (mIsBypassed)
+    return;
+
   BindWindow();
 
-  if (!rect) {
-    XRectangle allrect = { mAttr.x, mAttr.y, mAttr.width, mAttr.height };
-    Damaged(&allrect);
+  if (!rect)
+    mIsFullyDamaged = true;
+  else if (!IsCulled())
+    UpdateDamageRate(count);
+
+  if (mIsDamagePending || !mControl || IsCulled())
+    return;
+
+  mIsDamagePending = true;
+  mControl->WindowDamaged(this);
+}
+
+
+void
+compzillaWindow::SetDamageRates(PRUint32 idleRate,
+                                PRUint32 boundingBoxRate,
+                                PRUint32 nonEmptyRate)
+{
+  sDamageIdleRate = idleRate;
+  sDamageBoundingBoxRate = boundingBoxRate;
+  sDamageNonEmptyRate = nonEmptyRate;
+}
+
+
+void
+compzillaWindow::SetUseShm(bool useShm)
+{
+  sUseShm = useShm;
+}
+
+
+void
+compzillaWindow::SetCoalesceMotion(bool coalesceMotion)
+{
+  sCoalesceMotion = coalesceMotion;
+}
+
+
+/*
+ * Windows which damage a lot (video, browsers) flood us with rectangles we
+ * only merge anyway, so move them to BoundingBox, then to NonEmpty, where
+ * the server sends one event per flush and we fetch the region ourselves.
+ * Windows which calm down go back to RawRectangles.
+ */
+void
+compzillaWindow::UpdateDamageRate(PRUint32 count)
+{
+  // The event thread's damage always comes at one level.
+  if (!mDamage)
+    return;
+
+  mDamageEventCount += count;
+
+  PRIntervalTime now = PR_IntervalNow();
+  PRUint32 elapsed = PR_IntervalToMilliseconds(now - mDamageRateStart);
+  if (elapsed < DAMAGE_RATE_PERIOD)
     return;
+
+  PRUint32 rate = mDamageEventCount * 1000 / elapsed;
+  mDamageEventCount = 0;
+  mDamageRateStart = now;
+
+  int level = mDamageLevel;
+  if (rate >= sDamageNonEmptyRate) {
+    level = XDamageReportNonEmpty;
+  } else if (rate >= sDamageBoundingBoxRate) {
+    if (level == XDamageReportRawRectangles)
+      level = XDamageReportBoundingBox;
+  } else if (rate < sDamageIdleRate) {
+    level = XDamageReportRawRectangles;
   }
 
-  for (PRUint32 i = mContentNodes.Count() - 1; i != PRUint32(-1); --i) {
-    RedrawContentNode(mContentNodes.ObjectAt(i), rect);
+  if (level != mDamageLevel) {
+    SPEW("UpdateDamageRate: window=%p, rate=%d/s, level %d -> %d\n",
+         mWindow, rate, mDamageLevel, level);
+    SetDamageLevel(level);
   }
 }
 
 
+void
+compzillaWindow::SetDamageLevel(int level)
+{
+  if (mDamage)
+    XDamageDestroy(mDisplay, mDamage);
+
+  mDamageLevel = level;
+  mDamage = XDamageCreate(mDisplay, mWindow, mDamageLevel);
+
+  // Anything drawn between the destroy and the create is lost.
+  Damaged(NULL);
+}
+
+
+/*
+ * Windows covered by opaque windows are not drawn.  Windows shown more than
+ * once, such as in expose or the window picker, are always drawn since their
+ * clones can be anywhere.
+ */
+bool
+compzillaWindow::IsCulled()
+{
+  return mIsOccluded && !IsCloned();
+}
+
+
+bool
+compzillaWindow::IsCloned()
+{
+  return mContentNodes.Length() > 1;
+}
+
+
+void
+compzillaWindow::SetOccluded(bool occluded)
+{
+  if (occluded == mIsOccluded)
+    return;
+
+  SPEW("SetOccluded: window=%p, occluded=%d\n", mWindow, occluded);
+
+  mIsOccluded = occluded;
+
+  // Damage was dropped while covered, so redraw everything.
+  if (!occluded)
+    Damaged(NULL);
+}
+
+
+void
+compzillaWindow::SetShaped(bool shaped)
+{
+  mIsShaped = shaped;
+}
+
+
+void
+compzillaWindow::SetBypassed(bool bypassed)
+{
+  if (bypassed == mIsBypassed)
+    return;
+
+  SPEW("SetBypassed: window=%p, bypassed=%d\n", mWindow, bypassed);
+
+  mIsBypassed = bypassed;
+
+  if (mIsDestroyed)
+    return;
+
+  if (bypassed) {
+    UnredirectWindow();
+  } else {
+    // Redirects and binds the window again, and redraws the stale canvas.
+    Damaged(NULL);
+  }
+}
+
+
+bool
+compzillaWindow::IsOpaque()
+{
+  // ARGB windows and shaped windows let windows below show through.
+  return mAttr.depth != 32 && !mIsShaped;
+}
+
+
+bool
+compzillaWindow::IsDesktop()
+{
+  PRUint32 type;
+  return (NS_OK == GetAtomProperty(atoms.x._NET_WM_WINDOW_TYPE, &type) &&
+          type == atoms.x._NET_WM_WINDOW_TYPE_DESKTOP);
+}
+
+
+/*
+ * Make sure mShmImage matches the window size if the SHM transport is on.
+ * Returns true if the image was created or resized.
+ */
+bool
+compzillaWindow::EnsureShmImage()
+{
+  if (!sUseShm)
+    return false;
+
+  if (mShmImage &&
+      mShmImage->Width() == mAttr.width &&
+      mShmImage->Height() == mAttr.height)
+    return false;
+
+  bool hadImage = mShmImage != nsnull;
+  if (!mShmImage || !mShmImage->Resize(mAttr.width, mAttr.height)) {
+    mShmImage = compzillaShmImage::Create(mDisplay, mAttr.visual, mAttr.depth,
+                                          mAttr.width, mAttr.height);
+  }
+
+  // Canvases switch to the new surface, or between the image and the pixmap.
+  if (hadImage || mShmImage)
+    ForgetDrawables();
+
+  return mShmImage != nsnull;
+}
+
+
+void
+compzillaWindow::FlushDamage()
+{
+  if (!mIsDamagePending)
+    return;
+
+  mIsDamagePending = false;
+
+  if (mIsDestroyed || IsCulled())
+    return;
+
+  if (mIsPixmapStale)
+    RenamePixmap();
+
+  CheckPixmap();
+
+  // Move the damage collected by the server since the last flush into our
+  // region, leaving the server side damage empty.
+  if (mDamage)
+    XDamageSubtract(mDisplay, mDamage, None, mDamageRegion);
+
+  if (!mPixmap || mContentNodes.Length() == 0) {
+    mIsFullyDamaged = false;
+    mThreadDamage.SetEmpty();
+    return;
+  }
+
+  // A new image has nothing in it yet.
+  if (EnsureShmImage())
+    mIsFullyDamaged = true;
+
+  compzillaRegion damage;
+  if (mIsFullyDamaged) {
+    damage.SetRect(0, 0, mAttr.width, mAttr.height);
+    mIsFullyDamaged = false;
+    mThreadDamage.SetEmpty();
+  } else if (!mDamage) {
+    damage = mThreadDamage;
+    mThreadDamage.SetEmpty();
+    damage.IntersectRect(0, 0, mAttr.width, mAttr.height);
+  } else {
+    int nrects = 0;
+    XRectangle bounds;
+    XRectangle *rects = XFixesFetchRegionAndBounds(mDisplay, mDamageRegion,
+                                                   &nrects, &bounds);
+    if (!rects)
+      return;
+
+    nsTArray<compzillaBox> boxes(nrects);
+    for (int i = 0; i < nrects; i++) {
+      compzillaBox box = { rects[i].x, rects[i].y,
+                           rects[i].x + rects[i].width,
+                           rects[i].y + rects[i].height };
+      boxes.AppendElement(box);
+    }
+    XFree(rects);
+
+    if (!damage.SetRects(boxes.Elements(), boxes.Length())) {
+      // Out of memory, fall back to the bounding box.
+      damage.SetRect(bounds.x, bounds.y, bounds.width, bounds.height);
+    }
+    damage.IntersectRect(0, 0, mAttr.width, mAttr.height);
+  }
+
+  if (damage.IsEmpty())
+    return;
+
+  // Many small rects cost more in per-redraw overhead than the few extra
+  // pixels a slightly larger one does.
+  damage.Simplify(MAX_REDRAW_RECTS);
+
+  const compzillaBox *boxes = damage.Rects();
+  for (PRUint32 n = 0; n < damage.NumRects(); n++) {
+    XRectangle rect;
+    rect.x = boxes[n].x1;
+    rect.y = boxes[n].y1;
+    rect.width = boxes[n].x2 - boxes[n].x1;
+    rect.height = boxes[n].y2 - boxes[n].y1;
+
+    SPEW_EVENT("FlushDamage: window=%p, x=%d, y=%d, width=%d, height=%d\n",
+               mWindow, rect.x, rect.y, rect.width, rect.height);
+
+    // Copied once here for all canvases.
+    if (mShmImage)
+      mShmImage->Update(mPixmap, rect.x, rect.y, rect.width, rect.height);
+
+    for (PRUint32 i = mContentNodes.Length() - 1; i != PRUint32(-1); --i) {
+      RedrawContentNode(mContentNodes[i], &rect);
+    }
+  }
+}
+
+
+/*
+ * Pick up the pixmap for the window's new size.  Done at most once per frame
+ * however many ConfigureNotifys arrived, since each rename allocates a new
+ * pixmap in the server.  Until then canvases keep showing the old contents,
+ * stretched to the new size by their CSS box.
+ */
+void
+compzillaWindow::RenamePixmap()
+{
+  mIsPixmapStale = false;
+
+  ReleaseWindow();
+
+  if (mAttr.map_state == IsViewable && !mIsPixmapFailed)
+    NamePixmap();
+
+  for (PRUint32 i = mContentNodes.Length() - 1; i != PRUint32(-1); --i) {
+    nsIDOMHTMLCanvasElement *aContent = mContentNodes[i].mCanvas;
+
+    // Setting the size clears the canvas, so only do it when needed.
+    PRInt32 canvasWidth, canvasHeight;
+    aContent->GetWidth(&canvasWidth);
+    aContent->GetHeight(&canvasHeight);
+    if (canvasWidth != mAttr.width)
+      aContent->SetWidth(mAttr.width);
+    if (canvasHeight != mAttr.height)
+      aContent->SetHeight(mAttr.height);
+  }
+
+  mIsFullyDamaged = true;
+}
+
+
+void
+compzillaWindow::AddDamage(XRectangle *rect)
+{
+  if (mIsBypassed || IsCulled())
+    return;
+
+  if (!mThreadDamage.UnionRect(rect->x, rect->y, rect->width, rect->height)) {
+    Damaged(NULL);
+    return;
+  }
+
+  Damaged(rect);
+}
+
+
+void
+compzillaWindow::UseEventThread()
+{
+  if (mIsDestroyed || !mDamage)
+    return;
+
+  // Both connections got these until now, so nothing was missed.
+  mEventMask &= ~PropertyChangeMask;
+  XSelectInput(mDisplay, mWindow, mEventMask);
+
+  XDamageDestroy(mDisplay, mDamage);
+  mDamage = None;
+
+  // Damage left in the server region is ours to redraw.
+  Damaged(NULL);
+}
+
+
 void
 compzillaWindow::QueueResize(PRInt32 x, 
     PRInt32 y,
@@ -1535,21 +2771,8 @@ compzillaWindow::Resized(PRInt32 x,
       border != mAttr.border_width || 
       mAttr.override_redirect) {
 
-    if (mIsRedirected) {
-      ReleaseWindow();
-
-      mPixmap = XCompositeNameWindowPixmap(mDisplay, mWindow);
-      if (mPixmap == None)
-        return;
-
-      for (PRUint32 i = mContentNodes.Count() - 1; i != PRUint32(-1); --i) {
-        nsIDOMHTMLCanvasElement *aContent = mContentNodes.ObjectAt(i);
-        aContent->SetWidth(width);
-        aContent->SetHeight(height);
-      }
-
-      Damaged(NULL);
-    }
+    if (mIsRedirected)
+      mIsPixmapStale = true;
   }
 
   mAttr.x = x;
@@ -1557,6 +2780,10 @@ compzillaWindow::Resized(PRInt32 x,
   mAttr.width = width;
   mAttr.height = height;
   mAttr.border_width = border;
+
+  // The pixmap is renamed on the next flush.
+  if (mIsPixmapStale)
+    Damaged(NULL);
 }
 
 
@@ -1621,5 +2848,9 @@ compzillaWindow::Configured(bool isNotify,
           border,
           above);
     }
+
+    compzillaEventJournal *journal = GetJournal();
+    if (journal)
+      RecordConfigure(journal, x, y, width, height, border, aboveWin);
   }
 }
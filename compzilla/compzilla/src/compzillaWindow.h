@@ -7,6 +7,8 @@
 
 #include <nsCOMPtr.h>
 #include <nsCOMArray.h>
+#include <nsDataHashtable.h>
+#include <nsTArray.h>
 #include <nsIDOMDocument.h>
 #include <nsIDOMKeyEvent.h>      // unstable
 #include <nsIDOMKeyListener.h>   // unstable
@@ -17,11 +19,19 @@
 extern "C" {
 #include <X11/Xlib.h>
 #include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
 }
 
+#include "compzillaIconLoader.h"
 #include "compzillaIRenderingContextInternal.h"
 #include "compzillaIWindow.h"
 #include "compzillaIWindowObserver.h"
+#include "compzillaPropertyCache.h"
+#include "compzillaRegion.h"
+#include "compzillaShmImage.h"
+#include "compzillaSubwindowTree.h"
+
+#include <prinrval.h>
 
 
 // From X.h
@@ -35,6 +45,11 @@ extern "C" {
 #undef FocusOut
 
 
+class compzillaControl;
+class compzillaEventJournal;
+class nsIWritablePropertyBag2;
+
+
 class compzillaWindow
     : public compzillaIWindow,
       public nsIDOMKeyListener,
@@ -46,9 +61,11 @@ public:
     NS_DECL_COMPZILLAIWINDOW
     NS_DECL_NSIDOMEVENTLISTENER
 
-    compzillaWindow (Display *display, 
+    compzillaWindow (compzillaControl *control,
+                     Display *display, 
                      Window window,
-                     XWindowAttributes *attrs);
+                     XWindowAttributes *attrs,
+                     bool isShaped);
     virtual ~compzillaWindow ();
 
     // nsIDOMKeyListener
@@ -76,7 +93,15 @@ public:
     void Mapped (bool override_redirect);
     void Unmapped ();
     void PropertyChanged (Atom prop, bool deleted);
-    void Damaged (XRectangle *rect);
+    // count is the number of damage events rect covers.
+    void Damaged (XRectangle *rect, PRUint32 count = 1);
+    void FlushDamage ();
+
+    // Damage and property changes read by the event thread.  Once it
+    // watches the window, UseEventThread stops our own damage reporting
+    // and property selection.
+    void AddDamage (XRectangle *rect);
+    void UseEventThread ();
     void Configured (bool isNotify,
                      PRInt32 x, PRInt32 y,
                      PRInt32 width, PRInt32 height,
@@ -85,8 +110,43 @@ public:
                      bool override_redirect);
     void ClientMessaged (Atom type, int format, long *data/*[5]*/);
 
+    // Substructure events reported for our subwindows.
+    void SubwindowEvent (XEvent *xev);
+
+    // Records the window's creation and current state for batch observers.
+    void RecordCreate (compzillaEventJournal *journal);
+
     void QueueResize (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height, PRInt32 border);
 
+    void SetOccluded (bool occluded);
+    void SetShaped (bool shaped);
+    bool IsOpaque ();
+    bool IsCloned ();
+    bool IsDesktop ();
+
+    void SetBypassed (bool bypassed);
+
+    // An icon scaled by compzillaIconLoader is ready.
+    void IconLoaded (PRUint32 size, PRUint32 hash, gfxImageSurface *surface);
+
+    void RedirectWindow ();
+    void UnredirectWindow ();
+
+    // Passive grabs only change on transitions between grab states.
+    void SetGrabState (PRInt32 state);
+
+    static void SetDamageRates (PRUint32 idleRate,
+                                PRUint32 boundingBoxRate,
+                                PRUint32 nonEmptyRate);
+    static void SetUseShm (bool useShm);
+    static void SetCoalesceMotion (bool coalesceMotion);
+
+    // Frees the property decoder table, when the module unloads.
+    static void Shutdown ();
+
+    // Send the latest pointer motion queued since the last frame.
+    void FlushMotion ();
+
     XWindowAttributes mAttr;
 
  private:
@@ -94,37 +154,202 @@ public:
     void OnDOMMouseScroll (nsIDOMEvent* aDOMEvent);
     void SendKeyEvent (int eventType, nsIDOMKeyEvent *keyEv);
     void SendMouseEvent (int eventType, nsIDOMMouseEvent *mouseEv, bool isScroll = false);
+    void QueueMotion (Window dest, long mask, XEvent *xev);
     void ConnectListeners (bool connect, nsCOMPtr<nsISupports> aContent);
     void TranslateClientXYToWindow (int *x, int *y, nsIDOMEventTarget *target);
     Window GetSubwindowAtPoint (int *x, int *y);
+    Window QuerySubwindowAtPoint (int *x, int *y);
+    void BuildSubwindowTree ();
+    void ClearSubwindowTree ();
     unsigned int DOMKeyCodeToKeySym (PRUint32 vkCode);
 
-    void RedrawContentNode (nsIDOMHTMLCanvasElement *aContent, XRectangle *rect);
+    struct ContentNode {
+        nsCOMPtr<nsIDOMHTMLCanvasElement> mCanvas;
+        nsCOMPtr<compzillaIRenderingContextInternal> mContext;
 
-    void UpdateAttributes ();
+        // The pixmap last given to mContext with SetDrawable.
+        Pixmap mDrawable;
+    };
+
+    struct IconNode {
+        nsCOMPtr<nsIDOMHTMLCanvasElement> mCanvas;
+        nsCOMPtr<compzillaIRenderingContextInternal> mContext;
+        PRUint32 mSize;
+
+        // Hash of the image shown, 0 if none.
+        PRUint32 mHash;
+
+        // The icon is being scaled.  If it changed meanwhile, it is loaded
+        // again once that is done.
+        bool mIsLoading;
+        bool mIsStale;
+    };
+
+    // Property atoms and client message types an observer subscribed to,
+    // sorted.  Observers without a subscription get everything.
+    struct Subscription {
+        compzillaIWindowObserver *mObserver;
+        bool mFilterProperties;
+        bool mFilterMessageTypes;
+        nsTArray<PRUint32> mProperties;
+        nsTArray<PRUint32> mMessageTypes;
+    };
+
+    Subscription *GetSubscription (compzillaIWindowObserver *observer);
+    nsresult Subscribe (compzillaIWindowObserver *observer,
+                        PRUint32 count, PRUint32 *atoms,
+                        bool messageTypes);
+    bool IsSubscribed (compzillaIWindowObserver *observer,
+                       Atom atom, bool messageType);
+
+    struct CachedIcon {
+        PRUint32 mSize;
+        PRUint32 mHash;
+        nsRefPtr<gfxImageSurface> mSurface;
+    };
+
+    void LoadIcons ();
+    void ShowIcon (IconNode& node, PRUint32 hash, gfxImageSurface *surface);
+
+    void RedrawContentNode (ContentNode& node, XRectangle *rect);
+    void ForgetDrawables ();
+    bool EnsureShmImage ();
+
+    bool IsCulled ();
+    void UpdateDamageRate (PRUint32 count);
+    void SetDamageLevel (int level);
+
+    void PrefetchProperties ();
 
-    void RedirectWindow ();
-    void UnredirectWindow ();
     void BindWindow ();
+    void NamePixmap ();
+    bool CheckPixmap ();
     void ReleaseWindow ();
     void Resized (PRInt32 x, PRInt32 y, PRInt32 width, PRInt32 height, PRInt32 border);
+    void RenamePixmap ();
     void SendPendingResize ();
+    void RecordConfigure (compzillaEventJournal *journal,
+                          PRInt32 x, PRInt32 y,
+                          PRInt32 width, PRInt32 height,
+                          PRInt32 border,
+                          compzillaWindow *aboveWin);
+    compzillaEventJournal *GetJournal ();
 
     nsresult GetAtomProperty (Atom prop, PRUint32* value);
     nsresult GetUTF8StringProperty (Atom prop, nsACString& utf8Value);
-    nsresult GetCardinalListProperty (Atom prop, PRUint32 **values, PRUint32 expected_nitems);
+    nsresult GetCardinalListProperty (Atom prop, PRUint32 *values, PRUint32 expected_nitems);
+    bool ReadSizeHints (PRInt32 *hints);
+
+    // Property bags for GetProperty, looked up by atom.  A decoder leaves
+    // bag null if the property isn't set.
+    typedef nsresult (compzillaWindow::*PropertyDecoder) (Atom prop, nsIWritablePropertyBag2 **bag);
+    static nsDataHashtable<nsUint32HashKey, PropertyDecoder> *sPropertyDecoders;
+    static bool InitPropertyDecoders ();
+
+    nsresult NewPropertyBag (nsIWritablePropertyBag2 **bag);
+    nsresult DecodeText (Atom prop, nsIWritablePropertyBag2 **bag);
+    nsresult DecodeWMHints (Atom prop, nsIWritablePropertyBag2 **bag);
+    nsresult DecodeSizeHints (Atom prop, nsIWritablePropertyBag2 **bag);
+    nsresult DecodeWMClass (Atom prop, nsIWritablePropertyBag2 **bag);
+    nsresult DecodeWindowType (Atom prop, nsIWritablePropertyBag2 **bag);
+    nsresult DecodeStrut (Atom prop, nsIWritablePropertyBag2 **bag);
+    nsresult DecodeIconGeometry (Atom prop, nsIWritablePropertyBag2 **bag);
+
+    nsTArray<ContentNode> mContentNodes;
 
-    nsCOMArray<nsIDOMHTMLCanvasElement> mContentNodes;
+    // Canvases showing _NET_WM_ICON, and the icons shown recently, so apps
+    // cycling through a few icons don't have them scaled every time.
+    nsTArray<IconNode> mIconNodes;
+    nsTArray<CachedIcon> mIconCache;
+    compzillaIconLoader::Layout mIconLayout;
+    bool mHasIcon;
     nsCOMArray<compzillaIWindowObserver> mObservers;
+    nsTArray<Subscription> mSubscriptions;
     Display *mDisplay;
     Window mWindow;
 
+    // Invalidated in PropertyChanged.
+    compzillaPropertyCache mProperties;
+
+    // Weak, cleared in Destroyed.  Used to queue damage for the next flush.
+    compzillaControl *mControl;
+
     Pixmap mPixmap;
     Damage mDamage;
+
+    // Client side copy of mPixmap when the MIT-SHM transport is in use,
+    // shared by all of this window's canvases.
+    nsRefPtr<compzillaShmImage> mShmImage;
+    static bool sUseShm;
+
+    // Damage accumulated since the last flush.  The server side damage is
+    // subtracted into this region once per repaint, not once per event.
+    XserverRegion mDamageRegion;
+    bool mIsDamagePending;
+    bool mIsFullyDamaged;
+
+    // Damage events received since mDamageRateStart, used to pick the
+    // report level.  Thresholds are in events per second.
+    int mDamageLevel;
+    PRUint32 mDamageEventCount;
+    PRIntervalTime mDamageRateStart;
+
+    static PRUint32 sDamageIdleRate;
+    static PRUint32 sDamageBoundingBoxRate;
+    static PRUint32 sDamageNonEmptyRate;
+
+    // Damage from the event thread since the last flush, used instead of
+    // mDamageRegion once mDamage is gone.
+    compzillaRegion mThreadDamage;
+
+    // Set by the control when opaque windows above cover this one entirely.
+    // Damage is left on the server until the window is uncovered.
+    bool mIsOccluded;
+    bool mIsShaped;
+
+    // Unredirected because it covers the whole screen.  The server draws it
+    // directly, so it is not bound or drawn until the bypass ends.
+    bool mIsBypassed;
+
     Window mLastEntered;
 
+    // Motion waiting for the next frame.  Only the latest position is
+    // sent, and anything else sent to the client flushes it first.
+    XEvent mPendingMotion;
+    Window mPendingMotionWindow;
+    long mPendingMotionMask;
+    bool mIsMotionPending;
+    static bool sCoalesceMotion;
+
+    // One of compzillaIWindow's GRAB_ constants.
+    PRInt32 mGrabState;
+    bool mHasFocus;
+    PRUint32 mGrabRequests;
+    PRUint32 mFocusChanges;
+
+    // Subwindows for GetSubwindowAtPoint, read on the first pointer event.
+    // The control routes their substructure events to SubwindowEvent.
+    // A tree that couldn't be read is tried again after it changes, one
+    // too large to cache never is.
+    compzillaSubwindowTree mSubwindows;
+    bool mIsSubwindowTreeFailed;
+    bool mIsSubwindowTreeTooLarge;
+
+    // Events selected on mWindow.
+    long mEventMask;
+
     bool mIsDestroyed;
     bool mIsRedirected;
+
+    // Set when the window was resized, so mPixmap has the old size.
+    bool mIsPixmapStale;
+
+    // Naming mPixmap failed, don't retry until the window is mapped.
+    bool mIsPixmapFailed;
+
+    // Request naming mPixmap, until it is known to have succeeded.
+    unsigned long mPixmapSerial;
+
     bool mIsResizePending;
     XWindowChanges mPendingChanges;
 
@@ -135,9 +360,11 @@ public:
 };
 
 
-nsresult CZ_NewCompzillaWindow(Display *display,
+nsresult CZ_NewCompzillaWindow(compzillaControl *control,
+                               Display *display,
                                Window win,
                                XWindowAttributes *attrs,
+                               bool isShaped,
                                compzillaWindow **retval);
 
 
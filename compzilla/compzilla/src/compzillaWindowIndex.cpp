@@ -0,0 +1,243 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <string.h>
+
+#include <prmem.h>
+
+#include "compzillaWindowIndex.h"
+#include "compzillaWindow.h"
+#include "Debug.h"
+
+
+// XIDs are allocated sequentially per client, with the client id in the
+// high bits, so spread them with a multiplicative hash before masking.
+#define XID_HASH_MULTIPLIER 2654435761U
+
+// With DEBUG_EVENTS every operation is logged, for tests/windowIndexBench
+// to replay.
+#define RECORD(op, xid) SPEW_EVENT ("index: %c 0x%lx\n", op, (unsigned long) (xid))
+
+
+compzillaWindowIndex::compzillaWindowIndex ()
+  : mEntries (NULL),
+    mCapacity (0),
+    mCount (0),
+    mLookups (0),
+    mMisses (0)
+{
+}
+
+
+compzillaWindowIndex::~compzillaWindowIndex ()
+{
+  Clear ();
+  PR_Free (mEntries);
+}
+
+
+bool
+compzillaWindowIndex::Init (PRUint32 capacity)
+{
+  PRUint32 size = 16;
+  while (size < capacity)
+    size <<= 1;
+
+  return Resize (size);
+}
+
+
+PRUint32
+compzillaWindowIndex::Slot (Window xid) const
+{
+  return (PRUint32 (xid) * XID_HASH_MULTIPLIER) & (mCapacity - 1);
+}
+
+
+compzillaWindowIndex::Entry *
+compzillaWindowIndex::Find (Window xid)
+{
+  if (xid == None || !mCapacity)
+    return NULL;
+
+  for (PRUint32 i = Slot (xid); mEntries[i].mXid != None;
+       i = (i + 1) & (mCapacity - 1)) {
+    if (mEntries[i].mXid == xid)
+      return &mEntries[i];
+  }
+
+  return NULL;
+}
+
+
+compzillaWindow *
+compzillaWindowIndex::Get (Window xid)
+{
+  RECORD ('?', xid);
+  mLookups++;
+
+  Entry *entry = Find (xid);
+  if (entry && !entry->mIsAlias)
+    return entry->mWindow;
+
+  mMisses++;
+  return NULL;
+}
+
+
+compzillaWindow *
+compzillaWindowIndex::GetOwner (Window xid)
+{
+  RECORD ('o', xid);
+  Entry *entry = Find (xid);
+  return entry ? entry->mWindow : NULL;
+}
+
+
+bool
+compzillaWindowIndex::Put (Window xid, compzillaWindow *window)
+{
+  RECORD ('+', xid);
+  return Insert (xid, window, false);
+}
+
+
+bool
+compzillaWindowIndex::PutAlias (Window xid, compzillaWindow *owner)
+{
+  RECORD ('a', xid);
+  Entry *entry = Find (xid);
+  if (entry && !entry->mIsAlias)
+    return false;
+
+  return Insert (xid, owner, true);
+}
+
+
+bool
+compzillaWindowIndex::Insert (Window xid, compzillaWindow *window, bool isAlias)
+{
+  if (xid == None)
+    return false;
+
+  if ((mCount + 1) * 2 > mCapacity && !Resize (mCapacity ? mCapacity * 2 : 16))
+    return false;
+
+  PRUint32 i = Slot (xid);
+  while (mEntries[i].mXid != None && mEntries[i].mXid != xid)
+    i = (i + 1) & (mCapacity - 1);
+
+  NS_IF_ADDREF (window);
+  if (mEntries[i].mXid == xid) {
+    NS_IF_RELEASE (mEntries[i].mWindow);
+  } else {
+    mEntries[i].mXid = xid;
+    mCount++;
+  }
+  mEntries[i].mWindow = window;
+  mEntries[i].mIsAlias = isAlias;
+
+  return true;
+}
+
+
+void
+compzillaWindowIndex::Remove (Window xid)
+{
+  RECORD ('-', xid);
+  Entry *entry = Find (xid);
+  if (entry && !entry->mIsAlias)
+    RemoveEntry (entry);
+}
+
+
+void
+compzillaWindowIndex::RemoveAlias (Window xid, compzillaWindow *owner)
+{
+  RECORD ('r', xid);
+  Entry *entry = Find (xid);
+  if (entry && entry->mIsAlias && entry->mWindow == owner)
+    RemoveEntry (entry);
+}
+
+
+void
+compzillaWindowIndex::RemoveEntry (Entry *entry)
+{
+  PRUint32 mask = mCapacity - 1;
+  PRUint32 i = entry - mEntries;
+
+  compzillaWindow *window = mEntries[i].mWindow;
+
+  // Move back any following entry whose home slot isn't between the hole
+  // and it, so probing never stops early at the hole.
+  PRUint32 hole = i;
+  for (PRUint32 j = (i + 1) & mask; mEntries[j].mXid != None; j = (j + 1) & mask) {
+    PRUint32 home = Slot (mEntries[j].mXid);
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      mEntries[hole] = mEntries[j];
+      hole = j;
+    }
+  }
+
+  mEntries[hole].mXid = None;
+  mEntries[hole].mWindow = NULL;
+  mEntries[hole].mIsAlias = false;
+  mCount--;
+
+  // Released last, the window's destructor may look windows up.
+  NS_IF_RELEASE (window);
+}
+
+
+void
+compzillaWindowIndex::Clear ()
+{
+  for (PRUint32 i = 0; i < mCapacity; i++) {
+    if (mEntries[i].mXid != None) {
+      mEntries[i].mXid = None;
+      NS_IF_RELEASE (mEntries[i].mWindow);
+    }
+  }
+  mCount = 0;
+}
+
+
+void
+compzillaWindowIndex::Enumerate (EnumFunc func, void *userdata)
+{
+  for (PRUint32 i = 0; i < mCapacity; i++) {
+    if (mEntries[i].mXid != None && !mEntries[i].mIsAlias)
+      func (mEntries[i].mXid, mEntries[i].mWindow, userdata);
+  }
+}
+
+
+bool
+compzillaWindowIndex::Resize (PRUint32 capacity)
+{
+  Entry *entries = (Entry *) PR_Malloc (capacity * sizeof (Entry));
+  if (!entries) {
+    ERROR ("Out of memory growing the window index to %d entries\n", capacity);
+    return false;
+  }
+  memset (entries, 0, capacity * sizeof (Entry));
+
+  Entry *old = mEntries;
+  PRUint32 oldCapacity = mCapacity;
+
+  mEntries = entries;
+  mCapacity = capacity;
+
+  for (PRUint32 i = 0; i < oldCapacity; i++) {
+    if (old[i].mXid == None)
+      continue;
+
+    PRUint32 j = Slot (old[i].mXid);
+    while (mEntries[j].mXid != None)
+      j = (j + 1) & (mCapacity - 1);
+    mEntries[j] = old[i];
+  }
+
+  PR_Free (old);
+  return true;
+}
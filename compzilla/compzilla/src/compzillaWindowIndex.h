@@ -0,0 +1,90 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaWindowIndex_h___
+#define compzillaWindowIndex_h___
+
+
+#include <prtypes.h>
+
+extern "C" {
+#include <X11/Xlib.h>
+}
+
+
+class compzillaWindow;
+
+
+/*
+ * Managed windows by XID.  Every X event looks its window up here, often
+ * for windows we don't manage, so this is a flat open addressed table
+ * rather than a PLDHash: a miss usually touches one or two adjacent
+ * entries and no pointers are chased until a window is found.
+ *
+ * Entries are linearly probed and the table is kept at most half full.
+ * Removal shifts the following entries back, so there are no tombstones
+ * and lookups stay short however many windows come and go.
+ *
+ * Subwindows of a managed window can be added as aliases for it, so events
+ * on them find the window they belong to.  Get ignores aliases.
+ *
+ * Holds a reference to each window.
+ */
+class compzillaWindowIndex
+{
+public:
+    compzillaWindowIndex ();
+    ~compzillaWindowIndex ();
+
+    // Capacity is rounded up to a power of two.
+    bool Init (PRUint32 capacity);
+
+    // Returns NULL if xid isn't in the index.  Doesn't add a reference.
+    compzillaWindow *Get (Window xid);
+    bool Contains (Window xid) { return Get (xid) != NULL; }
+
+    bool Put (Window xid, compzillaWindow *window);
+    void Remove (Window xid);
+    void Clear ();
+
+    // Aliases never replace managed windows, and are only removed for the
+    // window they were added for.
+    bool PutAlias (Window xid, compzillaWindow *owner);
+    void RemoveAlias (Window xid, compzillaWindow *owner);
+
+    // The window xid is, or is an alias for.
+    compzillaWindow *GetOwner (Window xid);
+
+    // Including aliases.
+    PRUint32 Count () const { return mCount; }
+
+    // Skips aliases.
+    typedef void (*EnumFunc) (Window xid, compzillaWindow *window, void *userdata);
+    void Enumerate (EnumFunc func, void *userdata);
+
+    // Lookups done and how many found nothing, for tuning.
+    PRUint32 Lookups () const { return mLookups; }
+    PRUint32 Misses () const { return mMisses; }
+
+private:
+    struct Entry {
+        Window mXid;
+        compzillaWindow *mWindow;
+        bool mIsAlias;
+    };
+
+    PRUint32 Slot (Window xid) const;
+    Entry *Find (Window xid);
+    bool Insert (Window xid, compzillaWindow *window, bool isAlias);
+    void RemoveEntry (Entry *entry);
+    bool Resize (PRUint32 capacity);
+
+    Entry *mEntries;
+    PRUint32 mCapacity;
+    PRUint32 mCount;
+
+    PRUint32 mLookups;
+    PRUint32 mMisses;
+};
+
+
+#endif
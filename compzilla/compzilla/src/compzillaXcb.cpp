@@ -0,0 +1,231 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <stdlib.h>
+
+extern "C" {
+#include <xcb/xcbext.h>
+}
+
+#include "compzillaXcb.h"
+#include "Debug.h"
+
+
+PRUint32 compzillaXcb::sRoundTrips = 0;
+
+
+void *
+compzillaXcb::WaitForReply (Display *dpy,
+                            unsigned int sequence,
+                            xcb_generic_error_t **error)
+{
+  xcb_connection_t *conn = XGetXCBConnection (dpy);
+
+  void *reply = NULL;
+  *error = NULL;
+  if (xcb_poll_for_reply (conn, sequence, &reply, error))
+    return reply;
+
+  sRoundTrips++;
+  return xcb_wait_for_reply (conn, sequence, error);
+}
+
+
+compzillaXcb::AttributesCookie
+compzillaXcb::RequestAttributes (Display *dpy, Window win)
+{
+  xcb_connection_t *conn = XGetXCBConnection (dpy);
+
+  AttributesCookie cookie;
+  cookie.mAttributes = xcb_get_window_attributes (conn, win);
+  cookie.mGeometry = xcb_get_geometry (conn, win);
+  return cookie;
+}
+
+
+xcb_shape_query_extents_cookie_t
+compzillaXcb::RequestShaped (Display *dpy, Window win)
+{
+  return xcb_shape_query_extents (XGetXCBConnection (dpy), win);
+}
+
+
+bool
+compzillaXcb::GetShaped (Display *dpy, xcb_shape_query_extents_cookie_t cookie)
+{
+  xcb_generic_error_t *error;
+  xcb_shape_query_extents_reply_t *reply =
+    (xcb_shape_query_extents_reply_t *)
+    WaitForReply (dpy, cookie.sequence, &error);
+  free (error);
+
+  bool shaped = reply && reply->bounding_shaped;
+  free (reply);
+  return shaped;
+}
+
+
+// Requests sent before reading replies, so the cookies fit on the stack.
+#define GET_WINDOWS_BATCH 256
+
+void
+compzillaXcb::GetWindows (Display *dpy,
+                          const Window *windows,
+                          PRUint32 count,
+                          XWindowAttributes *attrs,
+                          bool *shaped,
+                          bool *found)
+{
+  AttributesCookie cookies[GET_WINDOWS_BATCH];
+#if HAVE_XSHAPE
+  xcb_shape_query_extents_cookie_t shapeCookies[GET_WINDOWS_BATCH];
+#endif
+
+  for (PRUint32 start = 0; start < count; start += GET_WINDOWS_BATCH) {
+    PRUint32 n = PR_MIN (count - start, GET_WINDOWS_BATCH);
+
+    for (PRUint32 i = 0; i < n; i++) {
+      cookies[i] = RequestAttributes (dpy, windows[start + i]);
+#if HAVE_XSHAPE
+      shapeCookies[i] = RequestShaped (dpy, windows[start + i]);
+#endif
+    }
+
+    for (PRUint32 i = 0; i < n; i++) {
+      found[start + i] = GetAttributes (dpy, cookies[i], &attrs[start + i]);
+#if HAVE_XSHAPE
+      shaped[start + i] = GetShaped (dpy, shapeCookies[i]);
+#else
+      shaped[start + i] = false;
+#endif
+    }
+  }
+}
+
+
+bool
+compzillaXcb::GetAttributes (Display *dpy,
+                             AttributesCookie cookie,
+                             XWindowAttributes *attrs)
+{
+  xcb_generic_error_t *error;
+
+  xcb_get_window_attributes_reply_t *attrReply =
+    (xcb_get_window_attributes_reply_t *)
+    WaitForReply (dpy, cookie.mAttributes.sequence, &error);
+  free (error);
+
+  xcb_get_geometry_reply_t *geomReply = (xcb_get_geometry_reply_t *)
+    WaitForReply (dpy, cookie.mGeometry.sequence, &error);
+  free (error);
+
+  if (!attrReply || !geomReply) {
+    free (attrReply);
+    free (geomReply);
+    return false;
+  }
+
+  attrs->x = geomReply->x;
+  attrs->y = geomReply->y;
+  attrs->width = geomReply->width;
+  attrs->height = geomReply->height;
+  attrs->border_width = geomReply->border_width;
+  attrs->depth = geomReply->depth;
+  attrs->root = geomReply->root;
+  attrs->screen = FindScreen (dpy, geomReply->root);
+
+  attrs->visual = FindVisual (dpy, attrReply->visual);
+  attrs->c_class = attrReply->_class;
+  attrs->bit_gravity = attrReply->bit_gravity;
+  attrs->win_gravity = attrReply->win_gravity;
+  attrs->backing_store = attrReply->backing_store;
+  attrs->backing_planes = attrReply->backing_planes;
+  attrs->backing_pixel = attrReply->backing_pixel;
+  attrs->save_under = attrReply->save_under;
+  attrs->colormap = attrReply->colormap;
+  attrs->map_installed = attrReply->map_is_installed;
+  attrs->map_state = attrReply->map_state;
+  attrs->all_event_masks = attrReply->all_event_masks;
+  attrs->your_event_mask = attrReply->your_event_mask;
+  attrs->do_not_propagate_mask = attrReply->do_not_propagate_mask;
+  attrs->override_redirect = attrReply->override_redirect;
+
+  free (attrReply);
+  free (geomReply);
+  return true;
+}
+
+
+Screen *
+compzillaXcb::FindScreen (Display *dpy, Window root)
+{
+  for (int i = 0; i < ScreenCount (dpy); i++) {
+    if (RootWindow (dpy, i) == root)
+      return ScreenOfDisplay (dpy, i);
+  }
+  return DefaultScreenOfDisplay (dpy);
+}
+
+
+/*
+ * Xlib keeps every screen's visuals, so this needs no request.  Windows
+ * with an InputOnly class report visual 0 and get the default.
+ */
+Visual *
+compzillaXcb::FindVisual (Display *dpy, VisualID id)
+{
+  for (int i = 0; i < ScreenCount (dpy); i++) {
+    Screen *screen = ScreenOfDisplay (dpy, i);
+    for (int d = 0; d < screen->ndepths; d++) {
+      Depth *depth = &screen->depths[d];
+      for (int v = 0; v < depth->nvisuals; v++) {
+        if (depth->visuals[v].visualid == id)
+          return &depth->visuals[v];
+      }
+    }
+  }
+  return DefaultVisual (dpy, DefaultScreen (dpy));
+}
+
+
+xcb_get_property_cookie_t
+compzillaPropertyReply::Request (Display *dpy,
+                                 Window win,
+                                 Atom prop,
+                                 Atom type,
+                                 PRUint32 length)
+{
+  return Request (dpy, win, prop, type, 0, length);
+}
+
+
+xcb_get_property_cookie_t
+compzillaPropertyReply::Request (Display *dpy,
+                                 Window win,
+                                 Atom prop,
+                                 Atom type,
+                                 PRUint32 offset,
+                                 PRUint32 length)
+{
+  return xcb_get_property (XGetXCBConnection (dpy), false, win, prop,
+                           type == AnyPropertyType ? XCB_GET_PROPERTY_TYPE_ANY : type,
+                           offset, length);
+}
+
+
+bool
+compzillaPropertyReply::Get (Display *dpy, xcb_get_property_cookie_t cookie)
+{
+  free (mReply);
+
+  xcb_generic_error_t *error;
+  mReply = (xcb_get_property_reply_t *)
+    compzillaXcb::WaitForReply (dpy, cookie.sequence, &error);
+  free (error);
+
+  if (mReply && mReply->type == None) {
+    free (mReply);
+    mReply = NULL;
+  }
+
+  return mReply != NULL;
+}
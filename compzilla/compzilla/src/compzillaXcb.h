@@ -0,0 +1,117 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+#ifndef compzillaXcb_h___
+#define compzillaXcb_h___
+
+
+#include <prtypes.h>
+
+extern "C" {
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/shape.h>
+}
+
+
+/*
+ * XCB requests on GDK's Xlib connection.  Requests are sent as cookies and
+ * their replies collected later, so several requests can share one round
+ * trip.  Errors come back with the reply instead of going to the Xlib
+ * error handler, so no error trap is needed.
+ *
+ * RoundTrips counts the times compzilla blocked waiting for the server, to
+ * measure how many requests are still synchronous.
+ */
+class compzillaXcb
+{
+public:
+    struct AttributesCookie {
+        xcb_get_window_attributes_cookie_t mAttributes;
+        xcb_get_geometry_cookie_t mGeometry;
+    };
+
+    static AttributesCookie RequestAttributes (Display *dpy, Window win);
+
+    // Fill attrs with the replies, like XGetWindowAttributes.  Returns false
+    // if the window is gone.
+    static bool GetAttributes (Display *dpy,
+                               AttributesCookie cookie,
+                               XWindowAttributes *attrs);
+
+    // Whether win has a bounding shape set.  False if the window is gone.
+    static xcb_shape_query_extents_cookie_t RequestShaped (Display *dpy,
+                                                           Window win);
+    static bool GetShaped (Display *dpy,
+                           xcb_shape_query_extents_cookie_t cookie);
+
+    // Attributes and shapes of count windows.  Requests for up to 256 are
+    // sent before any reply is read, so each 256 cost one round trip.
+    // found[i] is false for windows that are gone.
+    static void GetWindows (Display *dpy,
+                            const Window *windows,
+                            PRUint32 count,
+                            XWindowAttributes *attrs,
+                            bool *shaped,
+                            bool *found);
+
+    // The reply to sequence, waiting for it if it hasn't arrived yet.  Free
+    // the result, and the error if set, with free().
+    static void *WaitForReply (Display *dpy,
+                               unsigned int sequence,
+                               xcb_generic_error_t **error);
+
+    // For the blocking Xlib calls left.
+    static void CountRoundTrip () { sRoundTrips++; }
+    static PRUint32 RoundTrips () { return sRoundTrips; }
+
+private:
+    static Visual *FindVisual (Display *dpy, VisualID id);
+    static Screen *FindScreen (Display *dpy, Window root);
+
+    static PRUint32 sRoundTrips;
+};
+
+
+/*
+ * A window property fetched with XCB.  Format 32 values are 32 bits wide,
+ * not longs as with XGetWindowProperty.
+ */
+class compzillaPropertyReply
+{
+public:
+    compzillaPropertyReply () : mReply(NULL) { }
+    ~compzillaPropertyReply () { free (mReply); }
+
+    // length is in 32 bit units, as for XGetWindowProperty.
+    static xcb_get_property_cookie_t Request (Display *dpy,
+                                              Window win,
+                                              Atom prop,
+                                              Atom type,
+                                              PRUint32 length);
+    // Part of the value, offset is in 32 bit units too.
+    static xcb_get_property_cookie_t Request (Display *dpy,
+                                              Window win,
+                                              Atom prop,
+                                              Atom type,
+                                              PRUint32 offset,
+                                              PRUint32 length);
+
+    // Returns false if the property or window doesn't exist.
+    bool Get (Display *dpy, xcb_get_property_cookie_t cookie);
+
+    Atom Type () { return mReply->type; }
+    int Format () { return mReply->format; }
+    // Size of the value in bytes, and in items of Format bits.
+    PRUint32 Length () { return xcb_get_property_value_length (mReply); }
+    PRUint32 Count () { return mReply->value_len; }
+    // Bytes left past the part requested.
+    PRUint32 BytesAfter () { return mReply->bytes_after; }
+    void *Value () { return xcb_get_property_value (mReply); }
+
+private:
+    xcb_get_property_reply_t *mReply;
+};
+
+
+#endif
@@ -0,0 +1,184 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * Times adopting the windows that exist when compzilla starts: once the
+ * way AddWindow does it, a window at a time, and once the way AdoptWindows
+ * does, all together.  Setting a window up is stood in for by selecting
+ * its events, and ends in a sync, as the error trap around it does.
+ *
+ * Runs on $DISPLAY, or on an Xvfb started for it if that can't be opened.
+ *
+ * Usage: adoptBench [windows]
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <prinrval.h>
+
+#include "compzillaXcb.h"
+
+
+static pid_t sXvfb = 0;
+
+
+/*
+ * Xvfb picks a free display and writes its number to -displayfd once it
+ * accepts connections.
+ */
+static Display *
+StartXvfb ()
+{
+  int fds[2];
+  if (pipe (fds) < 0)
+    return NULL;
+
+  sXvfb = fork ();
+  if (sXvfb < 0)
+    return NULL;
+
+  if (sXvfb == 0) {
+    char fd[16];
+    snprintf (fd, sizeof (fd), "%d", fds[1]);
+    close (fds[0]);
+    execlp ("Xvfb", "Xvfb", "-displayfd", fd, "-nolisten", "tcp",
+            "-screen", "0", "1024x768x24", (char *) NULL);
+    _exit (127);
+  }
+
+  close (fds[1]);
+  char number[16] = { 0 };
+  ssize_t length = read (fds[0], number, sizeof (number) - 1);
+  close (fds[0]);
+  if (length <= 0)
+    return NULL;
+
+  char name[32];
+  snprintf (name, sizeof (name), ":%d", atoi (number));
+  return XOpenDisplay (name);
+}
+
+
+static void
+StopXvfb ()
+{
+  if (sXvfb > 0) {
+    kill (sXvfb, SIGTERM);
+    waitpid (sXvfb, NULL, 0);
+  }
+}
+
+
+static void
+SetUp (Display *dpy, Window win)
+{
+  XSelectInput (dpy, win, PropertyChangeMask | EnterWindowMask | FocusChangeMask);
+}
+
+
+static void
+AdoptOneByOne (Display *dpy, Window *windows, PRUint32 count)
+{
+  for (PRUint32 i = 0; i < count; i++) {
+    XWindowAttributes attrs;
+    bool shaped, found;
+    compzillaXcb::GetWindows (dpy, &windows[i], 1, &attrs, &shaped, &found);
+    if (!found)
+      continue;
+
+    SetUp (dpy, windows[i]);
+
+    compzillaXcb::CountRoundTrip ();
+    XSync (dpy, False);
+  }
+}
+
+
+static void
+AdoptAll (Display *dpy, Window *windows, PRUint32 count)
+{
+  XWindowAttributes *attrs = new XWindowAttributes[count];
+  bool *shaped = new bool[count];
+  bool *found = new bool[count];
+
+  compzillaXcb::GetWindows (dpy, windows, count, attrs, shaped, found);
+
+  for (PRUint32 i = 0; i < count; i++) {
+    if (found[i])
+      SetUp (dpy, windows[i]);
+  }
+
+  compzillaXcb::CountRoundTrip ();
+  XSync (dpy, False);
+
+  delete[] attrs;
+  delete[] shaped;
+  delete[] found;
+}
+
+
+static void
+Report (const char *path, PRUint32 count, PRUint32 roundTrips, PRIntervalTime start)
+{
+  printf ("%-14s %8u %12u %9.3f ms\n", path, count, roundTrips,
+          PR_IntervalToMicroseconds (PR_IntervalNow () - start) / 1000.0);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  PRUint32 count = argc > 1 ? strtoul (argv[1], NULL, 0) : 500;
+
+  Display *dpy = XOpenDisplay (NULL);
+  if (!dpy)
+    dpy = StartXvfb ();
+  if (!dpy) {
+    fprintf (stderr, "Can't open $DISPLAY or start Xvfb\n");
+    StopXvfb ();
+    return 1;
+  }
+
+  Window root = DefaultRootWindow (dpy);
+
+  // Half of them mapped, as in a session with some windows minimized.
+  Window *created = new Window[count];
+  for (PRUint32 i = 0; i < count; i++) {
+    created[i] = XCreateSimpleWindow (dpy, root, i % 700, i % 500, 200, 150,
+                                      0, 0, 0);
+    if (i % 2 == 0)
+      XMapWindow (dpy, created[i]);
+  }
+  XSync (dpy, False);
+
+  // Adopt whatever the root has, as InitWindowState does.
+  Window rootReturn, parent, *children;
+  unsigned int nchildren;
+  XQueryTree (dpy, root, &rootReturn, &parent, &children, &nchildren);
+
+  printf ("%-14s %8s %12s %12s\n", "path", "windows", "round trips", "time");
+
+  PRUint32 before = compzillaXcb::RoundTrips ();
+  PRIntervalTime start = PR_IntervalNow ();
+  AdoptOneByOne (dpy, children, nchildren);
+  Report ("AddWindow", nchildren, compzillaXcb::RoundTrips () - before, start);
+
+  before = compzillaXcb::RoundTrips ();
+  start = PR_IntervalNow ();
+  AdoptAll (dpy, children, nchildren);
+  Report ("AdoptWindows", nchildren, compzillaXcb::RoundTrips () - before, start);
+
+  XFree (children);
+  for (PRUint32 i = 0; i < count; i++) {
+    XDestroyWindow (dpy, created[i]);
+  }
+  delete[] created;
+
+  XCloseDisplay (dpy);
+  StopXvfb ();
+  return 0;
+}
@@ -0,0 +1,112 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * Times unioning thousands of small rectangles into a compzillaRegion, the
+ * way damage from a busy window accumulates between frames: one UnionRect
+ * per rectangle, and all of them at once with SetRects.
+ *
+ * Usage: regionBench [rects] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <prinrval.h>
+
+#include "compzillaRegion.h"
+
+
+enum Pattern { SCATTERED, ROWS, GRID };
+
+static const char *sPatternNames[] = { "scattered", "rows", "grid" };
+
+
+/*
+ * Scattered rects land anywhere on a 1600x1200 screen, rows look like
+ * lines of text being redrawn, and grid is a tiled redraw whose rects all
+ * touch and union down to a handful of boxes.
+ */
+static void
+MakeBoxes (Pattern pattern, compzillaBox *boxes, PRUint32 count)
+{
+  for (PRUint32 i = 0; i < count; i++) {
+    compzillaBox& b = boxes[i];
+
+    switch (pattern) {
+    case SCATTERED:
+      b.x1 = rand () % 1600;
+      b.y1 = rand () % 1200;
+      b.x2 = b.x1 + 1 + rand () % 16;
+      b.y2 = b.y1 + 1 + rand () % 16;
+      break;
+    case ROWS:
+      b.x1 = (i % 100) * 9 + rand () % 4;
+      b.y1 = (i / 100) * 14 % 1200;
+      b.x2 = b.x1 + 8;
+      b.y2 = b.y1 + 12;
+      break;
+    case GRID:
+      b.x1 = (i % 64) * 16;
+      b.y1 = (i / 64) * 16 % 1200;
+      b.x2 = b.x1 + 16;
+      b.y2 = b.y1 + 16;
+      break;
+    }
+  }
+}
+
+
+static double
+Elapsed (PRIntervalTime start)
+{
+  return PR_IntervalToMicroseconds (PR_IntervalNow () - start) / 1000.0;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  PRUint32 count = argc > 1 ? strtoul (argv[1], NULL, 0) : 4000;
+  int rounds = argc > 2 ? atoi (argv[2]) : 20;
+
+  compzillaBox *boxes = new compzillaBox[count];
+  srand (1);
+
+  printf ("%-10s %8s %12s %12s %8s\n",
+          "pattern", "rects", "UnionRect", "SetRects", "boxes");
+
+  for (int p = SCATTERED; p <= GRID; p++) {
+    MakeBoxes ((Pattern) p, boxes, count);
+
+    compzillaRegion incremental, batched;
+
+    PRIntervalTime start = PR_IntervalNow ();
+    for (int round = 0; round < rounds; round++) {
+      incremental.SetEmpty ();
+      for (PRUint32 i = 0; i < count; i++) {
+        incremental.UnionRect (boxes[i].x1, boxes[i].y1,
+                               boxes[i].x2 - boxes[i].x1,
+                               boxes[i].y2 - boxes[i].y1);
+      }
+    }
+    double incrementalMs = Elapsed (start) / rounds;
+
+    start = PR_IntervalNow ();
+    for (int round = 0; round < rounds; round++)
+      batched.SetRects (boxes, count);
+    double batchedMs = Elapsed (start) / rounds;
+
+    if (!incremental.Equals (batched)) {
+      fprintf (stderr, "%s: SetRects and UnionRect disagree\n",
+               sPatternNames[p]);
+      return 1;
+    }
+
+    printf ("%-10s %8u %9.3f ms %9.3f ms %8u\n",
+            sPatternNames[p], count, incrementalMs, batchedMs,
+            batched.NumRects ());
+  }
+
+  delete[] boxes;
+  return 0;
+}
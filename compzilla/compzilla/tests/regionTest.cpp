@@ -0,0 +1,405 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * Checks compzillaRegion against a bitmap model: random regions are built
+ * on a small grid, every operation is applied to both, and the region has
+ * to cover exactly the model's pixels and keep its banding invariants.
+ *
+ * Usage: regionTest [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compzillaRegion.h"
+
+
+// The grid covers GRID_MIN..GRID_MIN + GRID_SIZE on both axes, so negative
+// coordinates and translations off the origin are covered too.
+#define GRID_MIN -32
+#define GRID_SIZE 128
+
+// Random rectangles stay inside this part of the grid, leaving room to
+// translate by up to RECT_MARGIN either way.
+#define RECT_MARGIN 24
+
+#define ITERATIONS 2000
+
+
+static int sFailures = 0;
+static int sIteration = 0;
+
+#define CHECK(cond, what)                                               \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf (stderr, "FAIL: iteration %d: %s: %s (line %d)\n",        \
+               sIteration, what, #cond, __LINE__);                      \
+      sFailures++;                                                      \
+    }                                                                   \
+  } while (0)
+
+
+class Bitmap
+{
+public:
+  Bitmap () { Clear (); }
+
+  void Clear () { memset (mBits, 0, sizeof (mBits)); }
+
+  bool Get (int x, int y) const
+  {
+    x -= GRID_MIN;
+    y -= GRID_MIN;
+    if (x < 0 || y < 0 || x >= GRID_SIZE || y >= GRID_SIZE)
+      return false;
+    return mBits[y][x];
+  }
+
+  void Fill (int x1, int y1, int x2, int y2, bool value)
+  {
+    for (int y = PR_MAX (y1, GRID_MIN); y < PR_MIN (y2, GRID_MIN + GRID_SIZE); y++) {
+      for (int x = PR_MAX (x1, GRID_MIN); x < PR_MIN (x2, GRID_MIN + GRID_SIZE); x++)
+        mBits[y - GRID_MIN][x - GRID_MIN] = value;
+    }
+  }
+
+  void FromRegion (const compzillaRegion& region)
+  {
+    Clear ();
+    for (PRUint32 i = 0; i < region.NumRects (); i++) {
+      const compzillaBox& b = region.Rects ()[i];
+      Fill (b.x1, b.y1, b.x2, b.y2, true);
+    }
+  }
+
+  bool mBits[GRID_SIZE][GRID_SIZE];
+};
+
+
+static void
+RandomBox (compzillaBox *box)
+{
+  int span = GRID_SIZE - 2 * RECT_MARGIN;
+
+  box->x1 = GRID_MIN + RECT_MARGIN + rand () % span;
+  box->y1 = GRID_MIN + RECT_MARGIN + rand () % span;
+  box->x2 = PR_MIN (box->x1 + 1 + rand () % 24, GRID_MIN + GRID_SIZE - RECT_MARGIN);
+  box->y2 = PR_MIN (box->y1 + 1 + rand () % 24, GRID_MIN + GRID_SIZE - RECT_MARGIN);
+}
+
+
+static void
+RandomRegion (compzillaRegion *region, Bitmap *model)
+{
+  region->SetEmpty ();
+  model->Clear ();
+
+  int count = rand () % 12;
+  for (int i = 0; i < count; i++) {
+    compzillaBox box;
+    RandomBox (&box);
+    region->UnionRect (box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+    model->Fill (box.x1, box.y1, box.x2, box.y2, true);
+  }
+}
+
+
+static bool
+SameBoxes (const compzillaBox *a, const compzillaBox *b, PRUint32 count)
+{
+  for (PRUint32 i = 0; i < count; i++) {
+    if (a[i].x1 != b[i].x1 || a[i].x2 != b[i].x2)
+      return false;
+  }
+  return true;
+}
+
+
+/*
+ * The region's boxes are y-x banded, bands are coalesced, and the extents
+ * are the bounding box.  With banded false only checks that boxes are
+ * non-empty, disjoint and inside the extents, which is all Simplify keeps.
+ */
+static void
+CheckStructure (const compzillaRegion& region, bool banded, const char *what)
+{
+  const compzillaBox *r = region.Rects ();
+  PRUint32 n = region.NumRects ();
+
+  if (n == 0)
+    return;
+
+  compzillaBox ext = r[0];
+  for (PRUint32 i = 0; i < n; i++) {
+    CHECK (r[i].x1 < r[i].x2 && r[i].y1 < r[i].y2, what);
+    ext.x1 = PR_MIN (ext.x1, r[i].x1);
+    ext.y1 = PR_MIN (ext.y1, r[i].y1);
+    ext.x2 = PR_MAX (ext.x2, r[i].x2);
+    ext.y2 = PR_MAX (ext.y2, r[i].y2);
+
+    if (!banded) {
+      for (PRUint32 j = i + 1; j < n; j++) {
+        CHECK (r[i].x2 <= r[j].x1 || r[j].x2 <= r[i].x1 ||
+               r[i].y2 <= r[j].y1 || r[j].y2 <= r[i].y1, what);
+      }
+    }
+  }
+
+  const compzillaBox& e = region.Extents ();
+  CHECK (e.x1 == ext.x1 && e.y1 == ext.y1 && e.x2 == ext.x2 && e.y2 == ext.y2,
+         what);
+
+  if (!banded)
+    return;
+
+  PRUint32 prevStart = 0, prevCount = 0;
+  for (PRUint32 i = 0; i < n; ) {
+    PRUint32 j = i + 1;
+    while (j < n && r[j].y1 == r[i].y1) {
+      CHECK (r[j].y2 == r[i].y2, what);
+      CHECK (r[j].x1 > r[j - 1].x2, what);
+      j++;
+    }
+
+    if (i > 0) {
+      CHECK (r[i].y1 >= r[prevStart].y2, what);
+
+      // Touching bands with the same boxes should have been coalesced.
+      CHECK (!(r[i].y1 == r[prevStart].y2 &&
+               j - i == prevCount &&
+               SameBoxes (r + i, r + prevStart, prevCount)), what);
+    }
+
+    prevStart = i;
+    prevCount = j - i;
+    i = j;
+  }
+}
+
+
+static void
+CheckRegion (const compzillaRegion& region, const Bitmap& model, const char *what)
+{
+  CheckStructure (region, true, what);
+
+  Bitmap actual;
+  actual.FromRegion (region);
+  CHECK (memcmp (actual.mBits, model.mBits, sizeof (model.mBits)) == 0, what);
+
+  bool empty = true;
+  for (int y = 0; y < GRID_SIZE; y++) {
+    for (int x = 0; x < GRID_SIZE; x++)
+      empty = empty && !model.mBits[y][x];
+  }
+  CHECK (region.IsEmpty () == empty, what);
+
+  // Spot check the point queries.
+  for (int i = 0; i < 16; i++) {
+    int x = GRID_MIN + rand () % GRID_SIZE;
+    int y = GRID_MIN + rand () % GRID_SIZE;
+    CHECK (region.Contains (x, y) == model.Get (x, y), what);
+  }
+}
+
+
+static void
+TestOps ()
+{
+  compzillaRegion a, b;
+  Bitmap ma, mb;
+
+  RandomRegion (&a, &ma);
+  RandomRegion (&b, &mb);
+  CheckRegion (a, ma, "UnionRect");
+  CheckRegion (b, mb, "UnionRect");
+
+  compzillaRegion r;
+  Bitmap m;
+
+  r = a;
+  CHECK (r.Union (b), "Union");
+  for (int y = 0; y < GRID_SIZE; y++) {
+    for (int x = 0; x < GRID_SIZE; x++)
+      m.mBits[y][x] = ma.mBits[y][x] || mb.mBits[y][x];
+  }
+  CheckRegion (r, m, "Union");
+
+  r = a;
+  CHECK (r.Intersect (b), "Intersect");
+  for (int y = 0; y < GRID_SIZE; y++) {
+    for (int x = 0; x < GRID_SIZE; x++)
+      m.mBits[y][x] = ma.mBits[y][x] && mb.mBits[y][x];
+  }
+  CheckRegion (r, m, "Intersect");
+
+  r = a;
+  CHECK (r.Subtract (b), "Subtract");
+  for (int y = 0; y < GRID_SIZE; y++) {
+    for (int x = 0; x < GRID_SIZE; x++)
+      m.mBits[y][x] = ma.mBits[y][x] && !mb.mBits[y][x];
+  }
+  CheckRegion (r, m, "Subtract");
+
+  compzillaBox box;
+  RandomBox (&box);
+
+  r = a;
+  m = ma;
+  CHECK (r.IntersectRect (box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1),
+         "IntersectRect");
+  m.Fill (GRID_MIN, GRID_MIN, GRID_MIN + GRID_SIZE, box.y1, false);
+  m.Fill (GRID_MIN, box.y2, GRID_MIN + GRID_SIZE, GRID_MIN + GRID_SIZE, false);
+  m.Fill (GRID_MIN, GRID_MIN, box.x1, GRID_MIN + GRID_SIZE, false);
+  m.Fill (box.x2, GRID_MIN, GRID_MIN + GRID_SIZE, GRID_MIN + GRID_SIZE, false);
+  CheckRegion (r, m, "IntersectRect");
+
+  r = a;
+  m = ma;
+  CHECK (r.SubtractRect (box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1),
+         "SubtractRect");
+  m.Fill (box.x1, box.y1, box.x2, box.y2, false);
+  CheckRegion (r, m, "SubtractRect");
+
+  bool covered = true, touched = false;
+  for (int y = box.y1; y < box.y2; y++) {
+    for (int x = box.x1; x < box.x2; x++) {
+      covered = covered && ma.Get (x, y);
+      touched = touched || ma.Get (x, y);
+    }
+  }
+  CHECK (a.ContainsBox (box) == covered, "ContainsBox");
+  CHECK (a.Intersects (box) == touched, "Intersects");
+
+  // Translate, and back again.
+  int dx = rand () % (2 * RECT_MARGIN + 1) - RECT_MARGIN;
+  int dy = rand () % (2 * RECT_MARGIN + 1) - RECT_MARGIN;
+  r = a;
+  r.Translate (dx, dy);
+  m.Clear ();
+  for (int y = GRID_MIN; y < GRID_MIN + GRID_SIZE; y++) {
+    for (int x = GRID_MIN; x < GRID_MIN + GRID_SIZE; x++) {
+      if (ma.Get (x, y))
+        m.Fill (x + dx, y + dy, x + dx + 1, y + dy + 1, true);
+    }
+  }
+  CheckRegion (r, m, "Translate");
+  r.Translate (-dx, -dy);
+  CHECK (r.Equals (a), "Translate");
+
+  // Building from unsorted boxes in one go matches unioning them one by one.
+  compzillaBox boxes[32];
+  PRUint32 count = rand () % 32;
+  m.Clear ();
+  for (PRUint32 i = 0; i < count; i++) {
+    RandomBox (&boxes[i]);
+    m.Fill (boxes[i].x1, boxes[i].y1, boxes[i].x2, boxes[i].y2, true);
+  }
+  CHECK (r.SetRects (boxes, count), "SetRects");
+  CheckRegion (r, m, "SetRects");
+
+  // Equals is exact, so equal coverage has to mean equal boxes.
+  compzillaRegion copy;
+  for (PRUint32 i = 0; i < count; i++) {
+    copy.UnionRect (boxes[count - 1 - i].x1, boxes[count - 1 - i].y1,
+                    boxes[count - 1 - i].x2 - boxes[count - 1 - i].x1,
+                    boxes[count - 1 - i].y2 - boxes[count - 1 - i].y1);
+  }
+  CHECK (copy.Equals (r), "Equals");
+}
+
+
+static void
+TestSimplify ()
+{
+  compzillaRegion a;
+  Bitmap ma;
+  RandomRegion (&a, &ma);
+
+  PRUint32 maxRects = 1 + rand () % 6;
+  compzillaRegion r = a;
+  CHECK (r.Simplify (maxRects), "Simplify");
+  CHECK (r.NumRects () <= maxRects, "Simplify");
+  CheckStructure (r, false, "Simplify");
+
+  // Covers the original, and stays inside its extents.
+  Bitmap m;
+  m.FromRegion (r);
+  const compzillaBox& e = a.Extents ();
+  for (int y = GRID_MIN; y < GRID_MIN + GRID_SIZE; y++) {
+    for (int x = GRID_MIN; x < GRID_MIN + GRID_SIZE; x++) {
+      if (ma.Get (x, y))
+        CHECK (m.Get (x, y), "Simplify covers");
+      if (m.Get (x, y))
+        CHECK (!a.IsEmpty () && x >= e.x1 && x < e.x2 && y >= e.y1 && y < e.y2,
+               "Simplify extents");
+    }
+  }
+
+  // Already small enough is left alone.
+  r = a;
+  CHECK (r.Simplify (a.NumRects ()), "Simplify");
+  CHECK (r.Equals (a), "Simplify no-op");
+}
+
+
+static void
+TestEdgeCases ()
+{
+  compzillaRegion r (0, 0, 10, 10);
+  Bitmap m;
+
+  // Empty rectangles change nothing.
+  m.Fill (0, 0, 10, 10, true);
+  r.UnionRect (20, 20, 0, 5);
+  r.UnionRect (20, 20, 5, -1);
+  CheckRegion (r, m, "empty UnionRect");
+
+  r.IntersectRect (5, 5, 0, 0);
+  m.Clear ();
+  CheckRegion (r, m, "empty IntersectRect");
+
+  // Touching rectangles merge into one box.
+  r.SetRect (0, 0, 10, 10);
+  r.UnionRect (10, 0, 10, 10);
+  r.UnionRect (0, 10, 20, 10);
+  CHECK (r.NumRects () == 1, "touching union");
+
+  // Subtracting everything leaves an empty region.
+  r.Subtract (compzillaRegion (-5, -5, 40, 40));
+  CHECK (r.IsEmpty (), "subtract all");
+
+  // Self operations.
+  r.SetRect (0, 0, 10, 10);
+  r.UnionRect (20, 0, 10, 10);
+  compzillaRegion copy = r;
+  r.Union (r);
+  CHECK (r.Equals (copy), "self union");
+  r.Intersect (r);
+  CHECK (r.Equals (copy), "self intersect");
+  r.Subtract (r);
+  CHECK (r.IsEmpty (), "self subtract");
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned seed = argc > 1 ? strtoul (argv[1], NULL, 0) : 1;
+  srand (seed);
+
+  TestEdgeCases ();
+
+  for (sIteration = 0; sIteration < ITERATIONS; sIteration++) {
+    TestOps ();
+    TestSimplify ();
+  }
+
+  if (sFailures) {
+    fprintf (stderr, "%d checks failed (seed %u)\n", sFailures, seed);
+    return 1;
+  }
+
+  printf ("regionTest: %d iterations passed (seed %u)\n", ITERATIONS, seed);
+  return 0;
+}
@@ -0,0 +1,240 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * Times compzillaWindowIndex against the nsRefPtrHashtable it replaced,
+ * replaying a stream of window lookups, adds and removes.
+ *
+ * The stream is read from a log of a session run with DEBUG_EVENTS, where
+ * the index logs every operation as "index: <op> <xid>".  Without a log a
+ * stream is made up: a few clients creating windows with sequential XIDs,
+ * events for windows we don't manage about a third of the time, and
+ * windows coming and going.
+ *
+ * Usage: windowIndexBench [log] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <prinrval.h>
+
+#include <nsHashKeys.h>
+#include <nsRefPtrHashtable.h>
+
+#include "windowStub.h"
+#include "compzillaWindowIndex.cpp"
+
+
+#define WINDOWS 256
+
+
+struct Op
+{
+  char op;
+  Window xid;
+};
+
+
+static compzillaWindow sWindows[WINDOWS];
+
+
+static compzillaWindow *
+WindowFor (Window xid)
+{
+  return &sWindows[xid % WINDOWS];
+}
+
+
+static bool
+ReadLog (const char *path, nsTArray<Op>& ops)
+{
+  FILE *log = fopen (path, "r");
+  if (!log) {
+    perror (path);
+    return false;
+  }
+
+  char line[512];
+  while (fgets (line, sizeof (line), log)) {
+    const char *found = strstr (line, "index: ");
+    Op op;
+    unsigned long xid;
+
+    if (found && sscanf (found, "index: %c %lx", &op.op, &xid) == 2) {
+      op.xid = xid;
+      ops.AppendElement (op);
+    }
+  }
+
+  fclose (log);
+  return true;
+}
+
+
+static void
+AppendOp (nsTArray<Op>& ops, char op, Window xid)
+{
+  Op o = { op, xid };
+  ops.AppendElement (o);
+}
+
+
+static void
+MakeStream (nsTArray<Op>& ops)
+{
+  const int clients = 8;
+  Window next[clients];
+  nsTArray<Window> managed;
+
+  srand (1);
+
+  for (int c = 0; c < clients; c++) {
+    next[c] = ((c + 1) << 21) | 1;
+    for (int i = 0; i < 8; i++) {
+      // Each client window has an unmanaged sibling or two.
+      Window xid = next[c];
+      next[c] += 1 + rand () % 3;
+      managed.AppendElement (xid);
+      AppendOp (ops, '+', xid);
+    }
+  }
+
+  for (int n = 0; n < 500000; n++) {
+    int r = rand () % 100;
+
+    if (r < 65) {
+      AppendOp (ops, '?', managed[rand () % managed.Length ()]);
+    } else if (r < 98) {
+      int c = rand () % clients;
+      AppendOp (ops, '?', (next[c] & ~0x1fffffUL) | (rand () % (next[c] & 0x1fffff)));
+    } else {
+      // A window goes away and its client makes another.
+      PRUint32 i = rand () % managed.Length ();
+      AppendOp (ops, '-', managed[i]);
+
+      int c = rand () % clients;
+      managed[i] = next[c];
+      next[c] += 1 + rand () % 3;
+      AppendOp (ops, '+', managed[i]);
+    }
+  }
+}
+
+
+static double
+Elapsed (PRIntervalTime start)
+{
+  return PR_IntervalToMicroseconds (PR_IntervalNow () - start) / 1000.0;
+}
+
+
+static PRUint32
+ReplayIndex (const nsTArray<Op>& ops)
+{
+  compzillaWindowIndex index;
+  index.Init (50);
+
+  PRUint32 hits = 0;
+  for (PRUint32 i = 0; i < ops.Length (); i++) {
+    const Op& op = ops[i];
+
+    switch (op.op) {
+    case '?':
+      hits += index.Get (op.xid) != NULL;
+      break;
+    case 'o':
+      hits += index.GetOwner (op.xid) != NULL;
+      break;
+    case '+':
+      index.Put (op.xid, WindowFor (op.xid));
+      break;
+    case 'a':
+      index.PutAlias (op.xid, WindowFor (op.xid));
+      break;
+    case '-':
+      index.Remove (op.xid);
+      break;
+    case 'r':
+      index.RemoveAlias (op.xid, WindowFor (op.xid));
+      break;
+    }
+  }
+
+  return hits;
+}
+
+
+/*
+ * The old table had no aliases, so they are treated as plain adds and
+ * removes, and GetOwner as Get.
+ */
+static PRUint32
+ReplayHashtable (const nsTArray<Op>& ops)
+{
+  nsRefPtrHashtable<nsUint32HashKey, compzillaWindow> table;
+  table.Init (50);
+
+  PRUint32 hits = 0;
+  for (PRUint32 i = 0; i < ops.Length (); i++) {
+    const Op& op = ops[i];
+
+    switch (op.op) {
+    case '?':
+    case 'o':
+      hits += table.GetWeak (op.xid) != NULL;
+      break;
+    case '+':
+    case 'a':
+      table.Put (op.xid, WindowFor (op.xid));
+      break;
+    case '-':
+    case 'r':
+      table.Remove (op.xid);
+      break;
+    }
+  }
+
+  return hits;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  nsTArray<Op> ops;
+
+  if (argc > 1 && strcmp (argv[1], "-") != 0) {
+    if (!ReadLog (argv[1], ops))
+      return 1;
+  } else {
+    MakeStream (ops);
+  }
+
+  int rounds = argc > 2 ? atoi (argv[2]) : 20;
+
+  if (ops.IsEmpty ()) {
+    fprintf (stderr, "No index operations found\n");
+    return 1;
+  }
+
+  PRUint32 indexHits = 0, tableHits = 0;
+
+  PRIntervalTime start = PR_IntervalNow ();
+  for (int round = 0; round < rounds; round++)
+    indexHits = ReplayIndex (ops);
+  double indexMs = Elapsed (start) / rounds;
+
+  start = PR_IntervalNow ();
+  for (int round = 0; round < rounds; round++)
+    tableHits = ReplayHashtable (ops);
+  double tableMs = Elapsed (start) / rounds;
+
+  printf ("%-20s %8s %12s %8s\n", "table", "ops", "time", "hits");
+  printf ("%-20s %8u %9.3f ms %8u\n",
+          "compzillaWindowIndex", ops.Length (), indexMs, indexHits);
+  printf ("%-20s %8u %9.3f ms %8u\n",
+          "nsRefPtrHashtable", ops.Length (), tableMs, tableHits);
+
+  return 0;
+}
@@ -0,0 +1,291 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * Checks compzillaWindowIndex: probing that wraps around the end of the
+ * table, backward shift removal, aliases, and random churn against a
+ * std::map, with every window's reference count kept balanced.
+ *
+ * Usage: windowIndexTest [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <vector>
+
+#include "windowStub.h"
+#include "compzillaWindowIndex.cpp"
+
+
+#define WINDOWS 64
+#define OPERATIONS 200000
+
+
+static int sFailures = 0;
+
+#define CHECK(cond, what)                                               \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf (stderr, "FAIL: %s: %s (line %d)\n", what, #cond, __LINE__); \
+      sFailures++;                                                      \
+    }                                                                   \
+  } while (0)
+
+
+static compzillaWindow sWindows[WINDOWS];
+
+
+static PRUint32
+Home (Window xid, PRUint32 capacity)
+{
+  return (PRUint32 (xid) * XID_HASH_MULTIPLIER) & (capacity - 1);
+}
+
+
+// The next XID after from whose home slot in a table of capacity is slot.
+static Window
+XidAt (PRUint32 slot, PRUint32 capacity, Window from)
+{
+  Window xid = from + 1;
+  while (Home (xid, capacity) != slot)
+    xid++;
+  return xid;
+}
+
+
+static void
+CheckRefs (const char *what, PRUint32 *expected)
+{
+  for (int i = 0; i < WINDOWS; i++)
+    CHECK (sWindows[i].mRefCnt == expected[i], what);
+}
+
+
+/*
+ * Fill a chain running off the end of the table and back to the start,
+ * then take entries out of it in every position.
+ */
+static void
+TestWraparound ()
+{
+  const PRUint32 capacity = 16;
+
+  for (int victim = 0; victim < 5; victim++) {
+    compzillaWindowIndex index;
+    CHECK (index.Init (capacity), "wraparound Init");
+
+    // Homes 14, 15, 15, 0, 14: they end up in slots 14, 15, 0, 1, 2.
+    Window xids[5];
+    xids[0] = XidAt (capacity - 2, capacity, 0x200000);
+    xids[1] = XidAt (capacity - 1, capacity, xids[0]);
+    xids[2] = XidAt (capacity - 1, capacity, xids[1]);
+    xids[3] = XidAt (0, capacity, xids[2]);
+    xids[4] = XidAt (capacity - 2, capacity, xids[3]);
+
+    for (int i = 0; i < 5; i++)
+      CHECK (index.Put (xids[i], &sWindows[i]), "wraparound Put");
+
+    // Nothing may grow the table, or the chain isn't where it should be.
+    CHECK (index.Count () == 5, "wraparound Count");
+
+    index.Remove (xids[victim]);
+    CHECK (index.Count () == 4, "wraparound Remove");
+    CHECK (sWindows[victim].mRefCnt == 0, "wraparound Remove releases");
+
+    for (int i = 0; i < 5; i++) {
+      if (i == victim)
+        CHECK (index.Get (xids[i]) == NULL, "wraparound removed");
+      else
+        CHECK (index.Get (xids[i]) == &sWindows[i], "wraparound kept");
+    }
+
+    // And the hole can be filled again.
+    CHECK (index.Put (xids[victim], &sWindows[victim]), "wraparound Put again");
+    for (int i = 0; i < 5; i++)
+      CHECK (index.Get (xids[i]) == &sWindows[i], "wraparound refilled");
+
+    index.Clear ();
+    CHECK (index.Count () == 0, "wraparound Clear");
+    for (int i = 0; i < 5; i++)
+      CHECK (sWindows[i].mRefCnt == 0, "wraparound Clear releases");
+  }
+}
+
+
+static void
+TestAliases ()
+{
+  compzillaWindowIndex index;
+  compzillaWindow *a = &sWindows[0];
+  compzillaWindow *b = &sWindows[1];
+
+  CHECK (index.Put (0x100, a), "Put");
+  CHECK (index.PutAlias (0x101, a), "PutAlias");
+
+  // Get only finds managed windows, GetOwner finds both.
+  CHECK (index.Get (0x101) == NULL, "Get ignores aliases");
+  CHECK (index.GetOwner (0x101) == a, "GetOwner alias");
+  CHECK (index.GetOwner (0x100) == a, "GetOwner window");
+  CHECK (index.Misses () == 1, "alias lookups are misses");
+
+  // Aliases never replace managed windows, but windows replace aliases.
+  CHECK (!index.PutAlias (0x100, b), "PutAlias over a window");
+  CHECK (index.Get (0x100) == a, "window kept");
+  CHECK (index.Put (0x101, b), "Put over an alias");
+  CHECK (index.Get (0x101) == b, "alias replaced");
+  CHECK (a->mRefCnt == 1 && b->mRefCnt == 1, "replace releases");
+
+  // Only the owner's alias is removed, and Remove leaves aliases alone.
+  CHECK (index.PutAlias (0x102, a), "PutAlias");
+  index.RemoveAlias (0x102, b);
+  CHECK (index.GetOwner (0x102) == a, "RemoveAlias other owner");
+  index.Remove (0x102);
+  CHECK (index.GetOwner (0x102) == a, "Remove skips aliases");
+  index.RemoveAlias (0x101, b);
+  CHECK (index.Get (0x101) == b, "RemoveAlias skips windows");
+  index.RemoveAlias (0x102, a);
+  CHECK (index.GetOwner (0x102) == NULL, "RemoveAlias");
+
+  CHECK (index.Count () == 2, "Count includes aliases");
+
+  // None is never a key.
+  CHECK (!index.Put (None, a), "Put None");
+  CHECK (index.Get (None) == NULL, "Get None");
+
+  index.Clear ();
+  CHECK (a->mRefCnt == 0 && b->mRefCnt == 0, "Clear releases");
+}
+
+
+struct EnumState
+{
+  std::map<Window, compzillaWindow *> seen;
+};
+
+static void
+Collect (Window xid, compzillaWindow *window, void *userdata)
+{
+  static_cast<EnumState *>(userdata)->seen[xid] = window;
+}
+
+
+/*
+ * Random puts, aliases and removes, over a few client id ranges so XIDs
+ * collide the way real ones do, compared with a std::map after each step.
+ */
+static void
+TestChurn ()
+{
+  struct Entry {
+    compzillaWindow *window;
+    bool alias;
+  };
+  std::map<Window, Entry> model;
+
+  compzillaWindowIndex index;
+  PRUint32 expectedRefs[WINDOWS] = { 0 };
+
+  for (int n = 0; n < OPERATIONS; n++) {
+    // 4 clients with 64 XIDs each.
+    Window xid = ((rand () % 4 + 1) << 21) | (rand () % 64 + 1);
+    int w = rand () % WINDOWS;
+    std::map<Window, Entry>::iterator it = model.find (xid);
+
+    switch (rand () % 6) {
+    case 0:
+    case 1:
+      CHECK (index.Put (xid, &sWindows[w]), "churn Put");
+      if (it != model.end ())
+        expectedRefs[it->second.window - sWindows]--;
+      expectedRefs[w]++;
+      model[xid].window = &sWindows[w];
+      model[xid].alias = false;
+      break;
+    case 2:
+      if (it != model.end () && !it->second.alias) {
+        CHECK (!index.PutAlias (xid, &sWindows[w]), "churn PutAlias");
+        break;
+      }
+      CHECK (index.PutAlias (xid, &sWindows[w]), "churn PutAlias");
+      if (it != model.end ())
+        expectedRefs[it->second.window - sWindows]--;
+      expectedRefs[w]++;
+      model[xid].window = &sWindows[w];
+      model[xid].alias = true;
+      break;
+    case 3:
+    case 4:
+      index.Remove (xid);
+      if (it != model.end () && !it->second.alias) {
+        expectedRefs[it->second.window - sWindows]--;
+        model.erase (it);
+      }
+      break;
+    case 5:
+      if (it != model.end () && it->second.alias) {
+        // Half the time as the wrong owner.
+        compzillaWindow *owner = rand () % 2 ? it->second.window : &sWindows[w];
+        index.RemoveAlias (xid, owner);
+        if (owner == it->second.window) {
+          expectedRefs[owner - sWindows]--;
+          model.erase (it);
+        }
+      }
+      break;
+    }
+
+    CHECK (index.Count () == model.size (), "churn Count");
+
+    // Every key that was ever used, present or not.
+    if (n % 97 == 0 || n < 1000) {
+      for (Window c = 1; c <= 4; c++) {
+        for (Window x = 1; x <= 64; x++) {
+          Window key = (c << 21) | x;
+          std::map<Window, Entry>::iterator e = model.find (key);
+          compzillaWindow *window = e == model.end () ? NULL : e->second.window;
+          bool alias = e != model.end () && e->second.alias;
+
+          CHECK (index.GetOwner (key) == window, "churn GetOwner");
+          CHECK (index.Get (key) == (alias ? NULL : window), "churn Get");
+        }
+      }
+      CheckRefs ("churn refs", expectedRefs);
+    }
+  }
+
+  EnumState state;
+  index.Enumerate (Collect, &state);
+  PRUint32 managed = 0;
+  for (std::map<Window, Entry>::iterator e = model.begin (); e != model.end (); ++e) {
+    if (!e->second.alias) {
+      managed++;
+      CHECK (state.seen[e->first] == e->second.window, "Enumerate");
+    }
+  }
+  CHECK (state.seen.size () == managed, "Enumerate skips aliases");
+
+  index.Clear ();
+  for (int i = 0; i < WINDOWS; i++)
+    CHECK (sWindows[i].mRefCnt == 0, "churn Clear releases");
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned seed = argc > 1 ? strtoul (argv[1], NULL, 0) : 1;
+  srand (seed);
+
+  TestWraparound ();
+  TestAliases ();
+  TestChurn ();
+
+  if (sFailures) {
+    fprintf (stderr, "%d checks failed (seed %u)\n", sFailures, seed);
+    return 1;
+  }
+
+  printf ("windowIndexTest: passed (seed %u)\n", seed);
+  return 0;
+}
@@ -0,0 +1,36 @@
+/* -*- mode: C++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef windowStub_h___
+#define windowStub_h___
+
+/*
+ * Stands in for compzillaWindow, so compzillaWindowIndex.cpp can be built
+ * into the checks without Gecko.  Include this, then the .cpp: the real
+ * header is skipped through its include guard.
+ */
+
+#include <prtypes.h>
+
+#define compzillaWindow_h___
+
+
+class compzillaWindow
+{
+public:
+  compzillaWindow () : mRefCnt (0) { }
+
+  PRUint32 AddRef () { return ++mRefCnt; }
+  PRUint32 Release () { return --mRefCnt; }
+
+  // Owned by the test, so dropping to zero doesn't delete it.
+  PRUint32 mRefCnt;
+};
+
+
+#ifndef NS_IF_ADDREF
+#define NS_IF_ADDREF(p) do { if (p) (p)->AddRef (); } while (0)
+#define NS_IF_RELEASE(p) do { if (p) { (p)->Release (); (p) = 0; } } while (0)
+#endif
+
+
+#endif